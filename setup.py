@@ -41,20 +41,30 @@ else:
         # it might use the regiter rbx...
         extra_compile_args += ['-g']
         extra_compile_args += ['-O2']
-        extra_source_files += ['src/vmprof_unix.c', 'src/vmprof_mt.c']
+        extra_source_files += ['src/vmprof_unix.c', 'src/vmprof_mt.c',
+                               'src/vmprof_alloc.c', 'src/vmprof_reader.c',
+                               'src/vmprof_codes.c', 'src/vmprof_compress.c',
+                               'src/vmprof_threads.c']
+        libraries += ['z']
     elif _supported_unix():
-        libraries = ['dl','unwind']
+        libraries = ['dl','unwind','z']
         extra_compile_args = ['-Wno-unused']
         if _supported_unix() == 'linux':
+            libraries += ['rt']     # timer_create() with older glibc
             extra_compile_args += ['-DVMPROF_LINUX=1']
         if _supported_unix() == 'bsd':
-            libraries = ['unwind']
+            libraries = ['unwind','z']
             extra_compile_args += ['-DVMPROF_BSD=1']
             extra_compile_args += ['-I/usr/local/include']
         extra_compile_args += ['-DVMPROF_UNIX=1']
         extra_source_files += [
            'src/vmprof_mt.c',
            'src/vmprof_unix.c',
+           'src/vmprof_alloc.c',
+           'src/vmprof_reader.c',
+           'src/vmprof_codes.c',
+           'src/vmprof_compress.c',
+           'src/vmprof_threads.c',
            'src/libbacktrace/backtrace.c',
            'src/libbacktrace/state.c',
            'src/libbacktrace/elf.c',
@@ -78,7 +88,7 @@ else:
         raise NotImplementedError("platform '%s' is not supported!" % sys.platform)
     extra_compile_args.append('-I src/')
     extra_compile_args.append('-I src/libbacktrace')
-    if sys.version_info[:2] == (3,11):
+    if sys.version_info[:2] >= (3,11):
         extra_source_files += ['src/populate_frames.c']
     ext_modules = [Extension('_vmprof',
                            sources=[
@@ -98,6 +108,11 @@ else:
                                'src/machine.h',
                                'src/vmprof.h',
                                'src/vmprof_memory.h',
+                               'src/vmprof_alloc.h',
+                               'src/vmprof_reader.h',
+                               'src/vmprof_codes.h',
+                               'src/vmprof_compress.h',
+                               'src/vmprof_threads.h',
                            ],
                            extra_compile_args=extra_compile_args,
                            libraries=libraries)]
@@ -127,7 +142,8 @@ setup(
     tests_require=['pytest','cffi','hypothesis'],
     entry_points = {
         'console_scripts': [
-            'vmprofshow = vmprof.show:main'
+            'vmprofshow = vmprof.show:main',
+            'vmprofsymbolize = vmprof.symbolize:main',
     ]},
     classifiers=[
         'License :: OSI Approved :: MIT License',
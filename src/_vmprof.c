@@ -14,7 +14,6 @@
 
 #ifndef RPYTHON_VMPROF
   #if PY_VERSION_HEX >= 0x030b00f0 /* >= 3.11 */
-  #include "internal/pycore_frame.h"
   #include "populate_frames.h"
   #endif
 #endif
@@ -27,6 +26,11 @@ static PyObject* (*_default_eval_loop)(PyFrameObject *, int) = 0;
 #include "machine.h"
 #include "symboltable.h"
 #include "vmprof_unix.h"
+#include "vmprof_alloc.h"
+#include "vmprof_reader.h"
+#include "vmprof_codes.h"
+#include "vmprof_compress.h"
+#include "vmprof_threads.h"
 #else
 #include "vmprof_win.h"
 #endif
@@ -72,6 +76,33 @@ PY_EVAL_RETURN_T * vmprof_eval(PY_STACK_FRAME_T *f, int throwflag)
 }
 #endif
 
+static int emit_line_table(PyCodeObject *co)
+{
+    /* samples only carry instruction offsets in lines mode, the reader
+       needs the line table to turn them into line numbers */
+    PyObject *table;
+    long format;
+#if PY_VERSION_HEX >= 0x030B0000 /* >= 3.11, unchanged up to 3.13 */
+    table = co->co_linetable;
+    format = LINETABLE_PY311;
+#elif PY_VERSION_HEX >= 0x030A0000 /* 3.10 */
+    table = co->co_linetable;
+    format = LINETABLE_PY310;
+#elif PY_VERSION_HEX >= 0x03060000 /* 3.6 - 3.9 */
+    table = co->co_lnotab;
+    format = LINETABLE_LNOTAB;
+#else
+    table = co->co_lnotab;
+    format = LINETABLE_LNOTAB_UNSIGNED;
+#endif
+    if (table == NULL || !PyBytes_Check(table))
+        return 0;
+    return vmprof_register_line_table(CODE_ADDR_TO_UID(co), format,
+                                      co->co_firstlineno,
+                                      PyBytes_AS_STRING(table),
+                                      (long)PyBytes_GET_SIZE(table), 500000);
+}
+
 static int emit_code_object(PyCodeObject *co)
 {
     char buf[MAX_FUNC_NAME + 1];
@@ -96,9 +127,28 @@ static int emit_code_object(PyCodeObject *co)
     if (sz > MAX_FUNC_NAME / 2) sz = MAX_FUNC_NAME / 2;
     snprintf(buf + sz, MAX_FUNC_NAME / 2, ":%d:%s", co_firstlineno,
              co_filename);
-    return vmprof_register_virtual_function(buf, CODE_ADDR_TO_UID(co), 500000);
+    if (vmprof_register_virtual_function(buf, CODE_ADDR_TO_UID(co), 500000) < 0)
+        return -1;
+    if (vmp_profiles_python_lines())
+        return emit_line_table(co);
+    return 0;
+}
+
+#ifdef VMPROF_UNIX
+static int emit_code_uid(intptr_t code_uid)
+{
+    /* ids are the addresses of code objects, see vmprof_codes.c for
+       why the object is still alive */
+    return emit_code_object((PyCodeObject *)code_uid);
 }
 
+static int emit_thread_info(intptr_t tid, const char *name,
+                            const char *native_name)
+{
+    return vmprof_register_thread_info(tid, name, native_name, 500000);
+}
+#endif
+
 static int _look_for_code_object(PyObject *o, void * param)
 {
     Py_ssize_t i;
@@ -109,7 +159,8 @@ static int _look_for_code_object(PyObject *o, void * param)
     if (PyCode_Check(o) && !PySet_Contains(all_codes, o)) {
         PyCodeObject *co = (PyCodeObject *)o;
         PyObject * id = PyLong_FromVoidPtr((void*)CODE_ADDR_TO_UID(co));
-        if (PySet_Contains(seen_codes, id)) {
+        // None: every code object there is
+        if (seen_codes == Py_None || PySet_Contains(seen_codes, id)) {
             // only emit if the code id has been seen!
             if (emit_code_object(co) < 0)
                 return -1;
@@ -174,13 +225,48 @@ void emit_all_code_objects(PyObject * seen_code_ids)
 
 static void cpyprof_code_dealloc(PyObject *co)
 {
+#ifdef VMPROF_UNIX
+    /* only code objects that were sampled and not yet written; once
+       the table overflowed a sampled one might be missing from it, and
+       the heap search of disable() does not find dead objects */
+    if (vmprof_is_enabled() && (vmp_code_freed(CODE_ADDR_TO_UID(co)) ||
+                                vmp_codes_overflowed())) {
+        emit_code_object((PyCodeObject *)co);
+        /* xxx error return values are ignored */
+    }
+#else
     if (vmprof_is_enabled()) {
         emit_code_object((PyCodeObject *)co);
         /* xxx error return values are ignored */
     }
+#endif
     Original_code_dealloc(co);
 }
 
+#ifdef VMPROF_UNIX
+static int profile_native = 0;
+static long profile_alloc_sample_bytes = 0;
+
+static void write_profile_meta(void)
+{
+    // after the header of every segment of the profile, see rotate_profile()
+    if (profile_alloc_sample_bytes > 0) {
+        char value[32];
+        snprintf(value, sizeof(value), "%ld", profile_alloc_sample_bytes);
+        vmp_write_meta("alloc_sample_bytes", value);
+    }
+    if (vmp_native_skips_interpreter()) {
+        vmp_write_meta("native_skip_interpreter", "1");
+    }
+    if (profile_native && vmp_native_unwinder() == VMP_UNWIND_FRAME_POINTER) {
+        vmp_write_meta("native_unwinder", "frame_pointer");
+    }
+    if (profile_native && vmp_native_profiles_lines()) {
+        vmp_write_meta("native_lines", "1");
+    }
+}
+#endif
+
 static PyObject *enable_vmprof(PyObject* self, PyObject *args)
 {
     int fd;
@@ -188,10 +274,19 @@ static PyObject *enable_vmprof(PyObject* self, PyObject *args)
     int lines = 0;
     int native = 0;
     int real_time = 0;
+    int per_thread = 0;
+    long alloc_sample_bytes = 0;
+    int native_skip_interpreter = 0;
+    int native_unwinder = VMP_UNWIND_LIBUNWIND;
+    int native_lines = 0;
+    int compress = 0;
+    int timestamps = 0;
     double interval;
     char *p_error;
 
-    if (!PyArg_ParseTuple(args, "id|iiii", &fd, &interval, &memory, &lines, &native, &real_time)) {
+    if (!PyArg_ParseTuple(args, "id|iiiiiliiiii", &fd, &interval, &memory, &lines, &native, &real_time,
+                          &per_thread, &alloc_sample_bytes, &native_skip_interpreter,
+                          &native_unwinder, &native_lines, &compress, &timestamps)) {
         return NULL;
     }
 
@@ -216,25 +311,93 @@ static PyObject *enable_vmprof(PyObject* self, PyObject *args)
         return NULL;
     }
 #endif
+#ifndef VMPROF_LINUX
+    if (per_thread) {
+        PyErr_SetString(PyExc_ValueError, "per-thread timers are only supported on Linux");
+        return NULL;
+    }
+#endif
+#ifdef VMPROF_UNIX
+    if (per_thread && real_time) {
+        PyErr_SetString(PyExc_ValueError, "per-thread timers measure CPU time, "
+                                          "they cannot be combined with real time profiling");
+        return NULL;
+    }
+    vmprof_set_per_thread(per_thread);
+#endif
+#ifndef VMPROF_UNIX
+    if (alloc_sample_bytes > 0) {
+        PyErr_SetString(PyExc_ValueError, "allocation sampling is not supported on this platform");
+        return NULL;
+    }
+#endif
+    if (alloc_sample_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "alloc_sample_bytes must not be negative");
+        return NULL;
+    }
+#ifdef VMPROF_UNIX
+    if (compress < 0 || compress > 9) {
+        PyErr_SetString(PyExc_ValueError, "compression level must be between 0 and 9");
+        return NULL;
+    }
+    vmp_set_compression(compress);
+    vmprof_set_timestamps(timestamps);
+#else
+    if (compress) {
+        PyErr_SetString(PyExc_ValueError, "compression is only supported on Linux and MacOS");
+        return NULL;
+    }
+    if (timestamps) {
+        PyErr_SetString(PyExc_ValueError, "timestamps are only supported on Linux and MacOS");
+        return NULL;
+    }
+#endif
+
+    if (native && vmp_native_set_unwinder(native_unwinder) < 0) {
+        PyErr_SetString(PyExc_ValueError, "this native unwinder is not supported on this platform");
+        return NULL;
+    }
 
     vmp_profile_lines(lines);
+    vmp_native_skip_interpreter(native && native_skip_interpreter);
+    vmp_native_profile_lines(native && native_lines);
 
     if (!Original_code_dealloc) {
         Original_code_dealloc = PyCode_Type.tp_dealloc;
         PyCode_Type.tp_dealloc = &cpyprof_code_dealloc;
     }
 
+#ifdef VMPROF_UNIX
+    if (vmp_codes_reset(emit_code_uid) < 0 ||
+            vmp_threads_reset(emit_thread_info) < 0) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+#endif
+
     p_error = vmprof_init(fd, interval, memory, lines, "cpython", native, real_time);
     if (p_error) {
         PyErr_SetString(PyExc_ValueError, p_error);
         return NULL;
     }
 
+#ifdef VMPROF_UNIX
+    profile_native = native;
+    profile_alloc_sample_bytes = alloc_sample_bytes;
+    write_profile_meta();
+#endif
+
     if (vmprof_enable(memory, native, real_time) < 0) {
         PyErr_SetFromErrno(PyExc_OSError);
         return NULL;
     }
 
+#ifdef VMPROF_UNIX
+    if (alloc_sample_bytes > 0) {
+        vmp_alloc_enable(alloc_sample_bytes);
+    }
+#endif
+
     vmprof_set_enabled(1);
 
     Py_RETURN_NONE;
@@ -250,6 +413,9 @@ static PyObject * vmp_is_enabled(PyObject *module, PyObject *noargs) {
 static PyObject *
 disable_vmprof(PyObject *module, PyObject *noargs)
 {
+#ifdef VMPROF_UNIX
+    vmp_alloc_disable();
+#endif
     if (vmprof_disable() < 0) {
         PyErr_SetFromErrno(PyExc_OSError);
         return NULL;
@@ -267,7 +433,20 @@ static PyObject *
 write_all_code_objects(PyObject *module, PyObject * seen_code_ids)
 {
     // assumptions: signals must be disabled (see stop_sampling)
+#ifdef VMPROF_UNIX
+    // the caller is done reading the profile
+    vmp_resume_writes();
+    if (!vmp_codes_overflowed()) {
+        // every sampled code object is in the seen table, only the
+        // ones that were not written yet are left
+        vmp_codes_drain();
+    } else
+#endif
     emit_all_code_objects(seen_code_ids);
+#ifdef VMPROF_UNIX
+    if (!PyErr_Occurred())
+        vmp_threads_drain();
+#endif
 
     if (PyErr_Occurred())
         return NULL;
@@ -324,7 +503,10 @@ sample_stack_now(PyObject *module, PyObject * args)
 
     entry_count = vmp_walk_and_record_stack(frame, m, SINGLE_BUF_SIZE/sizeof(void*)-1, (int)skip, 0);
 
+#if PY_VERSION_HEX < 0x030B0000
+    // an interpreter frame is not an object, nothing was taken
     Py_XDECREF(frame);
+#endif
 
 
     for (i = 0; i < entry_count; i++) {
@@ -345,53 +527,259 @@ error:
 }
 
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
+static int
+_keep_resolved_addr(void *arg, void *addr, const char *name, int lineno, const char *srcfile) {
+    PyObject ** result = (PyObject**)arg;
+    *result = Py_BuildValue("(sis)", name, lineno, srcfile);
+    return *result == NULL ? -1 : 0;
+}
+
 static PyObject *
 resolve_addr(PyObject *module, PyObject *args) {
     long long addr;
-    PyObject * o_name = NULL;
-    PyObject * o_lineno = NULL;
-    PyObject * o_srcfile = NULL;
-    char name[128];
-    int lineno = 0;
-    char srcfile[256];
+    void * addrs[1];
+    PyObject * result = NULL;
 
     if (!PyArg_ParseTuple(args, "L", &addr)) {
         return NULL;
     }
-    name[0] = '\x00';
-    srcfile[0] = '-';
-    srcfile[1] = '\x00';
-    if (vmp_resolve_addr((void*)addr, name, 128, &lineno, srcfile, 256) != 0) {
-        goto error;
+    addrs[0] = (void*)addr;
+    if (vmp_resolve_many_addr(addrs, 1, _keep_resolved_addr, &result) < 0) {
+        return NULL;
+    }
+    if (result == NULL) {
+        Py_RETURN_NONE;
     }
+    return result;
+}
+
+static int
+_add_resolved_addr(void *arg, void *addr, const char *name, int lineno, const char *srcfile) {
+    PyObject * key = PyLong_FromVoidPtr(addr);
+    PyObject * value = NULL;
+    int res = -1;
 
-    o_name = PyStr_NEW(name);
-    if (o_name == NULL) goto error;
-    o_lineno = PyLong_NEW(lineno);
-    if (o_lineno == NULL) goto error;
-    o_srcfile = PyStr_NEW(srcfile);
-    if (o_srcfile == NULL) goto error;
-    //
-    return PyTuple_Pack(3, o_name, o_lineno, o_srcfile);
+    if (key == NULL) goto error;
+    value = Py_BuildValue("(sis)", name, lineno, srcfile);
+    if (value == NULL) goto error;
+    res = PyDict_SetItem((PyObject*)arg, key, value);
+error:
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    return res;
+}
+
+static void **
+_addr_list(PyObject *o_addrs, int *count) {
+    /* a PyMem_Malloc()ed array of the addresses in o_addrs */
+    PyObject * seq = NULL;
+    void ** addrs = NULL;
+    Py_ssize_t i, size;
+
+    seq = PySequence_Fast(o_addrs, "addresses must be iterable");
+    if (seq == NULL) {
+        return NULL;
+    }
+    size = PySequence_Fast_GET_SIZE(seq);
+    if (size > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "too many addresses");
+        goto error;
+    }
+    addrs = PyMem_Malloc((size > 0 ? size : 1) * sizeof(void*));
+    if (addrs == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < size; i++) {
+        addrs[i] = PyLong_AsVoidPtr(PySequence_Fast_GET_ITEM(seq, i));
+        if (addrs[i] == NULL && PyErr_Occurred()) {
+            PyMem_Free(addrs);
+            addrs = NULL;
+            goto error;
+        }
+    }
+    *count = (int)size;
 error:
-    Py_XDECREF(o_name);
-    Py_XDECREF(o_lineno);
-    Py_XDECREF(o_srcfile);
+    Py_DECREF(seq);
+    return addrs;
+}
+
+static PyObject *
+resolve_many_addr(PyObject *module, PyObject *o_addrs) {
+    PyObject * result = NULL;
+    void ** addrs;
+    int count;
+
+    if ((addrs = _addr_list(o_addrs, &count)) == NULL) {
+        return NULL;
+    }
+    result = PyDict_New();
+    if (result != NULL &&
+            vmp_resolve_many_addr(addrs, count, _add_resolved_addr, result) < 0) {
+        Py_CLEAR(result);
+    }
+    PyMem_Free(addrs);
+    return result;
+}
+
+static PyObject *
+resolve_file_addr(PyObject *module, PyObject *args) {
+    const char * path;
+    const char * build_id;
+    PyObject * o_addrs;
+    PyObject * result = NULL;
+    void ** addrs;
+    int count;
+
+    if (!PyArg_ParseTuple(args, "szO", &path, &build_id, &o_addrs)) {
+        return NULL;
+    }
+    if ((addrs = _addr_list(o_addrs, &count)) == NULL) {
+        return NULL;
+    }
+    result = PyDict_New();
+    if (result != NULL &&
+            vmp_resolve_file_addrs(path, build_id, addrs, count, _add_resolved_addr, result) < 0) {
+        Py_CLEAR(result);
+    }
+    PyMem_Free(addrs);
+    return result;
+}
 
+static PyObject *
+set_symbol_cache(PyObject *module, PyObject *args) {
+    const char * directory = NULL;
+
+    if (!PyArg_ParseTuple(args, "z", &directory)) {
+        return NULL;
+    }
+    if (vmp_set_symbol_cache(directory) < 0) {
+        return PyErr_NoMemory();
+    }
     Py_RETURN_NONE;
 }
+
+static PyObject *
+native_cache_stats(PyObject *module, PyObject *noargs) {
+    long hits, misses, size;
+
+    vmp_native_ip_cache_stats(&hits, &misses, &size);
+    return Py_BuildValue("(lll)", hits, misses, size);
+}
+
+/* the frame pointer walk needs the bounds of the stack of the sampled
+   thread, they can only be looked up by the thread itself */
+static int
+_register_native_thread(void) {
+    if (!vmprof_is_enabled() || !vmp_native_enabled() ||
+            vmp_native_unwinder() != VMP_UNWIND_FRAME_POINTER) {
+        return 0;
+    }
+    vmp_native_register_thread();
+    return 1;
+}
+
+static PyObject *
+register_native_thread(PyObject *module, PyObject *noargs) {
+    return PyBool_FromLong(_register_native_thread());
+}
 #endif
 
 static PyObject *
 stop_sampling(PyObject *module, PyObject *noargs)
 {
     vmprof_ignore_signals(1);
+#ifdef VMPROF_UNIX
+    /* samples still sitting in the per-thread rings (and allocation
+       samples in their partially filled buffer) must reach the file
+       before the caller starts reading it; nothing else is written
+       until write_all_code_objects() or disable() */
+    vmp_alloc_flush();
+    if (vmp_suspend_writes(vmp_profile_fileno()) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+#endif
     return PyLong_NEW(vmp_profile_fileno());
 }
 
+#ifdef VMPROF_UNIX
+static PyObject *
+rotate_profile(PyObject *module, PyObject *args)
+{
+    int fd, old_fd;
+    char trailer[VMP_TRAILER_SIZE];
+
+    if (!PyArg_ParseTuple(args, "i", &fd)) {
+        return NULL;
+    }
+    if (!vmprof_is_enabled()) {
+        PyErr_SetString(PyExc_ValueError, "vmprof is not enabled");
+        return NULL;
+    }
+    if (vmp_writes_suspended()) {
+        PyErr_SetString(PyExc_ValueError, "the profile is being read, see stop_sampling()");
+        return NULL;
+    }
+    if (fd == vmp_profile_fileno()) {
+        PyErr_SetString(PyExc_ValueError, "vmprof already writes to this file descriptor");
+        return NULL;
+    }
+    if (write(fd, NULL, 0) != 0) {
+        PyErr_SetString(PyExc_ValueError, "file descriptor must be writeable");
+        return NULL;
+    }
+    // the segment is read back when it ends
+    if (read(fd, NULL, 0) != 0) {
+        PyErr_SetString(PyExc_ValueError, "file descriptor must be readable");
+        return NULL;
+    }
+
+    // the timer keeps running, the few samples taken until the new
+    // segment is set up are ignored
+    vmprof_ignore_signals(1);
+    vmp_alloc_flush();
+    if (vmp_suspend_writes(vmp_profile_fileno()) < 0)
+        goto error;
+    // the code objects sampled so far are described in the segment that
+    // ends, the next one starts with an empty table
+    if (!vmp_codes_overflowed()) {
+        if (vmp_codes_drain() < 0)
+            PyErr_Clear();
+    } else {
+        emit_all_code_objects(Py_None);
+        PyErr_Clear();
+    }
+    // so are the threads, they are described again in the next one
+    if (vmp_threads_drain() < 0)
+        PyErr_Clear();
+    flush_codes();
+    if (vmp_codes_reset(emit_code_uid) < 0 ||
+            vmp_threads_reset(emit_thread_info) < 0)
+        goto error;
+    old_fd = vmprof_rotate(fd, trailer);
+    if (old_fd < 0)
+        goto error;
+    write_profile_meta();
+    vmp_resume_writes();
+    vmprof_ignore_signals(0);
+    return Py_BuildValue("(iN)", old_fd,
+                         PyBytes_FromStringAndSize(trailer, VMP_TRAILER_SIZE));
+
+ error:
+    vmp_resume_writes();
+    vmprof_ignore_signals(0);
+    PyErr_SetFromErrno(PyExc_OSError);
+    return NULL;
+}
+#endif
+
 static PyObject *
 start_sampling(PyObject *module, PyObject *noargs)
 {
+#ifdef VMPROF_UNIX
+    vmp_resume_writes();
+#endif
     vmprof_ignore_signals(0);
     Py_RETURN_NONE;
 }
@@ -419,9 +807,10 @@ static PyObject *
 insert_real_time_thread(PyObject *module, PyObject * args) {
     ssize_t thread_count;
     unsigned long thread_id = 0;
+    long native_id = 0;
     pthread_t th = pthread_self();
 
-    if (!PyArg_ParseTuple(args, "|k", &thread_id)) {
+    if (!PyArg_ParseTuple(args, "|kl", &thread_id, &native_id)) {
         return NULL;
     }
 
@@ -438,13 +827,24 @@ insert_real_time_thread(PyObject *module, PyObject * args) {
         return NULL;
     }
 
-    if (vmprof_get_signal_type() != SIGALRM) {
-        PyErr_SetString(PyExc_ValueError, "vmprof is not in real time mode");
+    if (vmprof_get_signal_type() != SIGALRM && !vmprof_get_per_thread()) {
+        PyErr_SetString(PyExc_ValueError, "vmprof is not in real time or per-thread mode");
         return NULL;
     }
 
+#ifdef VMPROF_LINUX
+    if (!thread_id) {
+        native_id = (long)syscall(SYS_gettid);
+    }
+#endif
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    if (!thread_id) {
+        (void)_register_native_thread();
+    }
+#endif
+
     vmprof_aquire_lock();
-    thread_count = insert_thread(th, -1);
+    thread_count = insert_thread(th, native_id);
     vmprof_release_lock();
 
     return PyLong_FromSsize_t(thread_count);
@@ -473,13 +873,13 @@ remove_real_time_thread(PyObject *module, PyObject * args) {
         return NULL;
     }
 
-    if (vmprof_get_signal_type() != SIGALRM) {
-        PyErr_SetString(PyExc_ValueError, "vmprof is not in real time mode");
+    if (vmprof_get_signal_type() != SIGALRM && !vmprof_get_per_thread()) {
+        PyErr_SetString(PyExc_ValueError, "vmprof is not in real time or per-thread mode");
         return NULL;
     }
 
     vmprof_aquire_lock();
-    thread_count = remove_thread(th, -1);
+    thread_count = remove_thread(th);
     vmprof_release_lock();
 
     return PyLong_FromSsize_t(thread_count);
@@ -502,6 +902,17 @@ static PyMethodDef VMProfMethods[] = {
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
     {"resolve_addr", resolve_addr, METH_VARARGS,
         "Returns the name of the given address"},
+    {"resolve_many_addr", resolve_many_addr, METH_O,
+        "Returns a dict mapping the given addresses to (name, lineno, srcfile)"},
+    {"resolve_file_addr", resolve_file_addr, METH_VARARGS,
+        "Resolves offsets into the object file at the given path, "
+        "returns a dict like resolve_many_addr"},
+    {"set_symbol_cache", set_symbol_cache, METH_VARARGS,
+        "Sets the directory of the symbol cache (None: no cache)"},
+    {"native_cache_stats", native_cache_stats, METH_NOARGS,
+        "Returns the hits, misses and size of the procedure cache of native unwinding"},
+    {"register_native_thread", register_native_thread, METH_NOARGS,
+        "Makes the native stack of the calling thread known to the frame pointer unwinder"},
 #endif
 #ifdef VMPROF_UNIX
     {"get_profile_path", vmp_get_profile_path, METH_NOARGS,
@@ -510,6 +921,11 @@ static PyMethodDef VMProfMethods[] = {
         "Insert a thread into the real time profiling list."},
     {"remove_real_time_thread", remove_real_time_thread, METH_VARARGS,
         "Remove a thread from the real time profiling list."},
+    {"read_profile_aggregated", vmp_read_profile_aggregated, METH_VARARGS,
+        "Read a profile from a file descriptor, aggregating samples by stack."},
+    {"rotate", rotate_profile, METH_VARARGS,
+        "Continues the profile in the given file descriptor, returns the "
+        "file descriptor of the previous segment and its trailer"},
 #endif
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
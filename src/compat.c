@@ -8,6 +8,7 @@
 #else
 #include <time.h>
 #include <sys/time.h>
+#include "vmprof_compress.h"
 #endif
 
 static int _vmp_profile_fileno = -1;
@@ -21,13 +22,18 @@ void vmp_set_profile_fileno(int fileno) {
 
 #ifndef VMPROF_WINDOWS
 int vmp_write_all(const char *buf, size_t bufsize)
+{
+    return vmp_write_all_fd(_vmp_profile_fileno, buf, bufsize);
+}
+
+int vmp_write_all_fd(int fd, const char *buf, size_t bufsize)
 {
     ssize_t count;
-    if (_vmp_profile_fileno == -1) {
+    if (fd == -1) {
         return -1;
     }
     while (bufsize > 0) {
-        count = write(_vmp_profile_fileno, buf, bufsize);
+        count = vmp_stream_write(fd, buf, bufsize);
         if (count <= 0)
             return -1;   /* failed */
         buf += count;
@@ -61,11 +67,11 @@ struct timezone_buf {
 #define __SIZE (1+sizeof(struct timezone_buf)+8)
 
 #ifdef VMPROF_UNIX
-int vmp_write_time_now(int marker) {
-    char buffer[__SIZE];
+int vmp_format_time_now(int marker, char *buffer) {
     struct timezone_buf buf;
 
-    (void)memset(&buffer, 0, __SIZE);
+    assert(__SIZE == VMP_TIME_RECORD_SIZE);
+    (void)memset(buffer, 0, __SIZE);
 
     assert((marker == MARKER_TRAILER || marker == MARKER_TIME_N_ZONE) && \
            "marker must be either a trailer or time_n_zone!");
@@ -93,6 +99,15 @@ int vmp_write_time_now(int marker) {
 
     buffer[0] = marker;
     (void)memcpy(buffer+1, &buf, sizeof(struct timezone_buf));
+    return 0;
+}
+
+int vmp_write_time_now(int marker) {
+    char buffer[__SIZE];
+
+    if (vmp_format_time_now(marker, buffer) < 0) {
+        return -1;
+    }
     vmp_write_all(buffer, __SIZE);
     return 0;
 }
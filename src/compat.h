@@ -20,7 +20,15 @@
 #endif
 
 int vmp_write_all(const char *buf, size_t bufsize);
+#ifdef VMPROF_UNIX
+int vmp_write_all_fd(int fd, const char *buf, size_t bufsize);
+#endif
 int vmp_write_time_now(int marker);
+#ifdef VMPROF_UNIX
+/* the record vmp_write_time_now() would write, without writing it */
+#define VMP_TIME_RECORD_SIZE (1 + 2 * 8 + 8)
+int vmp_format_time_now(int marker, char *buffer);
+#endif
 int vmp_write_meta(const char * key, const char * value);
 
 int vmp_profile_fileno(void);
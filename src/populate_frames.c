@@ -25,16 +25,80 @@ https://docs.python.org/3/whatsnew/3.11.html#pyframeobject-3-11-hiding.
 #include "internal/pycore_frame.h"
 #undef Py_BUILD_CORE
 
+// 0x030C0000 is 3.12, 0x030D0000 is 3.13.
+#define PY_312 0x030C0000
+#define PY_313 0x030D0000
+
+/**
+ * The layout of _PyInterpreterFrame changes with every minor version:
+ *
+ * - 3.11: the newest frame is tstate->cframe->current_frame, the code object
+ *   is f_code and prev_instr points to the last instruction executed.
+ * - 3.12: as 3.11, but every entry into the eval loop pushes a shim frame
+ *   owned by the C stack (FRAME_OWNED_BY_CSTACK) that runs no Python code.
+ * - 3.13: _PyCFrame is gone, the newest frame is tstate->current_frame, the
+ *   code object is f_executable (None for the shim frames) and instr_ptr
+ *   points to the current instruction.
+ *
+ * The helpers below hide these differences.  They only read memory, so they
+ * can be used from the signal handler.
+ */
+
+static inline _PyInterpreterFrame *_frame_current(PyThreadState *tstate) {
+#if PY_VERSION_HEX >= PY_313
+  return tstate->current_frame;
+#else
+  return tstate->cframe->current_frame;
+#endif
+}
+
+static inline PyCodeObject *_frame_code(_PyInterpreterFrame *frame) {
+#if PY_VERSION_HEX >= PY_313
+  return (PyCodeObject *)frame->f_executable;
+#else
+  return frame->f_code;
+#endif
+}
+
+// The signal can interrupt the eval loop while it pushes a frame: the
+// frame is linked before all of its fields are stored (the compiler may
+// reorder these stores), so 'previous' and the code object may still
+// hold anything.  A pointer that cannot be an object ends the walk.
+static inline int _pointer_is_plausible(const void *p) {
+  return (uintptr_t)p >= 4096 && ((uintptr_t)p & (sizeof(void *) - 1)) == 0;
+}
+
+// Modified from _PyFrame_IsIncomplete() of the respective version
+static int unsafe_PyInterpreterFrame_IsIncomplete(_PyInterpreterFrame *frame) {
+#if PY_VERSION_HEX >= PY_312
+  if (frame->owner == FRAME_OWNED_BY_CSTACK) {
+    return 1;
+  }
+#endif
+  if (frame->owner == FRAME_OWNED_BY_GENERATOR) {
+    return 0;
+  }
+  PyCodeObject *code = _frame_code(frame);
+  if (!_pointer_is_plausible(code) || Py_TYPE(code) != &PyCode_Type) {
+    return 1;
+  }
+#if PY_VERSION_HEX >= PY_313
+  return frame->instr_ptr < _PyCode_CODE(code) + code->_co_firsttraceable;
+#else
+  return frame->prev_instr < _PyCode_CODE(code) + code->_co_firsttraceable;
+#endif
+}
+
 // Modified from
 // https://github.com/python/cpython/blob/v3.11.4/Python/pystate.c#L1278-L1285
 _PyInterpreterFrame *unsafe_PyThreadState_GetInterpreterFrame(
     PyThreadState *tstate) {
   assert(tstate != NULL);
-  _PyInterpreterFrame *f = tstate->cframe->current_frame;
-  while (f && _PyFrame_IsIncomplete(f)) {
+  _PyInterpreterFrame *f = _frame_current(tstate);
+  while (_pointer_is_plausible(f) && unsafe_PyInterpreterFrame_IsIncomplete(f)) {
     f = f->previous;
   }
-  if (f == NULL) {
+  if (!_pointer_is_plausible(f)) {
     return NULL;
   }
   return f;
@@ -46,8 +110,8 @@ _PyInterpreterFrame *unsafe_PyThreadState_GetInterpreterFrame(
 PyCodeObject *unsafe_PyInterpreterFrame_GetCode(
     _PyInterpreterFrame *frame) {
   assert(frame != NULL);
-  assert(!_PyFrame_IsIncomplete(frame));
-  PyCodeObject *code = frame->f_code;
+  assert(!unsafe_PyInterpreterFrame_IsIncomplete(frame));
+  PyCodeObject *code = _frame_code(frame);
   assert(code != NULL);
   return code;
 }
@@ -58,11 +122,14 @@ PyCodeObject *unsafe_PyInterpreterFrame_GetCode(
 _PyInterpreterFrame *unsafe_PyInterpreterFrame_GetBack(
     _PyInterpreterFrame *frame) {
   assert(frame != NULL);
-  assert(!_PyFrame_IsIncomplete(frame));
+  assert(!unsafe_PyInterpreterFrame_IsIncomplete(frame));
   _PyInterpreterFrame *prev = frame->previous;
-  while (prev && _PyFrame_IsIncomplete(prev)) {
+  while (_pointer_is_plausible(prev) && unsafe_PyInterpreterFrame_IsIncomplete(prev)) {
     prev = prev->previous;
   }
+  if (!_pointer_is_plausible(prev)) {
+    return NULL;
+  }
   return prev;
 }
 
@@ -70,7 +137,13 @@ _PyInterpreterFrame *unsafe_PyInterpreterFrame_GetBack(
 // https://github.com/python/cpython/blob/v3.11.4/Python/frame.c#L165-L170 as
 // this function is not available in libpython
 int _PyInterpreterFrame_GetLine(_PyInterpreterFrame *frame) {
-  int addr = _PyInterpreterFrame_LASTI(frame) * sizeof(_Py_CODEUNIT);
-  return PyCode_Addr2Line(frame->f_code, addr);
+  return PyCode_Addr2Line(_frame_code(frame),
+                          unsafe_PyInterpreterFrame_GetAddr(frame));
+}
+
+// The argument _PyInterpreterFrame_GetLine() passes to PyCode_Addr2Line().
+// _PyInterpreterFrame_LASTI() accounts for prev_instr vs. instr_ptr.
+int unsafe_PyInterpreterFrame_GetAddr(_PyInterpreterFrame *frame) {
+  return _PyInterpreterFrame_LASTI(frame) * sizeof(_Py_CODEUNIT);
 }
 #endif  // PY_VERSION_HEX >= PY_311
\ No newline at end of file
@@ -19,4 +19,6 @@ _PyInterpreterFrame *unsafe_PyInterpreterFrame_GetBack(_PyInterpreterFrame *fram
 
 int _PyInterpreterFrame_GetLine(_PyInterpreterFrame *frame);
 
+int unsafe_PyInterpreterFrame_GetAddr(_PyInterpreterFrame *frame);
+
 #endif
\ No newline at end of file
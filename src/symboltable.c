@@ -265,3 +265,536 @@ int vmp_resolve_addr(void * addr, char * name, int name_len, int * lineno, char
 #endif
     return 0;
 }
+
+/* Directory of the symbol cache, NULL if there is none.  Linux only:
+   the results of a shared object (or executable) are kept in a file
+   named after its GNU build id, one line per address:
+
+     <offset in hex> TAB <lineno> TAB <name> TAB <source file> NL
+
+   where the offset is relative to the load address of the object.  A
+   missing source file stands for the path of the object, which may be
+   different in the next process. */
+static char * symbol_cache_dir = NULL;
+
+int vmp_set_symbol_cache(const char * directory)
+{
+    char * copy = NULL;
+    if (directory != NULL && (copy = strdup(directory)) == NULL) {
+        return -1;
+    }
+    free(symbol_cache_dir);
+    symbol_cache_dir = copy;
+    return 0;
+}
+
+#if defined(VMPROF_LINUX)
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BUILD_ID_MAX 64
+
+/* the address range of a loaded object, over all its PT_LOAD segments */
+typedef struct module_range {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t base;
+    const char * name;
+    char build_id[2 * BUILD_ID_MAX + 1];
+} module_range_t;
+
+typedef struct module_list {
+    module_range_t * modules;
+    int count;
+    int size;
+} module_list_t;
+
+typedef struct cached_symbol {
+    uintptr_t offset;
+    int lineno;
+    char * name;
+    char * srcfile;
+} cached_symbol_t;
+
+typedef struct symbol_cache {
+    module_range_t * module;
+    cached_symbol_t * symbols;
+    int count;
+    int fd;     /* to append to, opened on the first miss */
+} symbol_cache_t;
+
+static void _read_build_id(struct dl_phdr_info *info, module_range_t * module)
+{
+    int i;
+    module->build_id[0] = 0;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) * phdr = &info->dlpi_phdr[i];
+        const char * note, * end;
+        if (phdr->p_type != PT_NOTE) {
+            continue;
+        }
+        note = (const char*)(info->dlpi_addr + phdr->p_vaddr);
+        end = note + phdr->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) * nhdr = (const ElfW(Nhdr)*)note;
+            const char * name = note + sizeof(ElfW(Nhdr));
+            const unsigned char * desc = (const unsigned char*)name + ((nhdr->n_namesz + 3) & ~3);
+            note = (const char*)desc + ((nhdr->n_descsz + 3) & ~3);
+            if (note > end) {
+                break;
+            }
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                    memcmp(name, "GNU", 4) == 0 &&
+                    nhdr->n_descsz > 0 && nhdr->n_descsz <= BUILD_ID_MAX) {
+                unsigned int j;
+                for (j = 0; j < nhdr->n_descsz; j++) {
+                    snprintf(module->build_id + 2 * j, 3, "%02x", desc[j]);
+                }
+                return;
+            }
+        }
+    }
+}
+
+static int _collect_modules(struct dl_phdr_info *info, size_t size, void *data)
+{
+    module_list_t * list = (module_list_t*)data;
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) * phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD) {
+            continue;
+        }
+        uintptr_t lo = info->dlpi_addr + phdr->p_vaddr;
+        if (lo < start) start = lo;
+        if (lo + phdr->p_memsz > end) end = lo + phdr->p_memsz;
+    }
+    if (end == 0) {
+        return 0;
+    }
+    if (list->count == list->size) {
+        int new_size = list->size == 0 ? 32 : list->size * 2;
+        module_range_t * modules = realloc(list->modules, new_size * sizeof(module_range_t));
+        if (modules == NULL) {
+            return 1;
+        }
+        list->modules = modules;
+        list->size = new_size;
+    }
+    module_range_t * module = &list->modules[list->count];
+    module->start = start;
+    module->end = end;
+    module->base = info->dlpi_addr;
+    // the executable has no name here, dladdr knows it
+    module->name = info->dlpi_name[0] ? info->dlpi_name : NULL;
+    _read_build_id(info, module);
+    list->count++;
+    return 0;
+}
+
+static int _compare_modules(const void * a, const void * b)
+{
+    uintptr_t x = ((const module_range_t*)a)->start;
+    uintptr_t y = ((const module_range_t*)b)->start;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int _compare_symbols(const void * a, const void * b)
+{
+    uintptr_t x = ((const cached_symbol_t*)a)->offset;
+    uintptr_t y = ((const cached_symbol_t*)b)->offset;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void _symbol_cache_close(symbol_cache_t * cache)
+{
+    int i;
+    for (i = 0; i < cache->count; i++) {
+        free(cache->symbols[i].name);
+        free(cache->symbols[i].srcfile);
+    }
+    free(cache->symbols);
+    if (cache->fd >= 0) {
+        (void)close(cache->fd);
+    }
+    cache->module = NULL;
+    cache->symbols = NULL;
+    cache->count = 0;
+    cache->fd = -1;
+}
+
+static int _symbol_cache_path(module_range_t * module, char * path, size_t size)
+{
+    int n = snprintf(path, size, "%s/%s.sym", symbol_cache_dir, module->build_id);
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+static void _symbol_cache_open(symbol_cache_t * cache, module_range_t * module)
+{
+    char path[1024];
+    char * line = NULL;
+    size_t line_size = 0;
+    int size = 0;
+    FILE * file;
+
+    _symbol_cache_close(cache);
+    cache->module = module;
+    if (symbol_cache_dir == NULL || module->build_id[0] == 0 ||
+            _symbol_cache_path(module, path, sizeof(path)) < 0) {
+        return;
+    }
+    if ((file = fopen(path, "r")) == NULL) {
+        return;
+    }
+    while (getline(&line, &line_size, file) > 0) {
+        char * end, * name, * srcfile, * newline;
+        cached_symbol_t symbol;
+        symbol.offset = (uintptr_t)strtoull(line, &end, 16);
+        if (*end != '\t') continue;
+        symbol.lineno = (int)strtol(end + 1, &end, 10);
+        if (*end != '\t') continue;
+        name = end + 1;
+        if ((srcfile = strchr(name, '\t')) == NULL) continue;
+        *srcfile++ = 0;
+        // a line cut short by a crash is ignored
+        if ((newline = strchr(srcfile, '\n')) == NULL) continue;
+        *newline = 0;
+        if (cache->count == size) {
+            int new_size = size == 0 ? 256 : size * 2;
+            cached_symbol_t * symbols = realloc(cache->symbols, new_size * sizeof(cached_symbol_t));
+            if (symbols == NULL) break;
+            cache->symbols = symbols;
+            size = new_size;
+        }
+        symbol.name = strdup(name);
+        symbol.srcfile = strdup(srcfile);
+        if (symbol.name == NULL || symbol.srcfile == NULL) {
+            free(symbol.name);
+            free(symbol.srcfile);
+            break;
+        }
+        cache->symbols[cache->count++] = symbol;
+    }
+    free(line);
+    fclose(file);
+    qsort(cache->symbols, cache->count, sizeof(cached_symbol_t), _compare_symbols);
+}
+
+static cached_symbol_t * _symbol_cache_get(symbol_cache_t * cache, uintptr_t offset)
+{
+    cached_symbol_t key;
+    if (cache->count == 0) {
+        return NULL;
+    }
+    key.offset = offset;
+    return bsearch(&key, cache->symbols, cache->count, sizeof(cached_symbol_t), _compare_symbols);
+}
+
+static void _symbol_cache_put(symbol_cache_t * cache, uintptr_t offset,
+                              const char * name, int lineno, const char * srcfile)
+{
+    char record[512];
+    int n;
+
+    if (symbol_cache_dir == NULL || cache->module == NULL || cache->module->build_id[0] == 0) {
+        return;
+    }
+    if (strpbrk(name, "\t\n") != NULL || strpbrk(srcfile, "\t\n") != NULL) {
+        return;
+    }
+    if (cache->fd < 0) {
+        char path[1024];
+        if (_symbol_cache_path(cache->module, path, sizeof(path)) < 0) {
+            return;
+        }
+        cache->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (cache->fd < 0) {
+            return;
+        }
+    }
+    // one write per line, appends of other processes do not interleave
+    n = snprintf(record, sizeof(record), "%lx\t%d\t%s\t%s\n",
+                 (unsigned long)offset, lineno, name, srcfile);
+    if (n > 0 && (size_t)n < sizeof(record)) {
+        (void)write(cache->fd, record, n);
+    }
+}
+#endif
+
+#if defined(VMPROF_LINUX)
+int vmp_iterate_modules(vmp_module_fn fn, void * arg)
+{
+    module_list_t list = { NULL, 0, 0 };
+    char exe[1024];
+    ssize_t len;
+    int i, res = 0;
+
+    // collected first, fn is not called with the loader lock held
+    (void)dl_iterate_phdr(_collect_modules, &list);
+    len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    exe[len > 0 ? len : 0] = 0;
+    for (i = 0; i < list.count && res == 0; i++) {
+        module_range_t * module = &list.modules[i];
+        res = fn(arg, module->start, module->end, module->base, module->build_id,
+                 module->name != NULL ? module->name : exe);
+    }
+    free(list.modules);
+    return res;
+}
+
+static int _main_program_base(struct dl_phdr_info *info, size_t size, void *data)
+{
+    // the main program comes first
+    *(uintptr_t*)data = info->dlpi_addr;
+    return 1;
+}
+
+static int _file_bias(const char * path, uintptr_t * bias)
+{
+    // libbacktrace reads the file it is given as the executable; if that
+    // is position independent (shared objects are), it places it where
+    // the executable of this process is loaded
+    ElfW(Ehdr) ehdr;
+    int fd = open(path, O_RDONLY);
+    ssize_t count;
+
+    if (fd < 0) {
+        return -1;
+    }
+    count = read(fd, &ehdr, sizeof(ehdr));
+    (void)close(fd);
+    if (count != sizeof(ehdr) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0) {
+        return -1;
+    }
+    *bias = 0;
+    if (ehdr.e_type == ET_DYN) {
+        (void)dl_iterate_phdr(_main_program_base, bias);
+    }
+    return 0;
+}
+
+static void backtrace_syminfo_cb(void *data, uintptr_t pc, const char *symname,
+                                 uintptr_t symval, uintptr_t symsize)
+{
+    addr_info_t * info = (addr_info_t*)data;
+    if (symname != NULL) {
+        (void)strncpy(info->name, symname, info->name_len - 1);
+    }
+}
+
+int vmp_resolve_file_addrs(const char * path, const char * build_id,
+                           void ** addrs, int count, vmp_resolved_fn resolved, void * arg)
+{
+    char name[128];
+    char srcfile[256];
+    int lineno;
+    int i, res = 0;
+    struct backtrace_state * state = NULL;
+    uintptr_t bias = 0;
+    int readable;
+    module_range_t module;
+    symbol_cache_t cache = { NULL, NULL, 0, -1 };
+
+    // the object at 'path' stands for itself, loaded at address 0
+    module.start = 0;
+    module.end = UINTPTR_MAX;
+    module.base = 0;
+    module.name = path;
+    module.build_id[0] = 0;
+    if (build_id != NULL && strlen(build_id) < sizeof(module.build_id)) {
+        strcpy(module.build_id, build_id);
+    }
+    _symbol_cache_open(&cache, &module);
+    readable = _file_bias(path, &bias) == 0;
+
+    for (i = 0; i < count; i++) {
+        uintptr_t addr = (uintptr_t)addrs[i];
+        cached_symbol_t * symbol = _symbol_cache_get(&cache, addr);
+        name[0] = 0;
+        srcfile[0] = 0;
+        lineno = 0;
+        if (symbol != NULL) {
+            (void)strncpy(name, symbol->name, sizeof(name)-1);
+            (void)strncpy(srcfile, symbol->srcfile, sizeof(srcfile)-1);
+            lineno = symbol->lineno;
+        } else if (!readable) {
+            continue;
+        } else {
+            addr_info_t info = { .name = name, .name_len = sizeof(name),
+                                 .srcfile = srcfile, .srcfile_len = sizeof(srcfile),
+                                 .lineno = &lineno
+                               };
+            if (state == NULL) {
+                // never freed, libbacktrace cannot do that
+                state = backtrace_create_state(path, 0, backtrace_error_cb, NULL);
+                if (state == NULL) {
+                    break;
+                }
+            }
+            if (backtrace_pcinfo(state, addr + bias, backtrace_full_cb,
+                                 backtrace_error_cb, (void*)&info)) {
+                continue;
+            }
+            if (name[0] == 0) {
+                // no debug info, the symbol table might know it
+                (void)backtrace_syminfo(state, addr + bias, backtrace_syminfo_cb,
+                                        backtrace_error_cb, (void*)&info);
+            }
+            name[sizeof(name)-1] = 0;
+            srcfile[sizeof(srcfile)-1] = 0;
+            _symbol_cache_put(&cache, addr, name, lineno, srcfile);
+        }
+        name[sizeof(name)-1] = 0;
+        srcfile[sizeof(srcfile)-1] = 0;
+        if (srcfile[0] == 0) {
+            (void)strncpy(srcfile, path, sizeof(srcfile)-1);
+        }
+        if (resolved(arg, addrs[i], name, lineno, srcfile) < 0) {
+            res = -1;
+            break;
+        }
+    }
+    _symbol_cache_close(&cache);
+    return res;
+}
+#else
+int vmp_iterate_modules(vmp_module_fn fn, void * arg)
+{
+    return 0;
+}
+
+int vmp_resolve_file_addrs(const char * path, const char * build_id,
+                           void ** addrs, int count, vmp_resolved_fn resolved, void * arg)
+{
+    return 0;
+}
+#endif
+
+static int _compare_addrs(const void * a, const void * b)
+{
+    uintptr_t x = (uintptr_t)*(void * const *)a;
+    uintptr_t y = (uintptr_t)*(void * const *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+int vmp_resolve_many_addr(void ** addrs, int count, vmp_resolved_fn resolved, void * arg)
+{
+    char name[128];
+    char srcfile[256];
+    int lineno;
+    int i, res = 0;
+
+    // sorted, the addresses of one object are looked up one after the
+    // other, on linux the object is found by a merge with the sorted
+    // list of loaded objects instead of calling dladdr
+    qsort(addrs, count, sizeof(void*), _compare_addrs);
+
+#if defined(VMPROF_LINUX)
+    module_list_t list = { NULL, 0, 0 };
+    symbol_cache_t cache = { NULL, NULL, 0, -1 };
+    int m = 0;
+
+    (void)dl_iterate_phdr(_collect_modules, &list);
+    qsort(list.modules, list.count, sizeof(module_range_t), _compare_modules);
+
+    for (i = 0; i < count; i++) {
+        uintptr_t addr = (uintptr_t)addrs[i];
+        cached_symbol_t * symbol = NULL;
+        if (i > 0 && addrs[i] == addrs[i-1]) {
+            continue;
+        }
+
+        while (m < list.count && list.modules[m].end <= addr) {
+            m++;
+        }
+        module_range_t * module = NULL;
+        if (m < list.count && list.modules[m].start <= addr) {
+            module = &list.modules[m];
+            if (cache.module != module) {
+                _symbol_cache_open(&cache, module);
+            }
+            symbol = _symbol_cache_get(&cache, addr - module->base);
+        }
+
+        name[0] = 0;
+        srcfile[0] = 0;
+        lineno = 0;
+        if (symbol != NULL) {
+            (void)strncpy(name, symbol->name, sizeof(name)-1);
+            (void)strncpy(srcfile, symbol->srcfile, sizeof(srcfile)-1);
+            lineno = symbol->lineno;
+        } else {
+            if (bstate == NULL) {
+                bstate = backtrace_create_state (NULL, 1, backtrace_error_cb, NULL);
+            }
+            addr_info_t info = { .name = name, .name_len = sizeof(name),
+                                 .srcfile = srcfile, .srcfile_len = sizeof(srcfile),
+                                 .lineno = &lineno
+                               };
+            if (backtrace_pcinfo(bstate, addr, backtrace_full_cb,
+                                 backtrace_error_cb, (void*)&info)) {
+                continue;
+            }
+            name[sizeof(name)-1] = 0;
+            srcfile[sizeof(srcfile)-1] = 0;
+            if (name[0] == 0) {
+                // no debug info, only the dynamic symbols are left
+                Dl_info dlinfo;
+                dlinfo.dli_sname = NULL;
+                (void)dladdr((const void*)addr, &dlinfo);
+                if (dlinfo.dli_sname != NULL) {
+                    (void)strncpy(name, dlinfo.dli_sname, sizeof(name)-1);
+                }
+            }
+            if (module != NULL) {
+                _symbol_cache_put(&cache, addr - module->base, name, lineno, srcfile);
+            }
+        }
+
+        name[sizeof(name)-1] = 0;
+        srcfile[sizeof(srcfile)-1] = 0;
+        if (srcfile[0] == 0) {
+            if (module != NULL && module->name != NULL) {
+                (void)strncpy(srcfile, module->name, sizeof(srcfile)-1);
+            } else {
+                Dl_info dlinfo;
+                dlinfo.dli_fname = NULL;
+                (void)dladdr((const void*)addr, &dlinfo);
+                if (dlinfo.dli_fname != NULL) {
+                    (void)strncpy(srcfile, dlinfo.dli_fname, sizeof(srcfile)-1);
+                }
+            }
+        }
+        if (srcfile[0] == 0) {
+            srcfile[0] = '-';
+            srcfile[1] = 0;
+        }
+        if (resolved(arg, addrs[i], name, lineno, srcfile) < 0) {
+            res = -1;
+            break;
+        }
+    }
+    _symbol_cache_close(&cache);
+    free(list.modules);
+#else
+    for (i = 0; i < count; i++) {
+        if (i > 0 && addrs[i] == addrs[i-1]) {
+            continue;
+        }
+        name[0] = 0;
+        srcfile[0] = '-';
+        srcfile[1] = 0;
+        lineno = 0;
+        if (vmp_resolve_addr(addrs[i], name, sizeof(name), &lineno, srcfile, sizeof(srcfile)) != 0) {
+            continue;
+        }
+        if (resolved(arg, addrs[i], name, lineno, srcfile) < 0) {
+            res = -1;
+            break;
+        }
+    }
+#endif
+    return res;
+}
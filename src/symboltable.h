@@ -2,5 +2,35 @@
 
 #define _GNU_SOURCE 1
 
+#include <stdint.h>
+
 int vmp_resolve_addr(void * addr, char * name, int name_len, int * lineno,
                       char * srcfile, int srcfile_len);
+
+/* Directory to keep resolved symbols in, keyed by the build id of the
+   object and the offset of the address (NULL: none). Returns -1 if out
+   of memory. */
+int vmp_set_symbol_cache(const char * directory);
+
+/* Called for every distinct address that could be resolved, a negative
+   return value stops the resolution. */
+typedef int (*vmp_resolved_fn)(void * arg, void * addr, const char * name,
+                               int lineno, const char * srcfile);
+
+/* Called for every object (shared library or executable) that is loaded,
+   with the range of its segments, its load address, its GNU build id in
+   hex ("" if it has none) and its path. A non-zero return value stops
+   the iteration and is returned by vmp_iterate_modules. Linux only. */
+typedef int (*vmp_module_fn)(void * arg, uintptr_t start, uintptr_t end, uintptr_t base,
+                             const char * build_id, const char * path);
+int vmp_iterate_modules(vmp_module_fn fn, void * arg);
+
+/* Resolves offsets into the object at 'path', which does not have to be
+   loaded (e.g. to symbolize a profile of another process).  Consults
+   the symbol cache if build_id is given. Linux only. */
+int vmp_resolve_file_addrs(const char * path, const char * build_id,
+                           void ** addrs, int count, vmp_resolved_fn resolved, void * arg);
+
+/* Resolves a batch of addresses, sorted in place first. Returns -1 if
+   'resolved' stopped it. */
+int vmp_resolve_many_addr(void ** addrs, int count, vmp_resolved_fn resolved, void * arg);
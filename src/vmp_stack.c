@@ -13,6 +13,9 @@
 
 #include "vmprof.h"
 #include "compat.h"
+#if defined(VMPROF_UNIX) && !defined(RPYTHON_VMPROF)
+#include "vmprof_codes.h"
+#endif
 
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
 
@@ -44,10 +47,19 @@ static int (*unw_getcontext)(unw_context_t *) = NULL;
 #include <sys/types.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <mach-o/dyld.h>
 #elif defined(__unix__)
 #include <dlfcn.h>
 #endif
 
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+#include "vmprof_config.h"
+#include <link.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/ucontext.h>
+#endif
+
 #ifdef PYPY_JIT_CODEMAP
 void *pypy_find_codemap_at_addr(long addr, long *start_addr);
 #endif
@@ -71,9 +83,152 @@ PY_EVAL_RETURN_T * vmprof_eval(PY_STACK_FRAME_T *f, int throwflag) { return NULL
 #endif
 
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
-static intptr_t *vmp_ranges = NULL;
-static ssize_t vmp_range_count = 0;
+/* The address ranges of the interpreter, sorted (start, end) pairs.
+   The signal handlers read the table while the writer thread reads the
+   maps again (see vmp_native_refresh_ranges()): a new table is built
+   aside and replaces the old one with a single store.  A replaced table
+   might still be in use by a handler, it is kept until
+   vmp_native_free_ranges(). */
+struct vmp_ranges_s {
+    intptr_t *ranges;
+    int count;
+    int owned;                      /* 'ranges' is freed with the table */
+    struct vmp_ranges_s *replaced;  /* the next older replaced table */
+};
+static struct vmp_ranges_s * volatile vmp_ranges = NULL;
+static struct vmp_ranges_s * vmp_ranges_replaced = NULL;
 static int vmp_native_traces_enabled = 0;
+static int vmp_native_skip_interpreter_frames = 0;
+static int vmp_native_lines = 0;
+/* address range of the eval loop, known after the first sample that
+   went through it with interpreter frames skipped */
+static intptr_t volatile vmp_eval_start = 0;
+static intptr_t volatile vmp_eval_end = 0;
+
+/* Start of the procedure of an instruction pointer, as found by
+   unw_get_proc_info().  Direct mapped and filled by the signal handlers
+   of all threads: a writer claims an entry by swapping its key with
+   IP_CACHE_BUSY, a reader checks that the key did not change while it
+   read the value.  Emptied when a shared object is loaded or unloaded. */
+#define IP_CACHE_SIZE   (1 << 12)
+#define IP_CACHE_BUSY   ((intptr_t)1)
+
+struct ip_cache_entry_s {
+    intptr_t volatile ip;
+    intptr_t volatile start_ip;
+};
+
+static struct ip_cache_entry_s vmp_ip_cache[IP_CACHE_SIZE];
+static long volatile vmp_ip_cache_hits = 0;
+static long volatile vmp_ip_cache_misses = 0;
+
+static inline struct ip_cache_entry_s *_ip_cache_entry(intptr_t ip)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ip * 0x9E3779B97F4A7C15ULL;
+    return &vmp_ip_cache[(h >> 32) & (IP_CACHE_SIZE - 1)];
+}
+
+static int _ip_cache_get(intptr_t ip, intptr_t *start_ip)
+{
+    struct ip_cache_entry_s *entry = _ip_cache_entry(ip);
+    intptr_t value;
+
+    if (entry->ip != ip)
+        return 0;
+    __sync_synchronize();
+    value = entry->start_ip;
+    __sync_synchronize();
+    if (entry->ip != ip)
+        return 0;
+    *start_ip = value;
+    return 1;
+}
+
+static void _ip_cache_put(intptr_t ip, intptr_t start_ip)
+{
+    struct ip_cache_entry_s *entry = _ip_cache_entry(ip);
+    intptr_t key = entry->ip;
+
+    if (key == IP_CACHE_BUSY || !__sync_bool_compare_and_swap(&entry->ip, key, IP_CACHE_BUSY))
+        return;
+    entry->start_ip = start_ip;
+    __sync_synchronize();
+    entry->ip = ip;
+}
+
+void vmp_native_ip_cache_clear(void)
+{
+    int i;
+    for (i = 0; i < IP_CACHE_SIZE; i++) {
+        intptr_t key = vmp_ip_cache[i].ip;
+        // a busy entry is finished by its writer
+        if (key != IP_CACHE_BUSY)
+            (void)__sync_bool_compare_and_swap(&vmp_ip_cache[i].ip, key, 0);
+    }
+}
+
+#define NATIVE_FRAME_NATIVE 0   /* to be written to the stack trace */
+#define NATIVE_FRAME_SKIP   1   /* inside the interpreter, dropped */
+#define NATIVE_FRAME_EVAL   2   /* the eval loop, python frames follow */
+
+static int _native_frame_kind(unw_cursor_t *cursor, void **func_addr, unw_word_t *frame_ip)
+{
+    // Interpreter frames are recognized by their instruction pointer
+    // (see vmp_read_vmaps), which is much cheaper than looking up the
+    // procedure info.  The eval loop lives in the interpreter too; its
+    // range is learned from the procedure info once.  Other frames look
+    // up the procedure start in the cache first.
+    unw_proc_info_t pip;
+    unw_word_t ip = 0;
+    intptr_t start_ip;
+    int ignored = 0;
+
+    if (unw_get_reg(cursor, UNW_REG_IP, &ip) < 0) {
+        ip = 0;
+    }
+    *frame_ip = ip;
+
+    if (vmp_native_skip_interpreter_frames) {
+        if (ip != 0 && vmp_ignore_ip((intptr_t)ip)) {
+            intptr_t end = vmp_eval_end;
+            if (end == 0) {
+                ignored = 1;
+            } else if (vmp_eval_start <= (intptr_t)ip && (intptr_t)ip < end) {
+                *func_addr = (void*)vmp_eval_start;
+                return NATIVE_FRAME_EVAL;
+            } else {
+                return NATIVE_FRAME_SKIP;
+            }
+        }
+    }
+
+    if (!ignored && ip > IP_CACHE_BUSY && _ip_cache_get((intptr_t)ip, &start_ip)) {
+        __sync_fetch_and_add(&vmp_ip_cache_hits, 1L);
+        *func_addr = (void*)start_ip;
+        if (IS_VMPROF_EVAL((void*)start_ip)) {
+            return NATIVE_FRAME_EVAL;
+        }
+        return NATIVE_FRAME_NATIVE;
+    }
+
+    if (unw_get_proc_info(cursor, &pip) < 0) {
+        pip.start_ip = 0;
+        pip.end_ip = 0;
+    } else if (ip > IP_CACHE_BUSY) {
+        _ip_cache_put((intptr_t)ip, (intptr_t)pip.start_ip);
+    }
+    __sync_fetch_and_add(&vmp_ip_cache_misses, 1L);
+    *func_addr = (void*)pip.start_ip;
+    if (IS_VMPROF_EVAL((void*)pip.start_ip)) {
+        if (ignored) {
+            vmp_eval_start = (intptr_t)pip.start_ip;
+            __sync_synchronize();
+            vmp_eval_end = (intptr_t)pip.end_ip;
+        }
+        return NATIVE_FRAME_EVAL;
+    }
+    return ignored ? NATIVE_FRAME_SKIP : NATIVE_FRAME_NATIVE;
+}
 #endif
 static int _vmp_profiles_lines = 0;
 
@@ -84,25 +239,66 @@ int vmp_profiles_python_lines(void) {
     return _vmp_profiles_lines;
 }
 
+void vmp_native_ip_cache_stats(long *hits, long *misses, long *size) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    *hits = vmp_ip_cache_hits;
+    *misses = vmp_ip_cache_misses;
+    *size = IP_CACHE_SIZE;
+#else
+    *hits = *misses = *size = 0;
+#endif
+}
+
+void vmp_native_profile_lines(int lines) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    vmp_native_lines = lines;
+#endif
+}
+
+int vmp_native_profiles_lines(void) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    // the frame pointer unwinder knows nothing but the addresses
+    if (vmp_native_unwinder() == VMP_UNWIND_FRAME_POINTER) {
+        return 1;
+    }
+    return vmp_native_lines;
+#else
+    return 0;
+#endif
+}
+
+void vmp_native_skip_interpreter(int skip) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    vmp_native_skip_interpreter_frames = skip;
+#endif
+}
+
+int vmp_native_skips_interpreter(void) {
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    return vmp_native_skip_interpreter_frames;
+#else
+    return 0;
+#endif
+}
+
 #if PY_VERSION_HEX >= 0x030B0000 /* < 3.11 */
     static _PyInterpreterFrame * _write_python_stack_entry(_PyInterpreterFrame * frame, void ** result, int * depth, int max_depth)
     {
 #ifndef RPYTHON_VMPROF // pypy does not support line profiling
     if (vmp_profiles_python_lines()) {
-        // In the line profiling mode we save a line number for every frame.
-        // Actual line number isn't stored in the frame directly (f_lineno
-        // points to the beginning of the frame), so we need to compute it
-        // from f_lasti and f_code->co_lnotab. Here is explained what co_lnotab
-        // is:
-        // https://svn.python.org/projects/python/trunk/Objects/lnotab_notes.txt
-
-        // NOTE: the profiling overhead can be reduced by storing co_lnotab in the dump and
-        // moving this computation to the reader instead of doing it here.
-        result[*depth] = (void*) (int64_t) _PyInterpreterFrame_GetLine(frame);
+        // In the line profiling mode we save the offset of the current
+        // instruction for every frame, exactly what would be passed to
+        // PyCode_Addr2Line().  The line table of the code object is
+        // written once (see emit_code_object) and the reader maps the
+        // offset to a line (PROFILE_LINE_OFFSETS).
+        result[*depth] = (void*) (int64_t) unsafe_PyInterpreterFrame_GetAddr(frame);
         *depth = *depth + 1;
     }
     PyCodeObject* frame_code = unsafe_PyInterpreterFrame_GetCode(frame);
     result[*depth] = (void*)CODE_ADDR_TO_UID(frame_code);
+#ifdef VMPROF_UNIX
+    vmp_code_seen(CODE_ADDR_TO_UID(frame_code));
+#endif
     //Py_DECREF(frame_code);
     *depth = *depth + 1;
 #else
@@ -131,20 +327,23 @@ static PY_STACK_FRAME_T * _write_python_stack_entry(PY_STACK_FRAME_T * frame, vo
 {
 #ifndef RPYTHON_VMPROF // pypy does not support line profiling
     if (vmp_profiles_python_lines()) {
-        // In the line profiling mode we save a line number for every frame.
-        // Actual line number isn't stored in the frame directly (f_lineno
-        // points to the beginning of the frame), so we need to compute it
-        // from f_lasti and f_code->co_lnotab. Here is explained what co_lnotab
-        // is:
-        // https://svn.python.org/projects/python/trunk/Objects/lnotab_notes.txt
-
-        // NOTE: the profiling overhead can be reduced by storing co_lnotab in the dump and
-        // moving this computation to the reader instead of doing it here.
-        result[*depth] = (void*) (int64_t) PyFrame_GetLineNumber(frame);
+        // In the line profiling mode we save the offset of the current
+        // instruction for every frame, exactly what PyFrame_GetLineNumber()
+        // would pass to PyCode_Addr2Line().  The line table of the code
+        // object is written once (see emit_code_object) and the reader
+        // maps the offset to a line (PROFILE_LINE_OFFSETS).
+#if PY_VERSION_HEX >= 0x030A0000 /* >= 3.10, f_lasti counts code units */
+        result[*depth] = (void*) (int64_t) (frame->f_lasti * (int)sizeof(_Py_CODEUNIT));
+#else
+        result[*depth] = (void*) (int64_t) frame->f_lasti;
+#endif
         *depth = *depth + 1;
     }
     PyCodeObject* frame_code = FRAME_CODE(frame);
     result[*depth] = (void*)CODE_ADDR_TO_UID(frame_code);
+#ifdef VMPROF_UNIX
+    vmp_code_seen(CODE_ADDR_TO_UID(frame_code));
+#endif
     Py_DECREF(frame_code);
     *depth = *depth + 1;
 #else
@@ -214,6 +413,113 @@ int _write_native_stack(void* addr, void ** result, int depth, int max_depth) {
 }
 #endif
 
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+static int vmp_unwinder = VMP_UNWIND_LIBUNWIND;
+/* initial-exec: read in the signal handler */
+static __thread ucontext_t *vmp_signal_ucontext
+    __attribute__((tls_model("initial-exec"))) = NULL;
+/* 0 until vmp_native_register_thread() ran in the thread */
+static __thread uintptr_t vmp_thread_stack_top
+    __attribute__((tls_model("initial-exec"))) = 0;
+static uintptr_t vmp_max_stack_size = 8 << 20;
+
+static int _walk_frame_pointers(void ** result, int max_depth, int * depth)
+{
+    // Follows the chain of saved frame pointers from the interrupted
+    // context up to the eval loop (returns 1).  A frame pointer must lie
+    // above the previous frame and below the top of the thread's stack,
+    // otherwise the walk stops (returns 0): code compiled without frame
+    // pointers leaves anything in that register.  In a thread whose
+    // stack is unknown only the interrupted frame is recorded.
+    ucontext_t *uc = vmp_signal_ucontext;
+    uintptr_t pc, fp, lo, hi;
+    int caller = 0;
+
+    if (uc == NULL) {
+        return 0;
+    }
+    pc = (uintptr_t)uc->PC_FROM_UCONTEXT;
+    fp = (uintptr_t)uc->FP_FROM_UCONTEXT;
+    lo = (uintptr_t)uc->SP_FROM_UCONTEXT;
+    hi = vmp_thread_stack_top;
+    if (hi <= lo || hi - lo > vmp_max_stack_size) {
+        // not registered, or running on another stack
+        hi = 0;
+    }
+
+    while ((*depth + _per_loop()) <= max_depth) {
+        if (vmp_eval_start <= (intptr_t)pc && (intptr_t)pc < vmp_eval_end) {
+            return 1;
+        }
+        if (!vmp_native_skip_interpreter_frames || !vmp_ignore_ip((intptr_t)pc)) {
+            // a return address is just behind the call, step back into
+            // it (the lowest bit is set anyway, see below)
+            uintptr_t addr = caller ? pc - 2 : pc;
+            *depth = _write_native_stack((void*)(addr | 0x1), result, *depth, max_depth);
+        }
+        if (hi == 0) {
+            return 0;
+        }
+        if (fp < lo || fp > hi - 2 * sizeof(void*) || (fp & (sizeof(void*) - 1)) != 0) {
+            return 0;
+        }
+        pc = ((uintptr_t*)fp)[1];
+        lo = fp + 2 * sizeof(void*);
+        fp = ((uintptr_t*)fp)[0];
+        caller = 1;
+    }
+    return 0;
+}
+#endif
+
+void vmp_native_register_thread(void) {
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+    // the frame pointer walk needs the top of the stack, which is not
+    // safe to look up inside the signal handler
+    pthread_attr_t attr;
+    void * stack_addr;
+    size_t stack_size;
+
+    if (vmp_thread_stack_top != 0) {
+        return;
+    }
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0) {
+            vmp_thread_stack_top = (uintptr_t)stack_addr + stack_size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+#endif
+}
+
+int vmp_native_set_unwinder(int unwinder) {
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+    if (unwinder == VMP_UNWIND_LIBUNWIND || unwinder == VMP_UNWIND_FRAME_POINTER) {
+        vmp_unwinder = unwinder;
+        return 0;
+    }
+#else
+    if (unwinder == VMP_UNWIND_LIBUNWIND) {
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+int vmp_native_unwinder(void) {
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+    return vmp_unwinder;
+#else
+    return VMP_UNWIND_LIBUNWIND;
+#endif
+}
+
+void vmp_native_set_ucontext(void *ucontext) {
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+    vmp_signal_ucontext = (ucontext_t*)ucontext;
+#endif
+}
+
 #if PY_VERSION_HEX >= 0x030B0000 /* < 3.11 */
 int vmp_walk_and_record_stack(_PyInterpreterFrame *frame, void ** result,
                               int max_depth, int signal, intptr_t pc) {
@@ -242,13 +548,22 @@ int vmp_walk_and_record_stack(_PyInterpreterFrame *frame, void ** result,
     void * func_addr;
     unw_cursor_t cursor;
     unw_context_t uc;
-    unw_proc_info_t pip;
     int ret;
 
     if (vmp_native_enabled() == 0) {
         return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
     }
 
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+    if (vmp_unwinder == VMP_UNWIND_FRAME_POINTER) {
+        int depth = 0;
+        // if the chain breaks before the eval loop, the frames walked so
+        // far are kept and the python frames follow
+        (void)_walk_frame_pointers(result, max_depth, &depth);
+        return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
+    }
+#endif
+
     ret = unw_getcontext(&uc);
     if (ret < 0) {
         // could not initialize lib unwind cursor and context
@@ -308,11 +623,11 @@ int vmp_walk_and_record_stack(_PyInterpreterFrame *frame, void ** result,
     }
 
     int depth = 0;
+    int caller = 0;
+    unw_word_t frame_ip;
     //PY_STACK_FRAME_T * top_most_frame = frame;
     while ((depth + _per_loop()) <= max_depth) {
-        unw_get_proc_info(&cursor, &pip);
-
-        func_addr = (void*)pip.start_ip;
+        int kind = _native_frame_kind(&cursor, &func_addr, &frame_ip);
 
         //{
         //    char name[64];
@@ -321,15 +636,6 @@ int vmp_walk_and_record_stack(_PyInterpreterFrame *frame, void ** result,
         //    printf("  %s %p\n", name, func_addr);
         //}
 
-        //if (func_addr == 0) {
-        //    unw_word_t rip = 0;
-        //    if (unw_get_reg(&cursor, UNW_REG_IP, &rip) < 0) {
-        //        printf("failed failed failed\n");
-        //    }
-        //    func_addr = rip;
-        //    printf("func_addr is 0, now %p\n", rip);
-        //}
-
 #ifdef PYPY_JIT_CODEMAP
         long start_addr = 0;
         unw_word_t rip = 0;
@@ -338,7 +644,7 @@ int vmp_walk_and_record_stack(_PyInterpreterFrame *frame, void ** result,
         }
 #endif
 
-        if (IS_VMPROF_EVAL((void*)pip.start_ip)) {
+        if (kind == NATIVE_FRAME_EVAL) {
             // yes we found one stack entry of the python frames!
             return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
 #ifdef PYPY_JIT_CODEMAP
@@ -346,15 +652,20 @@ int vmp_walk_and_record_stack(_PyInterpreterFrame *frame, void ** result,
             depth = vmprof_write_header_for_jit_addr((intptr_t*)result, depth, pc, max_depth);
             return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
 #endif
-        } else {
+        } else if (kind == NATIVE_FRAME_NATIVE) {
             // mark native routines with the first bit set,
             // this is possible because compiler align to 8 bytes.
             //
-            if (func_addr != 0x0) {
+            if (vmp_native_lines && frame_ip != 0) {
+                // a return address is just behind the call, step back into it
+                uint64_t addr = caller ? (uint64_t)frame_ip - 2 : (uint64_t)frame_ip;
+                depth = _write_native_stack((void*)(addr | 0x1), result, depth, max_depth);
+            } else if (func_addr != 0x0) {
                 depth = _write_native_stack((void*)(((uint64_t)func_addr) | 0x1), result, depth, max_depth);
             }
         }
 
+        caller = 1;
         int err = unw_step(&cursor);
         if (err == 0) {
             break;
@@ -396,13 +707,22 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
     void * func_addr;
     unw_cursor_t cursor;
     unw_context_t uc;
-    unw_proc_info_t pip;
     int ret;
 
     if (vmp_native_enabled() == 0) {
         return vmp_walk_and_record_python_stack_only(frame, result, max_depth, 0, pc);
     }
 
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+    if (vmp_unwinder == VMP_UNWIND_FRAME_POINTER) {
+        int depth = 0;
+        // if the chain breaks before the eval loop, the frames walked so
+        // far are kept and the python frames follow
+        (void)_walk_frame_pointers(result, max_depth, &depth);
+        return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
+    }
+#endif
+
     ret = unw_getcontext(&uc);
     if (ret < 0) {
         // could not initialize lib unwind cursor and context
@@ -462,11 +782,11 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
     }
 
     int depth = 0;
+    int caller = 0;
+    unw_word_t frame_ip;
     //PY_STACK_FRAME_T * top_most_frame = frame;
     while ((depth + _per_loop()) <= max_depth) {
-        unw_get_proc_info(&cursor, &pip);
-
-        func_addr = (void*)pip.start_ip;
+        int kind = _native_frame_kind(&cursor, &func_addr, &frame_ip);
 
         //{
         //    char name[64];
@@ -475,15 +795,6 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
         //    printf("  %s %p\n", name, func_addr);
         //}
 
-        //if (func_addr == 0) {
-        //    unw_word_t rip = 0;
-        //    if (unw_get_reg(&cursor, UNW_REG_IP, &rip) < 0) {
-        //        printf("failed failed failed\n");
-        //    }
-        //    func_addr = rip;
-        //    printf("func_addr is 0, now %p\n", rip);
-        //}
-
 #ifdef PYPY_JIT_CODEMAP
         long start_addr = 0;
         unw_word_t rip = 0;
@@ -492,7 +803,7 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
         }
 #endif
 
-        if (IS_VMPROF_EVAL((void*)pip.start_ip)) {
+        if (kind == NATIVE_FRAME_EVAL) {
             // yes we found one stack entry of the python frames!
             return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
 #ifdef PYPY_JIT_CODEMAP
@@ -500,15 +811,20 @@ int vmp_walk_and_record_stack(PY_STACK_FRAME_T *frame, void ** result,
             depth = vmprof_write_header_for_jit_addr((intptr_t*)result, depth, pc, max_depth);
             return vmp_walk_and_record_python_stack_only(frame, result, max_depth, depth, pc);
 #endif
-        } else {
+        } else if (kind == NATIVE_FRAME_NATIVE) {
             // mark native routines with the first bit set,
             // this is possible because compiler align to 8 bytes.
             //
-            if (func_addr != 0x0) {
+            if (vmp_native_lines && frame_ip != 0) {
+                // a return address is just behind the call, step back into it
+                uint64_t addr = caller ? (uint64_t)frame_ip - 2 : (uint64_t)frame_ip;
+                depth = _write_native_stack((void*)(addr | 0x1), result, depth, max_depth);
+            } else if (func_addr != 0x0) {
                 depth = _write_native_stack((void*)(((uint64_t)func_addr) | 0x1), result, depth, max_depth);
             }
         }
 
+        caller = 1;
         int err = unw_step(&cursor);
         if (err == 0) {
             break;
@@ -556,39 +872,63 @@ int _ignore_symbols_from_path(const char * name) {
     return 0;
 }
 
-int _reset_vmp_ranges(void) {
+static void _publish_ranges(intptr_t * ranges, int count, int owned) {
+    // the signal handlers see either the old or the new table
+    struct vmp_ranges_s * table = NULL;
+    if (ranges != NULL) {
+        table = malloc(sizeof(struct vmp_ranges_s));
+        if (table == NULL) {
+            if (owned) { free(ranges); }
+            return;
+        }
+        table->ranges = ranges;
+        table->count = count;
+        table->owned = owned;
+    }
+    __sync_synchronize();
+    struct vmp_ranges_s * old = __sync_lock_test_and_set(&vmp_ranges, table);
+    if (old != NULL) {
+        old->replaced = vmp_ranges_replaced;
+        vmp_ranges_replaced = old;
+    }
+}
+
+int _reset_vmp_ranges(intptr_t ** ranges) {
     // initially 10 (start, stop) entries!
     int max_count = 10;
-    vmp_range_count = 0;
-    if (vmp_ranges != NULL) { free(vmp_ranges); }
-    vmp_ranges = malloc(max_count * sizeof(intptr_t));
-    return max_count;
+    *ranges = malloc(max_count * sizeof(intptr_t));
+    return *ranges == NULL ? 0 : max_count;
 }
 
 
-int _resize_ranges(intptr_t ** cursor, int max_count) {
-    ptrdiff_t diff = (*cursor - vmp_ranges);
+int _resize_ranges(intptr_t ** ranges, intptr_t ** cursor, int max_count) {
+    ptrdiff_t diff = (*cursor - *ranges);
     if (diff + 2 > max_count) {
+        intptr_t * resized = realloc(*ranges, max_count*2*sizeof(intptr_t));
+        if (resized == NULL) {
+            return 0;
+        }
         max_count *= 2;
-        vmp_ranges = realloc(vmp_ranges, max_count*sizeof(intptr_t));
-        *cursor = vmp_ranges + diff;
+        *ranges = resized;
+        *cursor = resized + diff;
     }
     return max_count;
 }
 
-intptr_t * _add_to_range(intptr_t * cursor, intptr_t start, intptr_t end) {
+intptr_t * _add_to_range(intptr_t * ranges, int * count, intptr_t * cursor,
+                         intptr_t start, intptr_t end) {
     if (cursor[0] == start) {
         // the last range is extended, this reduces the entry count
         // which makes the querying faster
         cursor[0] = end;
     } else {
-        if (cursor != vmp_ranges) {
+        if (cursor != ranges) {
             // not pointing to the first entry
             cursor++;
         }
         cursor[0] = start;
         cursor[1] = end;
-        vmp_range_count += 2;
+        *count += 2;
         cursor++;
     }
     return cursor;
@@ -617,8 +957,14 @@ int vmp_read_vmaps(const char * fname) {
     // 3) libraries containing site-packages are not considered
     //    candidates
 
-    int max_count = _reset_vmp_ranges();
-    intptr_t * cursor = vmp_ranges;
+    intptr_t * ranges;
+    int count = 0;
+    int max_count = _reset_vmp_ranges(&ranges);
+    if (max_count == 0) {
+        fclose(fd);
+        return 0;
+    }
+    intptr_t * cursor = ranges;
     cursor[0] = -1;
     while ((size = getline(&line, &n, fd)) >= 0) {
         assert(line != NULL);
@@ -636,15 +982,24 @@ int vmp_read_vmaps(const char * fname) {
 
         name = saveptr;
         if (_ignore_symbols_from_path(name)) {
-            max_count = _resize_ranges(&cursor, max_count);
-            cursor = _add_to_range(cursor, start, end);
+            max_count = _resize_ranges(&ranges, &cursor, max_count);
+            if (max_count == 0) {
+                break;
+            }
+            cursor = _add_to_range(ranges, &count, cursor, start, end);
         }
         free(line);
         line = NULL;
         n = 0;
     }
+    free(line);
 
     fclose(fd);
+    if (max_count == 0) {
+        free(ranges);
+        return 0;
+    }
+    _publish_ranges(ranges, count, 1);
     return 1;
 }
 #endif
@@ -668,8 +1023,13 @@ int vmp_read_vmaps(const char * fname) {
     }
 
     addr = 0;
-    int max_count = _reset_vmp_ranges();
-    intptr_t * cursor = vmp_ranges;
+    intptr_t * ranges;
+    int count = 0;
+    int max_count = _reset_vmp_ranges(&ranges);
+    if (max_count == 0) {
+        goto teardown;
+    }
+    intptr_t * cursor = ranges;
     cursor[0] = -1;
 
     do {
@@ -689,15 +1049,21 @@ int vmp_read_vmaps(const char * fname) {
             }
             if (_ignore_symbols_from_path(info.dli_fname)) {
                 // realloc if the chunk is to small
-                max_count = _resize_ranges(&cursor, max_count);
-                cursor = _add_to_range(cursor, start, end);
+                max_count = _resize_ranges(&ranges, &cursor, max_count);
+                if (max_count == 0) {
+                    free(ranges);
+                    goto teardown;
+                }
+                cursor = _add_to_range(ranges, &count, cursor, start, end);
             }
             addr = addr + vmsize;
         } else if (kr != KERN_INVALID_ADDRESS) {
+            free(ranges);
             goto teardown;
         }
     } while (kr == KERN_SUCCESS);
 
+    _publish_ranges(ranges, count, 1);
     ret = 1;
 
 teardown:
@@ -728,7 +1094,66 @@ static void * libhandle = NULL;
 #define UL_PREFIX "_UL"
 #endif
 
+#ifdef VMPROF_LINUX
+static int _maps_generation_callback(struct dl_phdr_info *info, size_t size, void *data)
+{
+    // the counters are the same in every entry
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        *(long*)data = (long)(info->dlpi_adds + info->dlpi_subs);
+    }
+    return 1;
+}
+#endif
+
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+static int _init_frame_pointer_unwinding(void)
+{
+#ifdef VMPROF_EVAL_FUNCTION
+    Dl_info info;
+    const ElfW(Sym) * sym = NULL;
+    struct rlimit limit;
+
+    // without procedure info, the eval loop is recognized by the range
+    // of its symbol
+    if (dladdr1(VMPROF_EVAL_FUNCTION, &info, (void**)&sym, RTLD_DL_SYMENT) == 0 ||
+            sym == NULL || sym->st_size == 0) {
+        vmprof_error = "the size of the eval loop is unknown";
+        return -1;
+    }
+    vmp_eval_start = (intptr_t)VMPROF_EVAL_FUNCTION;
+    vmp_eval_end = vmp_eval_start + (intptr_t)sym->st_size;
+
+    // threads get stacks of this size by default
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+            limit.rlim_cur > vmp_max_stack_size) {
+        vmp_max_stack_size = limit.rlim_cur;
+    }
+    // other threads register themselves with vmprof.register_native_thread()
+    vmp_native_register_thread();
+    return 0;
+#else
+    vmprof_error = "the eval loop is unknown";
+    return -1;
+#endif
+}
+#endif
+
 int vmp_native_enable(void) {
+#ifdef VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+    if (vmp_unwinder == VMP_UNWIND_FRAME_POINTER) {
+        // libunwind is not needed
+        if (_init_frame_pointer_unwinding() < 0) {
+            fprintf(stderr, "could not set up frame pointer unwinding: %s\n", vmprof_error);
+            vmp_native_traces_enabled = 0;
+            return 0;
+        }
+        vmp_native_traces_enabled = 1;
+        return 1;
+    }
+#endif
+    vmp_native_ip_cache_clear();
+    vmp_ip_cache_hits = 0;
+    vmp_ip_cache_misses = 0;
 #ifdef VMPROF_LINUX
     void * oldhandle = NULL;
     struct link_map * map = NULL;
@@ -822,26 +1247,46 @@ void vmp_native_disable(void) {
     }
 
     vmp_native_traces_enabled = 0;
-    if (vmp_ranges != NULL) {
-        free(vmp_ranges);
-        vmp_ranges = NULL;
+}
+
+void vmp_native_free_ranges(void) {
+    // not while signal handlers might look at them
+    struct vmp_ranges_s * table;
+    _publish_ranges(NULL, 0, 0);
+    while ((table = vmp_ranges_replaced) != NULL) {
+        vmp_ranges_replaced = table->replaced;
+        if (table->owned) { free(table->ranges); }
+        free(table);
     }
-    vmp_range_count = 0;
+}
+
+long vmp_native_maps_generation(void) {
+    // changes whenever a shared object is loaded or unloaded
+#ifdef __APPLE__
+    return (long)_dyld_image_count();
+#elif defined(VMPROF_LINUX)
+    long generation = 0;
+    dl_iterate_phdr(_maps_generation_callback, &generation);
+    return generation;
+#else
+    return 0;
+#endif
 }
 
 int vmp_ignore_ip(intptr_t ip) {
-    if (vmp_range_count == 0) {
+    struct vmp_ranges_s * table = vmp_ranges;
+    if (table == NULL || table->count == 0) {
         return 0;
     }
-    int i = vmp_binary_search_ranges(ip, vmp_ranges, (int)vmp_range_count);
+    int i = vmp_binary_search_ranges(ip, table->ranges, table->count);
     if (i == -1) {
         return 0;
     }
 
     assert((i & 1) == 0 && "returned index MUST be even");
 
-    intptr_t v = vmp_ranges[i];
-    intptr_t v2 = vmp_ranges[i+1];
+    intptr_t v = table->ranges[i];
+    intptr_t v2 = table->ranges[i+1];
     return v <= ip && ip <= v2;
 }
 
@@ -878,15 +1323,17 @@ int vmp_binary_search_ranges(intptr_t ip, intptr_t * l, int count) {
 }
 
 int vmp_ignore_symbol_count(void) {
-    return (int)vmp_range_count;
+    struct vmp_ranges_s * table = vmp_ranges;
+    return table == NULL ? 0 : table->count;
 }
 
 intptr_t * vmp_ignore_symbols(void) {
-    return vmp_ranges;
+    struct vmp_ranges_s * table = vmp_ranges;
+    return table == NULL ? NULL : table->ranges;
 }
 
 void vmp_set_ignore_symbols(intptr_t * symbols, int count) {
-    vmp_ranges = symbols;
-    vmp_range_count = count;
+    // the caller keeps 'symbols' alive
+    _publish_ranges(symbols, count, 0);
 }
 #endif
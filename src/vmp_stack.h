@@ -4,7 +4,6 @@
 
 #ifndef RPYTHON_VMPROF
   #if PY_VERSION_HEX >= 0x030b00f0 /* >= 3.11 */
-  #include "internal/pycore_frame.h"
   #include "populate_frames.h"
   #endif
 #endif
@@ -29,7 +28,21 @@ int vmp_ignore_symbol_count(void);
 intptr_t * vmp_ignore_symbols(void);
 void vmp_set_ignore_symbols(intptr_t * symbols, int count);
 void vmp_native_disable(void);
+#define VMP_UNWIND_LIBUNWIND      0
+#define VMP_UNWIND_FRAME_POINTER  1
+int vmp_native_set_unwinder(int unwinder);
+int vmp_native_unwinder(void);
+void vmp_native_register_thread(void);
+void vmp_native_set_ucontext(void *ucontext);
+void vmp_native_profile_lines(int lines);
+int vmp_native_profiles_lines(void);
+void vmp_native_skip_interpreter(int skip);
+int vmp_native_skips_interpreter(void);
+void vmp_native_free_ranges(void);
+void vmp_native_ip_cache_clear(void);
+void vmp_native_ip_cache_stats(long *hits, long *misses, long *size);
+long vmp_native_maps_generation(void);
 
-#ifdef __unix__
+#if defined(__unix__) || defined(__APPLE__)
 int vmp_read_vmaps(const char * fname);
 #endif
@@ -19,6 +19,12 @@
 #define MARKER_TIME_N_ZONE '\x06'
 #define MARKER_META '\x07'
 #define MARKER_NATIVE_SYMBOLS '\x08'
+#define MARKER_STACK_DEF '\x09'
+#define MARKER_STACK_REF '\x0a'
+#define MARKER_ALLOC '\x0b'
+#define MARKER_LINETABLE '\x0c'
+#define MARKER_MODULE_MAP '\x0d'
+#define MARKER_THREAD_INFO '\x0e'
 
 #define VERSION_BASE '\x00'
 #define VERSION_THREAD_ID '\x01'
@@ -27,12 +33,23 @@
 #define VERSION_MODE_AWARE '\x04'
 #define VERSION_DURATION '\x05'
 #define VERSION_TIMESTAMP '\x06'
+#define VERSION_DROPPED_SAMPLES '\x07'
+#define VERSION_COMPACT '\x08'
 
 #define PROFILE_MEMORY '\x01'
 #define PROFILE_LINES  '\x02'
 #define PROFILE_NATIVE '\x04'
 #define PROFILE_RPYTHON '\x08'
 #define PROFILE_REAL_TIME '\x10'
+#define PROFILE_LINE_OFFSETS '\x20'
+#define PROFILE_TIMESTAMPS '\x40'
+
+/* encodings of the line table in a MARKER_LINETABLE record */
+#define LINETABLE_LNOTAB_UNSIGNED 0   /* co_lnotab, before 3.6 */
+#define LINETABLE_LNOTAB 1            /* co_lnotab, 3.6 - 3.9 */
+#define LINETABLE_PY310 2             /* co_linetable of 3.10 */
+#define LINETABLE_PY311 3             /* co_linetable of 3.11 (locations) */
+#define LINETABLE_CHUNK 4096          /* bytes of the table per record */
 
 #define DYN_JIT_FLAG 0xbeefbeef
 
@@ -54,6 +71,16 @@
 #endif
 #endif
 
+#if defined(VMP_SUPPORTS_NATIVE_PROFILING) && defined(VMPROF_LINUX) && \
+    defined(X86_64) && !defined(RPYTHON_VMPROF)
+#define VMP_SUPPORTS_FRAME_POINTER_UNWINDING
+#endif
+
+#if defined(VMP_SUPPORTS_NATIVE_PROFILING) && defined(VMPROF_LINUX) && \
+    !defined(RPYTHON_VMPROF)
+#define VMP_SUPPORTS_MODULE_MAPS
+#endif
+
 #ifdef RPYTHON_VMPROF
 // only for pypy
 #include "rvmprof.h"
@@ -88,6 +115,7 @@ static inline PyCodeObject* PyFrame_GetCode(PyFrameObject *frame)
 
 #if CPYTHON_HAS_FRAME_EVALUATION
 #define IS_VMPROF_EVAL(PTR) PTR == (void*)_PyEval_EvalFrameDefault
+#define VMPROF_EVAL_FUNCTION ((void*)_PyEval_EvalFrameDefault)
 #else
 #define IS_VMPROF_EVAL(PTR) (PTR == (void*)PyEval_EvalFrameEx || PTR == (void*)PyEval_EvalFrame)
 #endif
@@ -96,5 +124,6 @@ static inline PyCodeObject* PyFrame_GetCode(PyFrameObject *frame)
 
 void set_current_codes(void * to);
 int opened_profile(const char *interp_name, int memory, int proflines, int native, int real_time);
+int reopened_profile(void);
 void flush_codes(void);
 
@@ -0,0 +1,274 @@
+#include "vmprof_alloc.h"
+
+#include "vmprof.h"
+#include "vmprof_common.h"
+#include "vmprof_unix.h"
+#include "vmp_stack.h"
+#include "vmprof_threads.h"
+#include "compat.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* The wrappers below are installed with PyMem_SetAllocator() on the
+   PYMEM_DOMAIN_MEM and PYMEM_DOMAIN_OBJ domains.  Both domains may
+   only be used with the GIL held, which serializes all of the state
+   that is not thread local: the buffer records are appended to and
+   the scratch area the stack is walked into.
+
+   Which allocations are recorded is decided per thread with a byte
+   countdown.  After every sample the next countdown is drawn from an
+   exponential distribution with mean 'sample_bytes', so the samples
+   form a Poisson process over the allocated bytes: an allocation of
+   'size' bytes is recorded with probability 1 - exp(-size/sample_bytes)
+   and there is no aliasing with periodic allocation patterns.
+
+   The record has the layout of a MARKER_STACKTRACE record, the count
+   field holds the size of the allocation:
+
+     MARKER_ALLOC, size, depth, stack[depth], thread
+
+   Records are packed into a shared buffer that is committed when it is
+   full and on vmp_alloc_flush().  If no buffer is available the sample
+   is thrown away, an allocation never waits for the writer.
+*/
+
+static long alloc_sample_bytes = 0;
+static long alloc_generation = 0;
+
+static PyMemAllocatorEx alloc_orig_mem;
+static PyMemAllocatorEx alloc_orig_obj;
+
+static struct profbuf_s *current_allocs = NULL;
+static void *alloc_stack[MAX_STACK_DEPTH];
+
+struct alloc_tls_s {
+    long generation;     /* alloc_generation the countdown was drawn for */
+    long countdown;      /* bytes left until the next sample */
+    uint64_t rng;
+    int busy;            /* set while a sample is being recorded */
+};
+
+static __thread struct alloc_tls_s alloc_tls;
+
+#if PY_VERSION_HEX < 0x030900B1 /* < 3.9 */
+static inline PyFrameObject* PyThreadState_GetFrame(PyThreadState *tstate)
+{
+    Py_XINCREF(tstate->frame);
+    return tstate->frame;
+}
+#endif
+
+static double alloc_random(struct alloc_tls_s *tls)
+{
+    /* xorshift64*, uniform in [0, 1) */
+    uint64_t x = tls->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    tls->rng = x;
+    return (double)((x * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static long alloc_next_countdown(struct alloc_tls_s *tls)
+{
+    double next = -(double)alloc_sample_bytes * log(1.0 - alloc_random(tls));
+    if (next < 1.0)
+        return 1;
+    if (next > (double)LONG_MAX / 2)
+        return LONG_MAX / 2;
+    return (long)next;
+}
+
+static void alloc_reset_tls(struct alloc_tls_s *tls)
+{
+    tls->generation = alloc_generation;
+    tls->rng = ((uint64_t)(uintptr_t)tls * 0x9E3779B97F4A7C15ULL) ^
+               (uint64_t)time(NULL) ^ (uint64_t)alloc_generation;
+    if (tls->rng == 0)
+        tls->rng = 0x2545F4914F6CDD1DULL;
+    tls->countdown = alloc_next_countdown(tls);
+}
+
+static int alloc_walk_stack(PyThreadState *tstate)
+{
+    int depth;
+#if PY_VERSION_HEX >= 0x030B0000 /* >= 3.11 */
+    _PyInterpreterFrame * frame = unsafe_PyThreadState_GetInterpreterFrame(tstate);
+#else
+    PyFrameObject * frame = PyThreadState_GetFrame(tstate);
+#endif
+    if (frame == NULL)
+        return 0;
+    depth = vmp_walk_and_record_stack(frame, alloc_stack, MAX_STACK_DEPTH-1, 0, 0);
+#if PY_VERSION_HEX < 0x030B0000 /* < 3.11 */
+    Py_XDECREF(frame);
+#endif
+    return depth;
+}
+
+static void alloc_record(size_t size)
+{
+    PyThreadState *tstate;
+    struct profbuf_s *p;
+    void *thread;
+    long depth, lsize;
+    long blocklen;
+    char *t;
+
+    tstate = PyGILState_GetThisThreadState();
+    if (tstate == NULL)
+        return;
+
+    depth = alloc_walk_stack(tstate);
+    if (depth <= 0)
+        return;
+
+    lsize = (long)size;
+    blocklen = 1 + 2 * sizeof(long) + (depth + 1) * sizeof(void *);
+
+    p = current_allocs;
+    if (p != NULL && SINGLE_BUF_SIZE - p->data_size < (size_t)blocklen) {
+        current_allocs = NULL;
+        commit_buffer(vmp_profile_fileno(), p);
+        p = NULL;
+    }
+    if (p == NULL) {
+        p = reserve_buffer(vmp_profile_fileno());
+        if (p == NULL)
+            return;
+        current_allocs = p;
+    }
+
+    t = p->data + p->data_size;
+    p->data_size += blocklen;
+    *t++ = MARKER_ALLOC;
+    memcpy(t, &lsize, sizeof(long)); t += sizeof(long);
+    memcpy(t, &depth, sizeof(long)); t += sizeof(long);
+    memcpy(t, alloc_stack, depth * sizeof(void *)); t += depth * sizeof(void *);
+#ifdef VMPROF_LINUX
+    thread = (void *)vmp_thread_id();
+#else
+    thread = tstate;
+#endif
+    memcpy(t, &thread, sizeof(void *));
+}
+
+static void alloc_account(size_t size)
+{
+    struct alloc_tls_s *tls = &alloc_tls;
+
+    if (tls->busy)
+        return;
+    if (tls->generation != alloc_generation) {
+        tls->busy = 1;
+        alloc_reset_tls(tls);
+        tls->busy = 0;
+    }
+    tls->countdown -= (long)size;
+    if (tls->countdown > 0)
+        return;
+
+    tls->busy = 1;
+    /* vmprof_ignore_signals() (e.g. stop_sampling) must keep allocation
+       samples out of the profile just like stack samples */
+    if (vmprof_enter_signal() == 0 && vmprof_is_enabled()) {
+        alloc_record(size);
+    }
+    vmprof_exit_signal();
+    tls->countdown = alloc_next_countdown(tls);
+    tls->busy = 0;
+}
+
+static void *alloc_malloc(void *ctx, size_t size)
+{
+    PyMemAllocatorEx *orig = (PyMemAllocatorEx *)ctx;
+    void *ptr = orig->malloc(orig->ctx, size);
+    if (ptr != NULL)
+        alloc_account(size);
+    return ptr;
+}
+
+static void *alloc_calloc(void *ctx, size_t nelem, size_t elsize)
+{
+    PyMemAllocatorEx *orig = (PyMemAllocatorEx *)ctx;
+    void *ptr = orig->calloc(orig->ctx, nelem, elsize);
+    if (ptr != NULL)
+        alloc_account(nelem * elsize);
+    return ptr;
+}
+
+static void *alloc_realloc(void *ctx, void *old, size_t new_size)
+{
+    PyMemAllocatorEx *orig = (PyMemAllocatorEx *)ctx;
+    void *ptr = orig->realloc(orig->ctx, old, new_size);
+    if (ptr != NULL)
+        alloc_account(new_size);
+    return ptr;
+}
+
+static void alloc_free(void *ctx, void *ptr)
+{
+    PyMemAllocatorEx *orig = (PyMemAllocatorEx *)ctx;
+    orig->free(orig->ctx, ptr);
+}
+
+static void alloc_install(PyMemAllocatorDomain domain, PyMemAllocatorEx *orig)
+{
+    PyMemAllocatorEx hook;
+
+    PyMem_GetAllocator(domain, orig);
+    hook.ctx = orig;
+    hook.malloc = alloc_malloc;
+    hook.calloc = alloc_calloc;
+    hook.realloc = alloc_realloc;
+    hook.free = alloc_free;
+    PyMem_SetAllocator(domain, &hook);
+}
+
+int vmp_alloc_enable(long sample_bytes)
+{
+    if (sample_bytes <= 0 || alloc_sample_bytes > 0)
+        return -1;
+    alloc_sample_bytes = sample_bytes;
+    alloc_generation++;
+    alloc_install(PYMEM_DOMAIN_MEM, &alloc_orig_mem);
+    alloc_install(PYMEM_DOMAIN_OBJ, &alloc_orig_obj);
+    return 0;
+}
+
+int vmp_alloc_disable(void)
+{
+    if (alloc_sample_bytes <= 0)
+        return 0;
+    /* blocks allocated through the wrappers are released by the same
+       underlying allocator, so the originals can be put back any time */
+    PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &alloc_orig_mem);
+    PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &alloc_orig_obj);
+    alloc_sample_bytes = 0;
+    vmp_alloc_flush();
+    return 0;
+}
+
+int vmp_alloc_enabled(void)
+{
+    return alloc_sample_bytes > 0;
+}
+
+void vmp_alloc_flush(void)
+{
+    struct profbuf_s *p = current_allocs;
+    if (p != NULL) {
+        current_allocs = NULL;
+        commit_buffer(vmp_profile_fileno(), p);
+    }
+}
+
+void vmp_alloc_atfork_child(void)
+{
+    /* the buffers of the parent are gone */
+    current_allocs = NULL;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+/* Allocation sampling (CPython only).  The PyMem "mem" and "object"
+   allocators are wrapped; on average every 'sample_bytes' allocated
+   bytes one allocation is recorded together with its Python stack as
+   a MARKER_ALLOC record. */
+
+int vmp_alloc_enable(long sample_bytes);
+int vmp_alloc_disable(void);
+int vmp_alloc_enabled(void);
+void vmp_alloc_flush(void);
+void vmp_alloc_atfork_child(void);
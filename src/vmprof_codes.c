@@ -0,0 +1,226 @@
+#include "vmprof_codes.h"
+
+#include "vmprof.h"
+#include "vmprof_common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Open addressing table of code ids.  A free slot (key 0) or a
+   tombstone is claimed with a compare-and-swap, so the signal handler
+   can insert without locks.  The state of a slot moves:
+
+     CODE_IDLE    -> CODE_SEEN      sampler (any thread, signal handler)
+     CODE_SEEN    -> CODE_EMITTED   drain (GIL held)
+
+   and when the code object is deallocated (GIL held) the slot is given
+   back: its state goes to CODE_IDLE and its key to CODE_TOMBSTONE,
+   which lookups step over and inserts reuse.  A code id that was seen
+   but not yet emitted is emitted by the caller right then, so code
+   objects that come and go do not fill the table.
+
+   A code object can only be deallocated once no frame uses it, i.e.
+   after every sample that marked it, so no sampler is inserting its id
+   meanwhile and the drain never looks at a code object that is gone.
+   Two samplers that insert the same id while a tombstone appears can
+   claim two slots; both are given back on deallocation.
+
+   Slots never become free again (until the next reset), so every
+   slot between the hash of an id and the slot of the id stays in use.
+   When an id finds no slot within CODE_MAX_PROBES the table is
+   considered full; disable() then falls back to searching the heap.
+*/
+
+#define CODE_TABLE_SIZE   (1 << 16)
+#define CODE_MAX_PROBES   32
+
+#define CODE_IDLE     0
+#define CODE_SEEN     1
+#define CODE_EMITTED  2
+
+/* code objects are aligned, no id is odd */
+#define CODE_TOMBSTONE  ((intptr_t)1)
+
+struct code_slot_s {
+    intptr_t volatile uid;      /* 0 if the slot is free */
+    long volatile state;
+};
+
+static struct code_slot_s *code_table = NULL;
+static long volatile code_pending = 0;
+static int volatile code_overflow = 0;
+static int volatile drain_scheduled = 0;
+static vmp_emit_code_fn code_emit = NULL;
+
+static inline size_t _code_hash(intptr_t uid)
+{
+    /* code objects are at least 16 byte aligned */
+    uint64_t h = (uint64_t)(uintptr_t)uid >> 4;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (CODE_TABLE_SIZE - 1);
+}
+
+static struct code_slot_s *_code_find(intptr_t uid, size_t *i, int *probes)
+{
+    /* continues the search at slot '*i' after '*probes' probes */
+    for (; *probes < CODE_MAX_PROBES; (*probes)++) {
+        struct code_slot_s *slot = &code_table[*i];
+        intptr_t key = slot->uid;
+        if (key == uid)
+            return slot;
+        if (key == 0)
+            break;
+        *i = (*i + 1) & (CODE_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+static struct code_slot_s *_code_insert(intptr_t uid)
+{
+    int attempts;
+
+    /* a compare-and-swap only fails if another sampler claimed the
+       slot just now, look again then */
+    for (attempts = 0; attempts < 4; attempts++) {
+        size_t i = _code_hash(uid);
+        int probes;
+        struct code_slot_s *reuse = NULL;
+        intptr_t expected = CODE_TOMBSTONE;
+
+        for (probes = 0; probes < CODE_MAX_PROBES; probes++) {
+            struct code_slot_s *slot = &code_table[i];
+            intptr_t key = slot->uid;
+            if (key == uid)
+                return slot;
+            if (key == CODE_TOMBSTONE && reuse == NULL)
+                reuse = slot;
+            if (key == 0) {
+                if (reuse == NULL) {
+                    reuse = slot;
+                    expected = 0;
+                }
+                break;
+            }
+            i = (i + 1) & (CODE_TABLE_SIZE - 1);
+        }
+        if (reuse == NULL)
+            return NULL;
+        if (__sync_bool_compare_and_swap(&reuse->uid, expected, uid))
+            return reuse;
+        if (reuse->uid == uid)
+            return reuse;   /* another thread claimed it for us */
+    }
+    return NULL;
+}
+int vmp_codes_reset(vmp_emit_code_fn emit)
+{
+    /* not running concurrently with the sampler */
+    if (code_table == NULL) {
+        code_table = calloc(CODE_TABLE_SIZE, sizeof(struct code_slot_s));
+        if (code_table == NULL)
+            return -1;
+    } else {
+        memset(code_table, 0, CODE_TABLE_SIZE * sizeof(struct code_slot_s));
+    }
+    code_emit = emit;
+    code_pending = 0;
+    code_overflow = 0;
+    return 0;
+}
+
+void vmp_code_seen(intptr_t code_uid)
+{
+    /* called from the signal handler */
+    struct code_slot_s *slot;
+
+    if (code_table == NULL)
+        return;
+    slot = _code_insert(code_uid);
+    if (slot == NULL) {
+        code_overflow = 1;
+        return;
+    }
+    if (slot->state == CODE_IDLE &&
+            __sync_bool_compare_and_swap(&slot->state, CODE_IDLE, CODE_SEEN)) {
+        __sync_fetch_and_add(&code_pending, 1L);
+    }
+}
+
+int vmp_code_freed(intptr_t code_uid)
+{
+    /* returns 1 if the code object still has to be emitted */
+    struct code_slot_s *slot;
+    size_t i;
+    int probes = 0, emit = 0;
+
+    if (code_table == NULL)
+        return 0;
+    i = _code_hash(code_uid);
+    while ((slot = _code_find(code_uid, &i, &probes)) != NULL) {
+        if (__sync_lock_test_and_set(&slot->state, CODE_IDLE) == CODE_SEEN) {
+            __sync_fetch_and_sub(&code_pending, 1L);
+            emit = 1;
+        }
+        /* the state is reset before a sampler can claim the slot */
+        __sync_lock_test_and_set(&slot->uid, CODE_TOMBSTONE);
+        i = (i + 1) & (CODE_TABLE_SIZE - 1);
+        probes++;
+    }
+    return emit;
+}
+
+int vmp_codes_drain(void)
+{
+    size_t i;
+    int res = 0;
+
+    if (code_table == NULL || code_emit == NULL)
+        return 0;
+    if (code_pending == 0)
+        return 0;
+    for (i = 0; i < CODE_TABLE_SIZE; i++) {
+        struct code_slot_s *slot = &code_table[i];
+        if (slot->state != CODE_SEEN)
+            continue;
+        if (!__sync_bool_compare_and_swap(&slot->state, CODE_SEEN, CODE_EMITTED))
+            continue;
+        __sync_fetch_and_sub(&code_pending, 1L);
+        if (code_emit(slot->uid) < 0)
+            res = -1;
+    }
+    return res;
+}
+
+static int _drain_pending_call(void *arg)
+{
+    drain_scheduled = 0;
+    /* while the profile is being read (see stop_sampling) the code
+       objects are left for write_all_code_objects() */
+    if (vmprof_is_enabled() && !vmp_writes_suspended()) {
+        if (vmp_codes_drain() < 0) {
+            /* a code object we could not describe, the reader shows it
+               as unknown; do not raise in some random place */
+            PyErr_Clear();
+        }
+        /* hand the records to the writer now, not when the buffer is
+           full: a profile that is cut short still names its code */
+        flush_codes();
+    }
+    return 0;
+}
+
+void vmp_codes_schedule_drain(void)
+{
+    /* called by the writer thread, without the GIL */
+    if (code_pending == 0)
+        return;
+    if (!__sync_bool_compare_and_swap(&drain_scheduled, 0, 1))
+        return;
+    if (Py_AddPendingCall(_drain_pending_call, NULL) < 0)
+        drain_scheduled = 0;
+}
+
+int vmp_codes_overflowed(void)
+{
+    return code_overflow;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "vmprof.h"
+
+/* Code objects seen by the sampler (CPython only).
+ *
+ * The signal handler marks the id of every code object it puts on a
+ * stack.  Ids that were marked but not yet written to the profile are
+ * emitted later with the GIL held: by a pending call the writer thread
+ * schedules, when the code object is deallocated, and finally by
+ * disable().  Nothing has to walk the heap to find the code objects of
+ * a profile, unless the table overflowed.
+ */
+
+typedef int (*vmp_emit_code_fn)(intptr_t code_uid);
+
+int vmp_codes_reset(vmp_emit_code_fn emit);
+void vmp_code_seen(intptr_t code_uid);
+int vmp_code_freed(intptr_t code_uid);
+int vmp_codes_drain(void);
+void vmp_codes_schedule_drain(void);
+int vmp_codes_overflowed(void);
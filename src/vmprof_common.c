@@ -2,6 +2,10 @@
 
 #include <assert.h>
 #include <errno.h>
+#ifdef VMPROF_LINUX
+#include <stdio.h>
+#include <string.h>
+#endif
 
 #ifdef RPYTHON_VMPROF
 
@@ -23,26 +27,86 @@ int get_stack_trace(PY_THREAD_STATE_T * current, void** result, int max_depth, i
 #include "vmp_stack.h" // reduces warings
 #endif
 
+#if defined(VMPROF_UNIX) && !defined(RPYTHON_VMPROF)
+#include "vmprof_compress.h"
+#endif
+
 
 static volatile int is_enabled = 0;
 static long prepare_interval_usec = 0;
 static long profile_interval_usec = 0;
 
+/* the arguments of the last opened_profile(), see reopened_profile() */
+static struct {
+    const char *interp_name;
+    int memory, proflines, native, real_time;
+} opened_args;
+
 #ifdef VMPROF_UNIX
+#include "khash.h"
+
+/* A thread registered for sampling.  On Linux, in real time mode and
+   with per-thread timers, every registered thread owns a POSIX timer
+   that signals only this very thread.  The timer runs on the wall clock
+   (real time mode) or on the CPU clock of the thread. */
+struct vmp_thread_s {
+    pthread_t th;
+#ifdef VMPROF_LINUX
+    pid_t tid;
+    unsigned long long start_time;  /* tells reused thread ids apart */
+    timer_t timer;
+    int has_timer;
+#endif
+};
+
+#define THREAD_KEY(th) ((khint64_t)(uintptr_t)(th))
+KHASH_MAP_INIT_INT64(vmp_threads, struct vmp_thread_s)
+
 static int signal_type = SIGPROF;
 static int itimer_type = ITIMER_PROF;
-static pthread_t *threads = NULL;
-static size_t threads_size = 0;
-static size_t thread_count = 0;
-static size_t threads_size_step = 8;
+static int per_thread = 0;
+static int profile_timestamps = 0;
+static int64_t timestamp_base = 0;
+static khash_t(vmp_threads) *threads = NULL;
 
 int vmprof_get_itimer_type(void) {
     return itimer_type;
 }
 
+static int64_t _monotonic_usec(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 int vmprof_get_signal_type(void) {
     return signal_type;
 }
+
+int vmprof_get_per_thread(void) {
+    return per_thread;
+}
+
+void vmprof_set_per_thread(int value) {
+    per_thread = value;
+}
+
+void vmprof_set_timestamps(int value) {
+    /* samples record the microseconds since now and the cpu they were
+       taken on; a new segment of the profile starts again at 0 */
+    profile_timestamps = value;
+    timestamp_base = _monotonic_usec();
+}
+
+int vmprof_get_timestamps(void) {
+    return profile_timestamps;
+}
+
+int64_t vmprof_timestamp_now(void) {
+    return _monotonic_usec() - timestamp_base;
+}
 #endif
 
 #ifdef VMPROF_WINDOWS
@@ -103,6 +167,12 @@ char *vmprof_init(int fd, double interval, int memory,
     }
 #endif
     vmp_set_profile_fileno(fd);
+#if defined(VMPROF_UNIX) && !defined(RPYTHON_VMPROF)
+    if (vmp_compress_start(fd) < 0) {
+        vmp_set_profile_fileno(0);
+        return "cannot set up the compression";
+    }
+#endif
     if (opened_profile(interp_name, memory, proflines, native, real_time) < 0) {
         vmp_set_profile_fileno(0);
         return strerror(errno);
@@ -122,6 +192,12 @@ int opened_profile(const char *interp_name, int memory, int proflines, int nativ
     const char * machine;
     size_t namelen = strnlen(interp_name, 255);
 
+    opened_args.interp_name = interp_name;
+    opened_args.memory = memory;
+    opened_args.proflines = proflines;
+    opened_args.native = native;
+    opened_args.real_time = real_time;
+
     machine = vmp_machine_os_name();
 
     header.hdr[0] = 0;
@@ -135,11 +211,23 @@ int opened_profile(const char *interp_name, int memory, int proflines, int nativ
     }
     header.interp_name[0] = MARKER_HEADER;
     header.interp_name[1] = '\x00';
-    header.interp_name[2] = VERSION_TIMESTAMP;
+#ifdef VMPROF_UNIX
+    /* the writer thread compacts the samples, see vmprof_mt.c */
+    header.interp_name[2] = VERSION_COMPACT;
+#else
+    header.interp_name[2] = VERSION_DROPPED_SAMPLES;
+#endif
     header.interp_name[3] = memory*PROFILE_MEMORY + proflines*PROFILE_LINES + \
                             native*PROFILE_NATIVE + real_time*PROFILE_REAL_TIME;
 #ifdef RPYTHON_VMPROF
     header.interp_name[3] += PROFILE_RPYTHON;
+#else
+    /* lines are resolved by the reader, see _write_python_stack_entry */
+    header.interp_name[3] += proflines*PROFILE_LINE_OFFSETS;
+#ifdef VMPROF_UNIX
+    if (vmprof_get_timestamps())
+        header.interp_name[3] += PROFILE_TIMESTAMPS;
+#endif
 #endif
     header.interp_name[4] = (char)namelen;
 
@@ -164,6 +252,14 @@ int opened_profile(const char *interp_name, int memory, int proflines, int nativ
     return success;
 }
 
+int reopened_profile(void)
+{
+    /* writes the same header again, to a new profile file descriptor */
+    return opened_profile(opened_args.interp_name, opened_args.memory,
+                          opened_args.proflines, opened_args.native,
+                          opened_args.real_time);
+}
+
 
 #ifdef RPYTHON_VMPROF
 #ifndef RPYTHON_LL2CTYPES
@@ -213,78 +309,262 @@ intptr_t vmprof_get_traceback(void *stack, void *ucontext,
 
 #ifdef VMPROF_UNIX
 
-ssize_t search_thread(pthread_t tid, ssize_t i)
+#ifdef VMPROF_LINUX
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static long thread_timers_interval_usec = 0;
+
+int vmp_uses_thread_timers(void)
 {
-    if (i < 0)
-        i = 0;
-    while ((size_t)i < thread_count) {
-        if (pthread_equal(threads[i], tid))
-            return i;
-        i++;
-    }
-    return -1;
+    return per_thread || signal_type == SIGALRM;
 }
 
-ssize_t insert_thread(pthread_t tid, ssize_t i)
+static int _create_thread_timer(struct vmp_thread_s *t)
 {
-    assert(signal_type == SIGALRM);
-    i = search_thread(tid, i);
-    if (i > 0)
+    struct sigevent sev;
+    clockid_t clock;
+
+    if (signal_type == SIGALRM)
+        clock = CLOCK_MONOTONIC;
+    else if (pthread_getcpuclockid(t->th, &clock) != 0)
+        return -1;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = signal_type;
+    sev.sigev_notify_thread_id = t->tid;
+    if (timer_create(clock, &sev, &t->timer) != 0)
         return -1;
-    if (thread_count == threads_size) {
-        threads_size += threads_size_step;
-        threads = realloc(threads, sizeof(pthread_t) * threads_size);
-        assert(threads != NULL);
-        memset(threads + thread_count, 0, sizeof(pthread_t) * threads_size_step);
+    t->has_timer = 1;
+    return 0;
+}
+
+static int _arm_thread_timer(struct vmp_thread_s *t, long interval_usec)
+{
+    /* an interval of 0 disarms the timer */
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_usec / 1000000;
+    its.it_interval.tv_nsec = (interval_usec % 1000000) * 1000;
+    its.it_value = its.it_interval;
+    return timer_settime(t->timer, 0, &its, NULL);
+}
+
+static void _delete_thread_timer(struct vmp_thread_s *t)
+{
+    if (t->has_timer) {
+        timer_delete(t->timer);
+        t->has_timer = 0;
     }
-    threads[thread_count++] = tid;
-    return thread_count;
 }
 
-ssize_t remove_thread(pthread_t tid, ssize_t i)
+static unsigned long long _thread_start_time(pid_t tid)
 {
-    assert(signal_type == SIGALRM);
-    if (thread_count == 0)
+    /* in clock ticks since boot, 0 if there is no such thread */
+    char path[64], buf[512], *p;
+    unsigned long long start_time = 0;
+    size_t count;
+    int field;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+    if ((f = fopen(path, "r")) == NULL)
+        return 0;
+    count = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[count] = '\0';
+    /* the name in parentheses may contain anything, the fields after
+       it start with the state (field 3), the start time is field 22 */
+    if ((p = strrchr(buf, ')')) == NULL)
+        return 0;
+    for (field = 2; field < 22 && p != NULL; field++)
+        p = strchr(p + 1, ' ');
+    if (p != NULL)
+        start_time = strtoull(p + 1, NULL, 10);
+    return start_time;
+}
+
+static int _thread_is_gone(struct vmp_thread_s *t)
+{
+    return _thread_start_time(t->tid) != t->start_time;
+}
+
+#ifndef RPYTHON_VMPROF
+static volatile int reap_scheduled = 0;
+
+static int _reap_pending_call(void *arg)
+{
+    /* The timers of threads that ended without remove_thread() stay
+       until they are deleted, each of them holds a queued signal of
+       RLIMIT_SIGPENDING.  The table is only changed with the GIL held,
+       and a thread id that is gone is enough here, insert_thread()
+       looks closer at the entry it would replace. */
+    khint_t k;
+    pid_t pid = getpid();
+    reap_scheduled = 0;
+    if (threads == NULL || !vmp_uses_thread_timers())
+        return 0;
+    for (k = kh_begin(threads); k != kh_end(threads); k++) {
+        struct vmp_thread_s *t;
+        if (!kh_exist(threads, k))
+            continue;
+        t = &kh_value(threads, k);
+        if (t->has_timer && syscall(SYS_tgkill, pid, t->tid, 0) != 0 &&
+                errno == ESRCH) {
+            _delete_thread_timer(t);
+            /* deleting does not move the other entries */
+            kh_del(vmp_threads, threads, k);
+        }
+    }
+    return 0;
+}
+
+void vmp_schedule_reap_threads(void)
+{
+    /* called by the writer thread about once a second, without the GIL */
+    if (!__sync_bool_compare_and_swap(&reap_scheduled, 0, 1))
+        return;
+    if (Py_AddPendingCall(_reap_pending_call, NULL) < 0)
+        reap_scheduled = 0;
+}
+#endif
+
+int vmp_arm_thread_timers(long interval_usec)
+{
+    khint_t k;
+    int result = 0;
+    thread_timers_interval_usec = interval_usec;
+    if (threads == NULL)
+        return 0;
+    for (k = kh_begin(threads); k != kh_end(threads); k++) {
+        struct vmp_thread_s *t;
+        if (!kh_exist(threads, k))
+            continue;
+        t = &kh_value(threads, k);
+        if (t->has_timer && _arm_thread_timer(t, interval_usec) != 0) {
+            if (errno != ESRCH) {
+                result = -1;
+                continue;
+            }
+            /* the thread is gone, its timer will never fire */
+            _delete_thread_timer(t);
+            kh_del(vmp_threads, threads, k);
+        }
+    }
+    return result;
+}
+#endif
+
+ssize_t insert_thread(pthread_t tid, long native_id)
+{
+    /* 'native_id' is the kernel thread id, it is only needed (and must
+       not be 0) if the thread gets its own timer */
+    struct vmp_thread_s t;
+    khint_t k;
+    int absent;
+    assert(signal_type == SIGALRM || per_thread);
+
+    if (threads == NULL && (threads = kh_init(vmp_threads)) == NULL)
+        return -1;
+    k = kh_get(vmp_threads, threads, THREAD_KEY(tid));
+    if (k != kh_end(threads)) {
+#ifdef VMPROF_LINUX
+        /* A new thread might have the pthread_t of a dead one, whose
+           timer holds a queued signal of RLIMIT_SIGPENDING until it is
+           deleted.  Only that entry is looked at, the other dead threads
+           are reaped by vmp_schedule_reap_threads(). */
+        struct vmp_thread_s *old = &kh_value(threads, k);
+        if (!old->has_timer || !_thread_is_gone(old))
+            return -1;   /* already registered */
+        _delete_thread_timer(old);
+        kh_del(vmp_threads, threads, k);
+#else
+        return -1;   /* already registered */
+#endif
+    }
+
+    memset(&t, 0, sizeof(struct vmp_thread_s));
+    t.th = tid;
+#ifdef VMPROF_LINUX
+    if (vmp_uses_thread_timers()) {
+        t.tid = (pid_t)native_id;
+        if (native_id == 0 || (t.start_time = _thread_start_time(t.tid)) == 0 ||
+                _create_thread_timer(&t) != 0)
+            return -1;
+        if (thread_timers_interval_usec > 0 &&
+                _arm_thread_timer(&t, thread_timers_interval_usec) != 0) {
+            _delete_thread_timer(&t);
+            return -1;
+        }
+    }
+#endif
+    k = kh_put(vmp_threads, threads, THREAD_KEY(tid), &absent);
+    if (absent < 0) {
+#ifdef VMPROF_LINUX
+        _delete_thread_timer(&t);
+#endif
         return -1;
+    }
+    kh_value(threads, k) = t;
+    return kh_size(threads);
+}
+
+ssize_t remove_thread(pthread_t tid)
+{
+    khint_t k;
+    assert(signal_type == SIGALRM || per_thread);
     if (threads == NULL)
         return -1;
-    i = search_thread(tid, i);
-    if (i < 0)
+    k = kh_get(vmp_threads, threads, THREAD_KEY(tid));
+    if (k == kh_end(threads))
         return -1;
-    threads[i] = threads[--thread_count];
-    threads[thread_count] = 0;
-    return thread_count;
+#ifdef VMPROF_LINUX
+    _delete_thread_timer(&kh_value(threads, k));
+#endif
+    kh_del(vmp_threads, threads, k);
+    return kh_size(threads);
 }
 
 ssize_t remove_threads(void)
 {
-    assert(signal_type == SIGALRM);
+    assert(signal_type == SIGALRM || per_thread);
     if (threads != NULL) {
-        free(threads);
+#ifdef VMPROF_LINUX
+        khint_t k;
+        for (k = kh_begin(threads); k != kh_end(threads); k++) {
+            if (kh_exist(threads, k))
+                _delete_thread_timer(&kh_value(threads, k));
+        }
+#endif
+        kh_destroy(vmp_threads, threads);
         threads = NULL;
     }
-    thread_count = 0;
-    threads_size = 0;
     return 0;
 }
 
+#ifndef VMPROF_LINUX
 int broadcast_signal_for_threads(void)
 {
     int done = 1;
-    size_t i = 0;
+    khint_t k;
     pthread_t self = pthread_self();
     pthread_t tid;
-    while (i < thread_count) {
-        tid = threads[i];
+    if (threads == NULL)
+        return done;
+    for (k = kh_begin(threads); k != kh_end(threads); k++) {
+        if (!kh_exist(threads, k))
+            continue;
+        tid = kh_value(threads, k).th;
         if (pthread_equal(tid, self)) {
             done = 0;
         } else if (pthread_kill(tid, SIGALRM)) {
-            remove_thread(tid, i);
+            /* deleting does not move the other entries */
+            kh_del(vmp_threads, threads, k);
         }
-        i++;
     }
     return done;
 }
+#endif
 
 int is_main_thread(void)
 {
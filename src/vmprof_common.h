@@ -31,9 +31,8 @@
 
 #ifdef VMPROF_UNIX
 
-ssize_t search_thread(pthread_t tid, ssize_t i);
-ssize_t insert_thread(pthread_t tid, ssize_t i);
-ssize_t remove_thread(pthread_t tid, ssize_t i);
+ssize_t insert_thread(pthread_t tid, long native_id);
+ssize_t remove_thread(pthread_t tid);
 ssize_t remove_threads(void);
 
 #endif
@@ -82,6 +81,7 @@ char *vmprof_init(int fd, double interval, int memory,
                   int proflines, const char *interp_name, int native, int real_time);
 
 int opened_profile(const char *interp_name, int memory, int proflines, int native, int real_time);
+int reopened_profile(void);
 
 #ifdef RPYTHON_VMPROF
 PY_STACK_FRAME_T *get_vmprof_stack(void);
@@ -99,6 +99,19 @@ int vmprof_is_enabled(void);
 void vmprof_set_enabled(int value);
 int vmprof_get_itimer_type(void);
 #ifdef VMPROF_UNIX
-int broadcast_signal_for_threads(void);
+int vmprof_get_per_thread(void);
+void vmprof_set_per_thread(int value);
+void vmprof_set_timestamps(int value);
+int vmprof_get_timestamps(void);
+int64_t vmprof_timestamp_now(void);
 int is_main_thread(void);
 #endif
+#ifdef VMPROF_LINUX
+int vmp_uses_thread_timers(void);
+int vmp_arm_thread_timers(long interval_usec);
+#ifndef RPYTHON_VMPROF
+void vmp_schedule_reap_threads(void);
+#endif
+#elif defined(VMPROF_UNIX)
+int broadcast_signal_for_threads(void);
+#endif
@@ -0,0 +1,168 @@
+#include "vmprof_compress.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define COMPRESS_OUT_SIZE 65536
+
+static int compress_level = 0;
+static int volatile compressing = 0;
+static int member_open = 0;
+static z_stream zs;
+static unsigned char *zout = NULL;
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void vmp_set_compression(int level)
+{
+    /* 0 turns it off, takes effect with the next profile */
+    compress_level = level;
+}
+
+int vmp_compression(void)
+{
+    return compressing ? compress_level : 0;
+}
+
+static void _compress_free(void)
+{
+    if (compressing) {
+        (void)deflateEnd(&zs);
+        compressing = 0;
+    }
+    free(zout);
+    zout = NULL;
+    member_open = 0;
+}
+
+int vmp_compress_start(int fd)
+{
+    _compress_free();
+    if (compress_level <= 0)
+        return 0;
+    zout = malloc(COMPRESS_OUT_SIZE);
+    if (zout == NULL)
+        return -1;
+    memset(&zs, 0, sizeof(zs));
+    /* 16 + window bits: a gzip header and trailer around the data */
+    if (deflateInit2(&zs, compress_level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(zout);
+        zout = NULL;
+        return -1;
+    }
+    compressing = 1;
+    return 0;
+}
+
+static int _write_fully(int fd, const unsigned char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t count = write(fd, buf, size);
+        if (count > 0) {
+            buf += count;
+            size -= count;
+        }
+        else if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+            usleep(1);
+        }
+        else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int _deflate(int fd, int flush)
+{
+    /* consumes all of the input, writes what deflate() produces */
+    do {
+        size_t have;
+        zs.next_out = zout;
+        zs.avail_out = COMPRESS_OUT_SIZE;
+        if (deflate(&zs, flush) == Z_STREAM_ERROR)
+            return -1;
+        have = COMPRESS_OUT_SIZE - zs.avail_out;
+        if (have > 0 && _write_fully(fd, zout, have) < 0)
+            return -1;
+    } while (zs.avail_out == 0);
+    return 0;
+}
+
+static int _compress(int fd, const void *buf, size_t size)
+{
+    if (!member_open) {
+        /* the profile might have been read back through this file
+           descriptor, a new member goes to the end */
+        (void)lseek(fd, 0, SEEK_END);
+        member_open = 1;
+    }
+    zs.next_in = (Bytef *)buf;
+    zs.avail_in = (uInt)size;
+    return _deflate(fd, Z_NO_FLUSH);
+}
+
+ssize_t vmp_stream_write(int fd, const void *buf, size_t size)
+{
+    int res;
+    if (!compressing)
+        return write(fd, buf, size);
+    pthread_mutex_lock(&compress_lock);
+    res = _compress(fd, buf, size);
+    pthread_mutex_unlock(&compress_lock);
+    return res < 0 ? -1 : (ssize_t)size;
+}
+
+ssize_t vmp_stream_writev(int fd, const struct iovec *iov, int count)
+{
+    ssize_t total = 0;
+    int i;
+    if (!compressing)
+        return writev(fd, iov, count);
+    pthread_mutex_lock(&compress_lock);
+    for (i = 0; i < count; i++) {
+        if (_compress(fd, iov[i].iov_base, iov[i].iov_len) < 0) {
+            total = -1;
+            break;
+        }
+        total += iov[i].iov_len;
+    }
+    pthread_mutex_unlock(&compress_lock);
+    return total;
+}
+
+int vmp_compress_end_member(int fd)
+{
+    int res = 0;
+    if (!compressing)
+        return 0;
+    pthread_mutex_lock(&compress_lock);
+    if (member_open) {
+        zs.next_in = NULL;
+        zs.avail_in = 0;
+        res = _deflate(fd, Z_FINISH);
+        (void)deflateReset(&zs);
+        member_open = 0;
+    }
+    pthread_mutex_unlock(&compress_lock);
+    return res;
+}
+
+int vmp_compress_stop(int fd)
+{
+    int res = vmp_compress_end_member(fd);
+    pthread_mutex_lock(&compress_lock);
+    _compress_free();
+    pthread_mutex_unlock(&compress_lock);
+    return res;
+}
+
+void vmp_compress_atfork_child(void)
+{
+    /* the member of the parent is not ours to finish; the writer thread
+       might have held the lock when the process forked */
+    pthread_mutex_init(&compress_lock, NULL);
+    _compress_free();
+}
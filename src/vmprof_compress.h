@@ -0,0 +1,40 @@
+#pragma once
+
+#include "vmprof.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Optional gzip compression of the profile (Unix only).
+ *
+ * Everything that goes into the profile passes vmp_stream_write() or
+ * vmp_stream_writev().  With a compression level set, the bytes are
+ * deflated into a gzip member instead of being written as they are.
+ * The writer thread completes the member about once a second, and so
+ * does everything that reads the profile back or closes it: up to the
+ * last complete member the file is a valid gzip stream (concatenated
+ * members are), which the reader detects on its own.  Never used from
+ * a signal handler, the compressor is protected by a mutex.
+ */
+
+#ifdef RPYTHON_VMPROF
+static inline ssize_t vmp_stream_write(int fd, const void *buf, size_t size)
+{
+    return write(fd, buf, size);
+}
+static inline ssize_t vmp_stream_writev(int fd, const struct iovec *iov, int count)
+{
+    return writev(fd, iov, count);
+}
+static inline int vmp_compress_end_member(int fd) { return 0; }
+#else
+void vmp_set_compression(int level);
+int vmp_compression(void);
+int vmp_compress_start(int fd);
+ssize_t vmp_stream_write(int fd, const void *buf, size_t size);
+ssize_t vmp_stream_writev(int fd, const struct iovec *iov, int count);
+int vmp_compress_end_member(int fd);
+int vmp_compress_stop(int fd);
+void vmp_compress_atfork_child(void);
+#endif
@@ -38,3 +38,9 @@
   /* linux, gnuc */
   #define PC_FROM_UCONTEXT uc_mcontext.gregs[REG_RIP]
 #endif
+
+/* frame and stack pointer, for the frame pointer unwinder */
+#if defined(__linux__) && defined(__x86_64__)
+  #define FP_FROM_UCONTEXT uc_mcontext.gregs[REG_RBP]
+  #define SP_FROM_UCONTEXT uc_mcontext.gregs[REG_RSP]
+#endif
@@ -16,17 +16,73 @@ static mach_port_t mach_task;
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-/* On '''normal''' Unices we can get RSS from '/proc/<pid>/status'. */
+#include <pthread.h>
+#include <signal.h>
+/* On '''normal''' Unices we can get RSS from '/proc/self/statm'.  Reading
+   it from the signal handler would cost two syscalls per sample, so a
+   helper thread refreshes the value every few milliseconds and the
+   handler only loads it. */
 static int proc_file = -1;
+static long volatile current_rss_kb = -1;
+static long rss_page_kb = 4;
+static pthread_t rss_thread;
+static int volatile rss_thread_running = 0;
+
+#define RSS_REFRESH_USEC 5000
 #endif
 
-int setup_rss(void)
-{
 #ifdef VMPROF_LINUX
+static long read_statm_rss(void)
+{
+    /* statm: size resident shared text lib data dt, all in pages */
     char buf[128];
+    char *p;
+    ssize_t count = pread(proc_file, buf, sizeof(buf) - 1, 0);
+    if (count <= 0)
+        return -1;
+    buf[count] = '\0';
+    p = strchr(buf, ' ');
+    if (p == NULL)
+        return -1;
+    return strtol(p + 1, NULL, 10) * rss_page_kb;
+}
 
-    sprintf(buf, "/proc/%d/status", getpid());
-    proc_file = open(buf, O_RDONLY);
+static void *rss_thread_main(void *arg)
+{
+    sigset_t mask;
+
+    /* never sample this thread */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPROF);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (rss_thread_running) {
+        long rss;
+        usleep(RSS_REFRESH_USEC);
+        rss = read_statm_rss();
+        if (rss >= 0)
+            current_rss_kb = rss;    /* else keep the last value */
+    }
+    return NULL;
+}
+#endif
+
+int setup_rss(void)
+{
+#ifdef VMPROF_LINUX
+    proc_file = open("/proc/self/statm", O_RDONLY);
+    if (proc_file == -1)
+        return -1;
+    rss_page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    current_rss_kb = read_statm_rss();
+    rss_thread_running = 1;
+    if (pthread_create(&rss_thread, NULL, rss_thread_main, NULL) != 0) {
+        rss_thread_running = 0;
+        close(proc_file);
+        proc_file = -1;
+        return -1;
+    }
     return proc_file;
 #elif defined(VMPROF_APPLE)
     mach_task = mach_task_self();
@@ -39,32 +95,32 @@ int setup_rss(void)
 int teardown_rss(void)
 {
 #ifdef VMPROF_LINUX
-    close(proc_file);
+    if (rss_thread_running) {
+        rss_thread_running = 0;
+        pthread_join(rss_thread, NULL);
+    }
+    if (proc_file != -1)
+        close(proc_file);
     proc_file = -1;
+    current_rss_kb = -1;
     return 0;
 #else
     return 0;
 #endif
 }
 
-long get_current_proc_rss(void)
+void rss_atfork_child(void)
 {
 #ifdef VMPROF_LINUX
-    char buf[1024];
-    int i = 0;
+    /* the helper thread does not exist in the child */
+    rss_thread_running = 0;
+#endif
+}
 
-    if (lseek(proc_file, 0, SEEK_SET) == -1)
-        return -1;
-    if (read(proc_file, buf, 1024) == -1)
-        return -1;
-    while (i < 1020) {
-        if (strncmp(buf + i, "VmRSS:\t", 7) == 0) {
-            i += 7;
-            return atoi(buf + i);
-        }
-        i++;
-    }
-    return -1;
+long get_current_proc_rss(void)
+{
+#ifdef VMPROF_LINUX
+    return current_rss_kb;
 #elif defined(VMPROF_APPLE)
     mach_msg_type_number_t out_count = MACH_TASK_BASIC_INFO_COUNT;
     mach_task_basic_info_data_t taskinfo = { .resident_size = 0 };
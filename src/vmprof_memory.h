@@ -2,4 +2,5 @@
 
 int setup_rss(void);
 int teardown_rss(void);
+void rss_atfork_child(void);
 long get_current_proc_rss(void);
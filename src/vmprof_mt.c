@@ -2,17 +2,99 @@
 /* Support for multithreaded write() operations (implementation) */
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef VMPROF_LINUX
+#include <sys/syscall.h>
+#endif
+
+#include "compat.h"
+#include "vmprof_compress.h"
+#ifndef RPYTHON_VMPROF
+#include "vmprof_codes.h"
+#include "vmprof_threads.h"
+#include "vmprof_common.h"
+#include "vmprof_unix.h"
+#endif
 
 #if defined(__i386__) || defined(__amd64__)
   static inline void write_fence(void) { asm("" : : : "memory"); }
+  static inline void read_fence(void) { asm("" : : : "memory"); }
 #else
   static inline void write_fence(void) { __sync_synchronize(); }
+  static inline void read_fence(void) { __sync_synchronize(); }
 #endif
 
 static char volatile profbuf_state[MAX_NUM_BUFFERS];
 static struct profbuf_s *profbuf_all_buffers = NULL;
+/* 0: free, 1: taken, 2: buffers not prepared, 3: suspended */
 static int volatile profbuf_write_lock = 2;
 static long profbuf_pending_write;
+/* the entries of the last batch that are not written yet, see
+   _write_batch() */
+static int batch_next = 0, batch_end = 0;
+
+static struct profring_s *profring_all = NULL;
+static unsigned long volatile profring_generation = 0;
+static long volatile profring_claim_failures = 0;
+/* dropped in the segments before the current one, see vmp_rotate_writes() */
+static long profring_dropped_before = 0;
+/* dropped in rings that were unmapped already, the trailer is written
+   after shutdown_concurrent_bufs() */
+static long profring_dropped_unmapped = 0;
+
+#ifdef VMPROF_LINUX
+/* initial-exec: reading these from the signal handler must not end up
+   in __tls_get_addr(), which may allocate */
+static __thread struct profring_s *this_ring
+    __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread unsigned long this_ring_generation
+    __attribute__((tls_model("initial-exec"))) = 0;
+#else
+/* thread locals cannot be trusted inside the signal handler on OS X
+   (see sigprof_handler), the ring is kept in a pthread key instead,
+   which is lock-free to read like the thread state of CPython 3.7+.
+   The value is the generation shifted left by RING_KEY_INDEX_BITS, or'ed
+   with the number of the ring plus one.  When the thread ends, the
+   destructor of the key stores the generation in 'profring_gone' (not
+   in the ring, which might be unmapped by then); the writer thread
+   hands the ring back. */
+#define RING_KEY_INDEX_BITS 9
+#define RING_KEY_INDEX_MASK ((1UL << RING_KEY_INDEX_BITS) - 1)
+static pthread_key_t this_ring_key;
+static int this_ring_key_created = 0;
+static pthread_once_t this_ring_key_once = PTHREAD_ONCE_INIT;
+static unsigned long volatile profring_gone[MAX_NUM_RINGS];
+
+static void _this_ring_thread_ended(void *value)
+{
+    uintptr_t cached = (uintptr_t)value;
+    unsigned long generation = profring_generation;
+    if ((cached & ~RING_KEY_INDEX_MASK) == (uintptr_t)generation << RING_KEY_INDEX_BITS)
+        profring_gone[(cached & RING_KEY_INDEX_MASK) - 1] = generation;
+}
+
+static void _create_this_ring_key(void)
+{
+    this_ring_key_created = pthread_key_create(&this_ring_key,
+                                               _this_ring_thread_ended) == 0;
+}
+#endif
+
+static pthread_t writer_thread;
+static int volatile writer_running = 0;
+static long writer_sleep_usec = 0;
+
+static int _write_everything_ready(int fd);
+static int _write_rest_of_batch(int fd);
+static int stacktable_reset(void);
+static void stacktable_free(void);
 
 
 static void unprepare_concurrent_bufs(void)
@@ -21,6 +103,15 @@ static void unprepare_concurrent_bufs(void)
         munmap(profbuf_all_buffers, sizeof(struct profbuf_s) * MAX_NUM_BUFFERS);
         profbuf_all_buffers = NULL;
     }
+    if (profring_all != NULL) {
+        long i;
+        for (i = 0; i < MAX_NUM_RINGS; i++)
+            profring_dropped_unmapped += profring_all[i].dropped;
+        munmap(profring_all, sizeof(struct profring_s) * MAX_NUM_RINGS);
+        profring_all = NULL;
+    }
+    batch_next = batch_end = 0;
+    stacktable_free();
 }
 
 int prepare_concurrent_bufs(void)
@@ -36,9 +127,32 @@ int prepare_concurrent_bufs(void)
         profbuf_all_buffers = NULL;
         return -1;
     }
+    /* the rings are large, but only the slots that are actually used
+       get backed by memory */
+    profring_all = mmap(NULL, sizeof(struct profring_s) * MAX_NUM_RINGS,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (profring_all == MAP_FAILED) {
+        profring_all = NULL;
+        unprepare_concurrent_bufs();
+        return -1;
+    }
+    if (stacktable_reset() < 0) {
+        unprepare_concurrent_bufs();
+        return -1;
+    }
     memset((char *)profbuf_state, PROFBUF_UNUSED, sizeof(profbuf_state));
     profbuf_write_lock = 0;
     profbuf_pending_write = -1;
+    profring_claim_failures = 0;
+    profring_dropped_before = 0;
+    profring_dropped_unmapped = 0;
+    /* invalidates the ring cached by every thread in a previous run */
+    profring_generation++;
+#ifndef VMPROF_LINUX
+    (void)pthread_once(&this_ring_key_once, _create_this_ring_key);
+#endif
     return 0;
 }
 
@@ -48,6 +162,10 @@ static int _write_single_ready_buffer(int fd, long i)
        only be called while we hold the write lock. */
     assert(profbuf_write_lock != 0);
 
+    /* the buffer might be part of a batch that is not written yet */
+    if (_write_rest_of_batch(fd) < 0)
+        return -1;
+
     if (profbuf_pending_write >= 0) {
         /* A partially written buffer is waiting.  We'll write the
            rest of this buffer now, instead of 'i'. */
@@ -63,7 +181,7 @@ static int _write_single_ready_buffer(int fd, long i)
 
     int err;
     struct profbuf_s *p = &profbuf_all_buffers[i];
-    ssize_t count = write(fd, p->data + p->data_offset, p->data_size);
+    ssize_t count = vmp_stream_write(fd, p->data + p->data_offset, p->data_size);
     if (count == p->data_size) {
         profbuf_state[i] = PROFBUF_UNUSED;
         profbuf_pending_write = -1;
@@ -106,13 +224,15 @@ struct profbuf_s *reserve_buffer(int fd)
        successful, returns the profbuf_s.  It fails only if the
        concurrent buffers are all busy (extreme multithreaded usage).
 
-       This might call write() to emit the data sitting in
-       previously-prepared buffers.  In case of write() error, the
-       error is ignored but unwritten data stays in the buffers.
+       Without a writer thread, this might call write() to emit the
+       data sitting in previously-prepared buffers.  In case of write()
+       error, the error is ignored but unwritten data stays in the
+       buffers.
     */
     long i;
 
-    _write_ready_buffers(fd);
+    if (!writer_running)
+        _write_ready_buffers(fd);
 
     for (i = 0; i < MAX_NUM_BUFFERS; i++) {
         if (profbuf_state[i] == PROFBUF_UNUSED &&
@@ -132,9 +252,9 @@ void commit_buffer(int fd, struct profbuf_s *buf)
 {
     /* Leaves a region of code that filled 'buf'.
 
-       This might call write() to emit the data now ready.  In case of
-       write() error, the error is ignored but unwritten data stays in
-       the buffers.
+       Without a writer thread, this might call write() to emit the
+       data now ready.  In case of write() error, the error is ignored
+       but unwritten data stays in the buffers.
     */
 
     /* Make sure every thread sees the full content of 'buf' */
@@ -145,7 +265,10 @@ void commit_buffer(int fd, struct profbuf_s *buf)
     assert(profbuf_state[i] == PROFBUF_FILLING);
     profbuf_state[i] = PROFBUF_READY;
 
-    if (!__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
+    if (writer_running) {
+        /* the writer thread picks it up */
+    }
+    else if (!__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
         /* can't acquire the write lock, ignore */
     }
     else {
@@ -164,18 +287,811 @@ void cancel_buffer(struct profbuf_s *buf)
 int shutdown_concurrent_bufs(int fd)
 {
     /* no signal handler can be running concurrently here, because we
-       already did vmprof_ignore_signals(1) */
+       already did vmprof_ignore_signals(1), and the writer thread was
+       stopped */
     assert(profbuf_write_lock == 0);
     profbuf_write_lock = 2;
 
     /* last attempt to flush buffers */
-    int i;
-    for (i = 0; i < MAX_NUM_BUFFERS; i++) {
-        while (profbuf_state[i] == PROFBUF_READY) {
-            if (_write_single_ready_buffer(fd, i) < 0)
-                return -1;
+    if (_write_everything_ready(fd) < 0)
+        return -1;
+    unprepare_concurrent_bufs();
+    return 0;
+}
+
+/* *************************************************************
+ * per-thread sample rings
+ * *************************************************************
+ */
+
+static long _ring_owner_for_this_thread(void)
+{
+#ifdef VMPROF_LINUX
+    return (long)syscall(SYS_gettid);
+#else
+    return (long)pthread_self();
+#endif
+}
+
+static struct profring_s *_claim_ring(long owner)
+{
+    /* Only done the first time a thread is sampled */
+    long i;
+    for (i = 0; i < MAX_NUM_RINGS; i++) {
+        struct profring_s *r = &profring_all[i];
+        if (r->owner == 0 &&
+            __sync_bool_compare_and_swap(&r->owner, 0, owner)) {
+            return r;
         }
     }
-    unprepare_concurrent_bufs();
+    /* more sampled threads than rings, the sample is lost */
+    __sync_fetch_and_add(&profring_claim_failures, 1L);
+    return NULL;
+}
+
+static struct profring_s *_ring_for_this_thread(void)
+{
+#ifdef VMPROF_LINUX
+    if (this_ring == NULL || this_ring_generation != profring_generation) {
+        this_ring = _claim_ring(_ring_owner_for_this_thread());
+        this_ring_generation = profring_generation;
+    }
+    return this_ring;
+#else
+    uintptr_t tag = (uintptr_t)profring_generation << RING_KEY_INDEX_BITS;
+    uintptr_t cached;
+    struct profring_s *r = NULL;
+    long owner, i;
+
+    if (this_ring_key_created) {
+        cached = (uintptr_t)pthread_getspecific(this_ring_key);
+        if ((cached & ~RING_KEY_INDEX_MASK) == tag &&
+                (cached & RING_KEY_INDEX_MASK) != 0)
+            return &profring_all[(cached & RING_KEY_INDEX_MASK) - 1];
+    }
+    /* the first sample of the thread in this run: it might own a ring
+       already if the key could not be created */
+    owner = _ring_owner_for_this_thread();
+    for (i = 0; i < MAX_NUM_RINGS; i++) {
+        if (profring_all[i].owner == owner) {
+            r = &profring_all[i];
+            break;
+        }
+    }
+    if (r == NULL && (r = _claim_ring(owner)) == NULL)
+        return NULL;
+    if (this_ring_key_created)
+        (void)pthread_setspecific(this_ring_key,
+                                  (void *)(tag | (uintptr_t)(r - profring_all + 1)));
+    return r;
+#endif
+}
+
+static struct profring_s *_ring_of_slot(struct profbuf_s *buf)
+{
+    long i = ((char *)buf - (char *)profring_all) / sizeof(struct profring_s);
+    assert(i >= 0 && i < MAX_NUM_RINGS);
+    return &profring_all[i];
+}
+
+struct profbuf_s *reserve_sample_buffer(void)
+{
+    /* Called from the signal handler.  Returns the next free slot of
+       the ring owned by the current thread, or NULL if the ring is full
+       (the writer thread has not caught up yet). */
+    struct profring_s *r;
+    struct profbuf_s *p;
+
+    if (profring_all == NULL)
+        return NULL;
+    r = _ring_for_this_thread();
+    if (r == NULL)
+        return NULL;
+    if (r->head - r->tail >= VMP_RING_SLOTS) {
+        r->dropped++;
+        return NULL;
+    }
+    p = &r->slots[r->head % VMP_RING_SLOTS];
+    p->data_size = 0;
+    p->data_offset = 0;
+    return p;
+}
+
+void commit_sample_buffer(struct profbuf_s *buf)
+{
+    struct profring_s *r = _ring_of_slot(buf);
+    assert(buf == &r->slots[r->head % VMP_RING_SLOTS]);
+
+    /* Make sure the writer sees the full content of 'buf' */
+    write_fence();
+
+    /* Then publish it */
+    r->head++;
+}
+
+void cancel_sample_buffer(struct profbuf_s *buf)
+{
+    /* nothing to do, the slot was never published */
+}
+
+long vmp_dropped_samples(void)
+{
+    long i;
+    long dropped = profring_claim_failures + profring_dropped_unmapped -
+                   profring_dropped_before;
+    if (profring_all == NULL)
+        return dropped;
+    for (i = 0; i < MAX_NUM_RINGS; i++) {
+        dropped += profring_all[i].dropped;
+    }
+    return dropped;
+}
+
+static int _write_rest_of_buffer(int fd, struct profbuf_s *p)
+{
+    /* Writes the rest of the buffer.  Retries on EINTR and EAGAIN, a
+       partially written buffer must not be left behind. */
+    while (p->data_size > 0) {
+        ssize_t count = vmp_stream_write(fd, p->data + p->data_offset, p->data_size);
+        if (count > 0) {
+            p->data_offset += count;
+            p->data_size -= count;
+        }
+        else if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+            usleep(1);
+        }
+        else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* *************************************************************
+ * stack deduplication
+ * *************************************************************
+
+   Samples mostly repeat a small set of distinct stacks.  Before a ring
+   slot is written, the writer looks its stack up in an open-addressing
+   table and rewrites the record in place (VERSION_COMPACT, every field
+   an LEB128 varint).  The first occurrence of a stack becomes
+
+       MARKER_STACK_DEF, id, thread, shared, count, delta[count], [rss],
+           [time, cpu]
+
+   every later one shrinks to
+
+       MARKER_STACK_REF, id, thread, [rss], [time, cpu]
+
+   'thread' is the number of the thread in the order the writer first
+   met it; that first record carries the thread word right after it.
+   The stack of a MARKER_STACK_DEF has its 'shared' outermost entries in
+   common with the last stack written for the same thread, the 'count'
+   entries in front of them follow from the outermost to the innermost,
+   each as the (zigzag) difference to the entry two positions further
+   out, or to 0 where there is none.  Two positions, because with lines
+   every other entry is a line number.  'rss' is the difference to the
+   last reading of the thread, and so is 'time' (PROFILE_TIMESTAMPS,
+   microseconds); 'cpu' is the number of the cpu plus one, 0 if it is
+   unknown.
+
+   Only the writer (or whoever holds the write lock) touches the tables,
+   so they need no synchronization and may use malloc().
+*/
+#define STACKTABLE_INITIAL_SIZE 4096
+#define STACKTABLE_MAX_STACKS   (1L << 20)
+#define THREADTABLE_INITIAL_SIZE 64
+/* bytes of a varint holding 64 bits */
+#define VARINT_MAX 10
+
+struct stack_entry_s {
+    uint64_t hash;
+    long depth;
+    size_t addrs;           /* index into 'stacktable_addrs', 0 if empty */
+};
+
+struct thread_entry_s {
+    intptr_t thread;
+    long number;            /* 0 if free, -1 until the thread word was
+                               written, then the number of the thread + 1 */
+    long last_id;           /* 0 before the first stack */
+    long last_depth;
+    intptr_t last_rss;
+    intptr_t last_time;
+};
+
+static struct stack_entry_s *stacktable = NULL;
+static long stacktable_size = 0;
+static long stacktable_used = 0;
+static void **stacktable_addrs = NULL;
+static size_t stacktable_addrs_used = 0;
+static size_t stacktable_addrs_size = 0;
+static struct thread_entry_s *threadtable = NULL;
+static long threadtable_size = 0;
+static long threadtable_used = 0;
+static long threads_written = 0;
+/* the compact record is built here, then copied over the sample */
+static char compact_record[SINGLE_BUF_SIZE];
+
+static void stacktable_free(void)
+{
+    free(stacktable);
+    stacktable = NULL;
+    free(stacktable_addrs);
+    stacktable_addrs = NULL;
+    stacktable_size = stacktable_used = 0;
+    stacktable_addrs_used = stacktable_addrs_size = 0;
+    free(threadtable);
+    threadtable = NULL;
+    threadtable_size = threadtable_used = threads_written = 0;
+}
+
+static int stacktable_reset(void)
+{
+    stacktable_free();
+    stacktable = calloc(STACKTABLE_INITIAL_SIZE, sizeof(struct stack_entry_s));
+    stacktable_addrs_size = STACKTABLE_INITIAL_SIZE * 16;
+    stacktable_addrs = malloc(stacktable_addrs_size * sizeof(void *));
+    threadtable = calloc(THREADTABLE_INITIAL_SIZE, sizeof(struct thread_entry_s));
+    if (stacktable == NULL || stacktable_addrs == NULL || threadtable == NULL) {
+        stacktable_free();
+        return -1;
+    }
+    threadtable_size = THREADTABLE_INITIAL_SIZE;
+    stacktable_size = STACKTABLE_INITIAL_SIZE;
+    /* index 0 marks an empty entry */
+    stacktable_addrs_used = 1;
+    return 0;
+}
+
+static void stacktable_clear(void)
+{
+    /* like stacktable_reset(), but keeps the memory */
+    memset(stacktable, 0, stacktable_size * sizeof(struct stack_entry_s));
+    stacktable_used = 0;
+    stacktable_addrs_used = 1;
+    memset(threadtable, 0, threadtable_size * sizeof(struct thread_entry_s));
+    threadtable_used = threads_written = 0;
+}
+
+static uint64_t _hash_stack(void **addrs, long depth)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t)depth;
+    long i;
+    for (i = 0; i < depth; i++) {
+        h ^= (uint64_t)(uintptr_t)addrs[i];
+        h *= 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static int _stacktable_grow(void)
+{
+    long i, newsize = stacktable_size * 2;
+    struct stack_entry_s *newtable;
+
+    newtable = calloc(newsize, sizeof(struct stack_entry_s));
+    if (newtable == NULL)
+        return -1;
+    for (i = 0; i < stacktable_size; i++) {
+        struct stack_entry_s *e = &stacktable[i];
+        long j;
+        if (e->addrs == 0)
+            continue;
+        j = (long)(e->hash & (newsize - 1));
+        while (newtable[j].addrs != 0)
+            j = (j + 1) & (newsize - 1);
+        newtable[j] = *e;
+    }
+    free(stacktable);
+    stacktable = newtable;
+    stacktable_size = newsize;
+    return 0;
+}
+
+static long _stacktable_lookup_or_add(void **addrs, long depth, int *is_new)
+{
+    /* Returns the id of the stack, or -1 if it is unknown and the table
+       is full */
+    uint64_t h = _hash_stack(addrs, depth);
+    long j = (long)(h & (stacktable_size - 1));
+    struct stack_entry_s *e;
+
+    while (stacktable[j].addrs != 0) {
+        e = &stacktable[j];
+        if (e->hash == h && e->depth == depth &&
+            memcmp(&stacktable_addrs[e->addrs], addrs,
+                   depth * sizeof(void *)) == 0) {
+            *is_new = 0;
+            /* entries never move in the address storage, and the
+               storage index is unique per stack */
+            return (long)e->addrs;
+        }
+        j = (j + 1) & (stacktable_size - 1);
+    }
+
+    if (stacktable_used >= STACKTABLE_MAX_STACKS)
+        return -1;
+    if (stacktable_addrs_used + depth > stacktable_addrs_size) {
+        size_t newsize = stacktable_addrs_size * 2 + depth;
+        void **newaddrs = realloc(stacktable_addrs, newsize * sizeof(void *));
+        if (newaddrs == NULL)
+            return -1;
+        stacktable_addrs = newaddrs;
+        stacktable_addrs_size = newsize;
+    }
+    e = &stacktable[j];
+    e->hash = h;
+    e->depth = depth;
+    e->addrs = stacktable_addrs_used;
+    memcpy(&stacktable_addrs[e->addrs], addrs, depth * sizeof(void *));
+    /* an empty stack still needs a unique, non-zero id */
+    stacktable_addrs_used += depth > 0 ? depth : 1;
+    stacktable_used++;
+    *is_new = 1;
+    if (stacktable_used * 2 >= stacktable_size)
+        (void)_stacktable_grow();   /* on failure, keep the load higher */
+    return (long)e->addrs;
+}
+
+static inline size_t _hash_thread(intptr_t thread)
+{
+    uint64_t h = (uint64_t)(uintptr_t)thread * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32);
+}
+
+static int _threadtable_grow(void)
+{
+    long i, newsize = threadtable_size * 2;
+    struct thread_entry_s *newtable;
+
+    newtable = calloc(newsize, sizeof(struct thread_entry_s));
+    if (newtable == NULL)
+        return -1;
+    for (i = 0; i < threadtable_size; i++) {
+        struct thread_entry_s *t = &threadtable[i];
+        size_t j;
+        if (t->number == 0)
+            continue;
+        j = _hash_thread(t->thread) & (newsize - 1);
+        while (newtable[j].number != 0)
+            j = (j + 1) & (newsize - 1);
+        newtable[j] = *t;
+    }
+    free(threadtable);
+    threadtable = newtable;
+    threadtable_size = newsize;
+    return 0;
+}
+
+static struct thread_entry_s *_threadtable_lookup_or_add(intptr_t thread)
+{
+    /* Returns NULL if the thread is new and there is no memory for it */
+    size_t j = _hash_thread(thread) & (threadtable_size - 1);
+    struct thread_entry_s *t;
+
+    while (threadtable[j].number != 0) {
+        if (threadtable[j].thread == thread)
+            return &threadtable[j];
+        j = (j + 1) & (threadtable_size - 1);
+    }
+    if ((threadtable_used + 1) * 2 >= threadtable_size) {
+        if (_threadtable_grow() < 0)
+            return NULL;
+        return _threadtable_lookup_or_add(thread);
+    }
+    t = &threadtable[j];
+    t->thread = thread;
+    t->number = -1;
+    t->last_id = 0;
+    t->last_depth = 0;
+    t->last_rss = 0;
+    t->last_time = 0;
+    threadtable_used++;
+    return t;
+}
+
+static inline char *_put_uvarint(char *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
+
+static inline char *_put_svarint(char *out, uint64_t value)
+{
+    /* zigzag: small negative numbers stay small too */
+    return _put_uvarint(out, (value << 1) ^ (uint64_t)((int64_t)value >> 63));
+}
+
+static void _compact_stack_record(struct profbuf_s *p)
+{
+    /* Rewrites the MARKER_STACKTRACE record in 'p', see above.  Records
+       already rewritten (or unknown ones) are left alone, and so is a
+       sample whose stack or thread finds no room in the tables. */
+    char *rec = p->data + p->data_offset;
+    char *out = compact_record;
+    void **addrs, **prev = NULL;
+    long depth, id, tailsize, shared = 0, i;
+    intptr_t thread, rss = 0, when = 0, cpu = 0;
+    int is_new, has_rss, has_time = 0;
+    struct thread_entry_s *t;
+    const long headsize = 1 + 2 * sizeof(long);
+    void **tail;
+
+    if (stacktable == NULL || p->data_size < headsize ||
+            rec[0] != MARKER_STACKTRACE)
+        return;
+    memcpy(&depth, rec + 1 + sizeof(long), sizeof(long));
+#ifndef RPYTHON_VMPROF
+    has_time = vmprof_get_timestamps();
+#endif
+    tailsize = p->data_size - headsize - depth * (long)sizeof(void *);
+    if (depth < 0 || tailsize < (1 + 2 * has_time) * (long)sizeof(void *))
+        return;
+    /* the worst case of the encoding has to fit into the slot */
+    if ((depth + 8) * VARINT_MAX + 1 > (long)SINGLE_BUF_SIZE - (long)p->data_offset)
+        return;
+    addrs = (void **)(rec + headsize);
+    tail = addrs + depth;
+    memcpy(&thread, tail++, sizeof(intptr_t));
+    has_rss = tailsize >= (2 + 2 * has_time) * (long)sizeof(void *);
+    if (has_rss)
+        memcpy(&rss, tail++, sizeof(intptr_t));
+    if (has_time) {
+        memcpy(&when, tail++, sizeof(intptr_t));
+        memcpy(&cpu, tail++, sizeof(intptr_t));
+    }
+
+    t = _threadtable_lookup_or_add(thread);
+    if (t == NULL)
+        return;
+    id = _stacktable_lookup_or_add(addrs, depth, &is_new);
+    if (id < 0)
+        return;     /* table full, keep the full record */
+
+    *out++ = is_new ? MARKER_STACK_DEF : MARKER_STACK_REF;
+    out = _put_uvarint(out, (uint64_t)id);
+    if (t->number < 0) {
+        t->number = ++threads_written;
+        out = _put_uvarint(out, (uint64_t)(t->number - 1));
+        out = _put_uvarint(out, (uint64_t)thread);
+    }
+    else {
+        out = _put_uvarint(out, (uint64_t)(t->number - 1));
+    }
+    if (is_new) {
+        if (t->last_id != 0) {
+            prev = &stacktable_addrs[t->last_id];
+            while (shared < depth && shared < t->last_depth &&
+                   addrs[depth - 1 - shared] == prev[t->last_depth - 1 - shared])
+                shared++;
+        }
+        out = _put_uvarint(out, (uint64_t)shared);
+        out = _put_uvarint(out, (uint64_t)(depth - shared));
+        for (i = depth - shared - 1; i >= 0; i--) {
+            uintptr_t base = i + 2 < depth ? (uintptr_t)addrs[i + 2] : 0;
+            out = _put_svarint(out, (uintptr_t)addrs[i] - base);
+        }
+    }
+    if (has_rss) {
+        out = _put_svarint(out, (uint64_t)rss - (uint64_t)t->last_rss);
+        t->last_rss = rss;
+    }
+    if (has_time) {
+        out = _put_svarint(out, (uint64_t)when - (uint64_t)t->last_time);
+        out = _put_uvarint(out, (uint64_t)(cpu + 1));
+        t->last_time = when;
+    }
+    t->last_id = id;
+    t->last_depth = depth;
+
+    memcpy(rec, compact_record, out - compact_record);
+    p->data_size = out - compact_record;
+}
+
+/* Everything that is ready is written with writev(), at most
+   VMP_WRITEV_BATCH buffers at a time.  A buffer is only handed back
+   once it made it out completely. */
+#define VMP_WRITEV_BATCH 64
+
+struct batch_entry_s {
+    struct profbuf_s *buf;
+    long shared_index;          /* -1 for a ring slot */
+    struct profring_s *ring;    /* NULL for a shared buffer */
+};
+
+/* The records of a batch are compacted before they are written, a
+   stack is defined by the first of them that uses it.  What a failed
+   write leaves of the batch is written before anything else, in order:
+   the records that follow refer to the stacks and threads defined in
+   it. */
+static struct batch_entry_s batch_entries[VMP_WRITEV_BATCH];
+
+static void _release_batch_entry(struct batch_entry_s *e)
+{
+    if (e->ring == NULL) {
+        profbuf_state[e->shared_index] = PROFBUF_UNUSED;
+    }
+    else {
+        write_fence();
+        /* hand the slot back to the producer */
+        e->ring->tail++;
+    }
+}
+
+static int _write_rest_of_batch(int fd)
+{
+    /* Must only be called while we hold the write lock */
+    while (batch_next < batch_end) {
+        struct batch_entry_s *e = &batch_entries[batch_next];
+        if (_write_rest_of_buffer(fd, e->buf) < 0)
+            return -1;
+        _release_batch_entry(e);
+        batch_next++;
+    }
+    return 0;
+}
+
+static int _write_batch(int fd)
+{
+    /* Returns 1 if the batch was full and more might be ready, 0 if
+       everything was written, -1 on error.  Must only be called while we
+       hold the write lock, with no pending partial write. */
+    struct iovec iov[VMP_WRITEV_BATCH];
+    struct batch_entry_s *entries = batch_entries;
+    int n = 0, k;
+    long i;
+    ssize_t count;
+    assert(profbuf_write_lock != 0);
+    assert(profbuf_pending_write < 0);
+    assert(batch_next == batch_end);
+
+    for (i = 0; i < MAX_NUM_BUFFERS && n < VMP_WRITEV_BATCH; i++) {
+        if (profbuf_state[i] == PROFBUF_READY) {
+            entries[n].buf = &profbuf_all_buffers[i];
+            entries[n].shared_index = i;
+            entries[n].ring = NULL;
+            n++;
+        }
+    }
+    read_fence();
+    for (i = 0; i < MAX_NUM_RINGS && n < VMP_WRITEV_BATCH; i++) {
+        struct profring_s *r = &profring_all[i];
+        unsigned long pos;
+        unsigned long head = r->head;
+        read_fence();
+        for (pos = r->tail; pos != head && n < VMP_WRITEV_BATCH; pos++) {
+            entries[n].buf = &r->slots[pos % VMP_RING_SLOTS];
+            _compact_stack_record(entries[n].buf);
+            entries[n].shared_index = -1;
+            entries[n].ring = r;
+            n++;
+        }
+    }
+    if (n == 0)
+        return 0;
+    batch_next = 0;
+    batch_end = n;
+
+    for (k = 0; k < n; k++) {
+        iov[k].iov_base = entries[k].buf->data + entries[k].buf->data_offset;
+        iov[k].iov_len = entries[k].buf->data_size;
+    }
+    do {
+        count = vmp_stream_writev(fd, iov, n);
+        if (count < 0 && (errno == EINTR || errno == EAGAIN))
+            usleep(1);
+        else
+            break;
+    } while (1);
+    if (count < 0)
+        return -1;      /* the whole batch is left */
+
+    for (k = 0; k < n; k++) {
+        struct profbuf_s *p = entries[k].buf;
+        if ((size_t)count < (size_t)p->data_size) {
+            p->data_offset += count;
+            p->data_size -= count;
+            break;
+        }
+        count -= p->data_size;
+        _release_batch_entry(&entries[k]);
+        batch_next++;
+    }
+    /* partially written: the rest goes out before the next batch is
+       compacted */
+    if (_write_rest_of_batch(fd) < 0)
+        return -1;
+    return n == VMP_WRITEV_BATCH;
+}
+
+static int _write_everything_ready(int fd)
+{
+    /* Writes the committed shared buffers and the sample rings.  Must
+       only be called while we hold the write lock. */
+    int res;
+    while (profbuf_pending_write >= 0) {
+        /* a partially written buffer is left over from write() */
+        if (_write_single_ready_buffer(fd, profbuf_pending_write) < 0)
+            return -1;
+    }
+    if (_write_rest_of_batch(fd) < 0)
+        return -1;
+    do {
+        res = _write_batch(fd);
+    } while (res > 0);
+    return res;
+}
+
+int vmp_suspend_writes(int fd)
+{
+    /* Writes out everything sampled so far, then keeps the write lock
+       until vmp_resume_writes(): the caller reads the profile through
+       the same file descriptor, a write in between would land at the
+       offset being read.  Buffers committed meanwhile stay ready.  Not
+       for signal handlers: this waits until the writer thread releases
+       the write lock. */
+    int res;
+    if (fd < 0)
+        return 0;
+    while (!__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
+        if (profbuf_write_lock == 2 || profbuf_write_lock == 3)
+            return 0;   /* buffers are not prepared, or already suspended */
+        usleep(1);
+    }
+    res = _write_everything_ready(fd);
+    /* the reader has to see a complete gzip member */
+    if (res == 0)
+        res = vmp_compress_end_member(fd);
+    profbuf_write_lock = 3;
+    return res;
+}
+
+long vmp_rotate_writes(int fd)
+{
+    /* Ends the segment of the profile in 'fd', while the writes are
+       suspended: writes what was committed since vmp_suspend_writes()
+       and completes the gzip member.  The stacks and threads are
+       forgotten, the next segment defines them again.  Returns the
+       number of samples dropped during the segment, or -1. */
+    long dropped;
+    assert(profbuf_write_lock == 3);
+    if (_write_everything_ready(fd) < 0)
+        return -1;
+    if (vmp_compress_end_member(fd) < 0)
+        return -1;
+    if (stacktable != NULL)
+        stacktable_clear();
+    dropped = vmp_dropped_samples();
+    profring_dropped_before += dropped;
+    return dropped;
+}
+
+void vmp_resume_writes(void)
+{
+    __sync_bool_compare_and_swap(&profbuf_write_lock, 3, 0);
+}
+
+int vmp_writes_suspended(void)
+{
+    return profbuf_write_lock == 3;
+}
+
+static int _ring_owner_is_gone(long i, long owner)
+{
+#ifdef VMPROF_LINUX
+    return syscall(SYS_tgkill, getpid(), (pid_t)owner, 0) == -1 &&
+           errno == ESRCH;
+#else
+    if (profring_gone[i] != profring_generation)
+        return 0;
+    /* before the ring is free again: its next owner might end soon */
+    profring_gone[i] = 0;
+    write_fence();
+    return 1;
+#endif
+}
+
+static void _reclaim_rings_of_dead_threads(void)
+{
+    long i;
+    for (i = 0; i < MAX_NUM_RINGS; i++) {
+        struct profring_s *r = &profring_all[i];
+        long owner = r->owner;
+        if (owner != 0 && r->tail == r->head && _ring_owner_is_gone(i, owner)) {
+            /* the owner is gone and cannot produce anymore */
+            r->owner = 0;
+        }
+    }
+}
+
+static void *_writer_main(void *arg)
+{
+    sigset_t mask;
+    int fd, end_member = 0;
+    long rounds = 0;
+    long reclaim_every = 1000000 / writer_sleep_usec;
+
+    /* the writer must never be the thread that takes a sample */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPROF);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (writer_running) {
+        usleep(writer_sleep_usec);
+        if (++rounds % reclaim_every == 0) {
+            _reclaim_rings_of_dead_threads();
+#if defined(VMPROF_LINUX) && !defined(RPYTHON_VMPROF)
+            vmp_schedule_reap_threads();
+#endif
+            /* about once a second, a crash loses at most that much */
+            end_member = 1;
+        }
+        if (__sync_bool_compare_and_swap(&profbuf_write_lock, 0, 1)) {
+            /* read under the lock: vmprof_rotate() switches to another
+               file descriptor while the writes are suspended */
+            fd = vmp_profile_fileno();
+            if (fd >= 0) {
+                (void)_write_everything_ready(fd);
+#if !defined(RPYTHON_VMPROF) && defined(VMP_SUPPORTS_NATIVE_PROFILING)
+                /* a dlopen() since enable(); writes the new module maps */
+                vmp_native_refresh_ranges(fd);
+#endif
+                if (end_member) {
+                    (void)vmp_compress_end_member(fd);
+                    end_member = 0;
+                }
+            }
+            profbuf_write_lock = 0;
+        }
+#ifndef RPYTHON_VMPROF
+        /* code objects that showed up in samples are described with
+           the GIL held, see vmprof_codes.h */
+        vmp_codes_schedule_drain();
+        vmp_threads_schedule_drain();
+#endif
+    }
+    return NULL;
+}
+
+int vmp_start_writer(long interval_usec)
+{
+    /* Starts the thread that drains the sample rings.  It wakes up
+       often enough that a thread sampled every 'interval_usec' fills at
+       most a quarter of its ring in between. */
+    if (writer_running)
+        return 0;
+    writer_sleep_usec = interval_usec * VMP_RING_SLOTS / 4;
+    if (writer_sleep_usec < 1000)
+        writer_sleep_usec = 1000;
+    if (writer_sleep_usec > 100000)
+        writer_sleep_usec = 100000;
+    writer_running = 1;
+    if (pthread_create(&writer_thread, NULL, _writer_main, NULL) != 0) {
+        writer_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int vmp_stop_writer(void)
+{
+    if (!writer_running)
+        return 0;
+    writer_running = 0;
+    if (pthread_join(writer_thread, NULL) != 0)
+        return -1;
     return 0;
 }
+
+void vmp_writer_atfork_child(void)
+{
+    /* the writer thread does not exist in the child */
+    writer_running = 0;
+}
@@ -44,8 +44,43 @@ struct profbuf_s {
     char data[SINGLE_BUF_SIZE];
 };
 
+/* Stack samples do not go through the buffers above.  Every sampled
+   thread owns one ring of VMP_RING_SLOTS buffers: the signal handler
+   running on that thread is the only producer (it advances 'head'),
+   the writer thread is the only consumer (it advances 'tail').  The
+   handler therefore never scans, never does a compare-and-swap on
+   shared state and never calls write(); when its ring is full the
+   sample is counted in 'dropped' and thrown away.
+
+   A thread claims a free ring the first time it is sampled.  Rings of
+   threads that died are handed back by the writer thread.
+*/
+#define VMP_RING_SLOTS   16
+#define MAX_NUM_RINGS    256
+
+struct profring_s {
+    long volatile owner;               /* 0 if the ring is free */
+    unsigned long volatile head;       /* written by the owner only */
+    unsigned long volatile tail;       /* written by the writer only */
+    unsigned long volatile dropped;    /* written by the owner only */
+    struct profbuf_s slots[VMP_RING_SLOTS];
+};
+
 int prepare_concurrent_bufs(void);
 struct profbuf_s *reserve_buffer(int fd);
 void commit_buffer(int fd, struct profbuf_s *buf);
 void cancel_buffer(struct profbuf_s *buf);
 int shutdown_concurrent_bufs(int fd);
+
+struct profbuf_s *reserve_sample_buffer(void);
+void commit_sample_buffer(struct profbuf_s *buf);
+void cancel_sample_buffer(struct profbuf_s *buf);
+long vmp_dropped_samples(void);
+
+int vmp_start_writer(long interval_usec);
+int vmp_stop_writer(void);
+int vmp_suspend_writes(int fd);
+long vmp_rotate_writes(int fd);
+void vmp_resume_writes(void);
+int vmp_writes_suspended(void);
+void vmp_writer_atfork_child(void);
@@ -0,0 +1,765 @@
+#include "vmprof_reader.h"
+
+#include "vmprof.h"
+#include "khash.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* This is the C counterpart of LogReader.read_all() in vmprof/reader.py,
+   keep both in sync when the format changes.
+
+   The whole file is mapped and decoded in place.  A sample is reduced
+   to a key (thread, depth, pointer to its addresses inside the mapping)
+   and counted in a hash table, so memory use grows with the number of
+   distinct stacks, not with the number of samples.  Python objects are
+   only created at the end, once per distinct stack.  The stacks of
+   compact records (VERSION_COMPACT) are decoded once per definition
+   into chunks that never move. */
+
+#define VMP_VERSION_THREAD_ID    1
+#define VMP_VERSION_MEMORY       3
+#define VMP_VERSION_MODE_AWARE   4
+#define VMP_VERSION_DURATION     5
+
+struct agg_key_s {
+    const char *addrs;      /* inside the mapping, may be unaligned */
+    long depth;
+    intptr_t thread;
+};
+
+struct agg_value_s {
+    long count;
+    long long bytes;        /* sum of the allocation sizes */
+};
+
+struct stackdef_s {
+    const char *addrs;
+    long depth;
+};
+
+static inline khint_t agg_key_hash(struct agg_key_s key)
+{
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)key.thread;
+    long i;
+    for (i = 0; i < key.depth; i++) {
+        intptr_t addr;
+        memcpy(&addr, key.addrs + i * sizeof(intptr_t), sizeof(intptr_t));
+        h = (h ^ (uint64_t)addr) * 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    return (khint_t)(h ^ (h >> 32));
+}
+
+static inline int agg_key_equal(struct agg_key_s a, struct agg_key_s b)
+{
+    return a.depth == b.depth && a.thread == b.thread &&
+           memcmp(a.addrs, b.addrs, a.depth * sizeof(intptr_t)) == 0;
+}
+
+struct compact_thread_s {
+    intptr_t thread;
+    const char *addrs;      /* the last stack of the thread */
+    long depth;
+    intptr_t rss;
+};
+
+#define ARENA_CHUNK_ADDRS 65536
+
+struct arena_chunk_s {
+    struct arena_chunk_s *next;
+    long used, size;
+    intptr_t addrs[];
+};
+
+KHASH_INIT(vmp_agg, struct agg_key_s, struct agg_value_s, 1, agg_key_hash, agg_key_equal)
+KHASH_MAP_INIT_INT64(vmp_stackdefs, struct stackdef_s)
+
+struct profile_reader_s {
+    const char *start;
+    const char *pos;
+    const char *end;
+    int version;
+    int profile_memory;
+    int profile_lines;
+    int profile_line_offsets;
+    int profile_rpython;
+    int profile_timestamps;
+    khash_t(vmp_agg) *samples;
+    khash_t(vmp_agg) *allocs;
+    khash_t(vmp_stackdefs) *stackdefs;
+    struct compact_thread_s *threads;
+    long threads_used, threads_size;
+    struct arena_chunk_s *arena;
+};
+
+#define ENSURE(r, n) \
+    do { if ((size_t)((r)->end - (r)->pos) < (size_t)(n)) goto malformed; } while (0)
+
+static long read_word(struct profile_reader_s *r)
+{
+    long value;
+    memcpy(&value, r->pos, sizeof(long));
+    r->pos += sizeof(long);
+    return value;
+}
+
+static intptr_t read_addr(struct profile_reader_s *r)
+{
+    intptr_t value;
+    memcpy(&value, r->pos, sizeof(intptr_t));
+    r->pos += sizeof(intptr_t);
+    return value;
+}
+
+static int read_uvarint(struct profile_reader_s *r, uint64_t *value)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while (r->pos < r->end && shift < 64) {
+        unsigned char byte = (unsigned char)*r->pos++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *value = v;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static int read_svarint(struct profile_reader_s *r, uint64_t *value)
+{
+    uint64_t v;
+    if (read_uvarint(r, &v) < 0)
+        return -1;
+    *value = (v >> 1) ^ (0 - (v & 1));
+    return 0;
+}
+
+static intptr_t *arena_alloc(struct profile_reader_s *r, long count)
+{
+    struct arena_chunk_s *c = r->arena;
+    intptr_t *addrs;
+    if (c == NULL || c->size - c->used < count) {
+        long size = count > ARENA_CHUNK_ADDRS ? count : ARENA_CHUNK_ADDRS;
+        c = malloc(sizeof(struct arena_chunk_s) + size * sizeof(intptr_t));
+        if (c == NULL)
+            return NULL;
+        c->next = r->arena;
+        c->used = 0;
+        c->size = size;
+        r->arena = c;
+    }
+    addrs = c->addrs + c->used;
+    c->used += count;
+    return addrs;
+}
+
+static void arena_free(struct profile_reader_s *r)
+{
+    while (r->arena != NULL) {
+        struct arena_chunk_s *c = r->arena;
+        r->arena = c->next;
+        free(c);
+    }
+}
+
+static int count_sample(khash_t(vmp_agg) *table, const char *addrs, long depth,
+                        intptr_t thread, long bytes)
+{
+    struct agg_key_s key;
+    khint_t k;
+    int absent;
+
+    key.addrs = addrs;
+    key.depth = depth;
+    key.thread = thread;
+    k = kh_put(vmp_agg, table, key, &absent);
+    if (absent < 0)
+        return -1;
+    if (absent) {
+        kh_value(table, k).count = 0;
+        kh_value(table, k).bytes = 0;
+    }
+    kh_value(table, k).count++;
+    kh_value(table, k).bytes += bytes;
+    return 0;
+}
+
+static PyObject *read_string(struct profile_reader_s *r)
+{
+    long length;
+    PyObject *s;
+
+    if ((size_t)(r->end - r->pos) < sizeof(long))
+        return NULL;
+    length = read_word(r);
+    if (length < 0 || (size_t)(r->end - r->pos) < (size_t)length)
+        return NULL;
+    s = PyUnicode_DecodeUTF8(r->pos, length, NULL);
+    r->pos += length;
+    return s;
+}
+
+static PyObject *read_timeval(struct profile_reader_s *r)
+{
+    int64_t tv_sec, tv_usec;
+    /* seconds, microseconds and 8 bytes of (unused) time zone */
+    if ((size_t)(r->end - r->pos) < 3 * 8)
+        return NULL;
+    memcpy(&tv_sec, r->pos, 8);
+    memcpy(&tv_usec, r->pos + 8, 8);
+    r->pos += 3 * 8;
+    return PyLong_FromLongLong(tv_sec * 1000000 + tv_usec);
+}
+
+/* thread and optionally the RSS, time and cpu of a stack trace record */
+static int read_sample_tail(struct profile_reader_s *r, intptr_t *thread)
+{
+    *thread = 0;
+    if (r->version >= VMP_VERSION_THREAD_ID) {
+        if ((size_t)(r->end - r->pos) < sizeof(intptr_t))
+            return -1;
+        *thread = read_addr(r);
+    }
+    if (r->profile_memory) {
+        if ((size_t)(r->end - r->pos) < sizeof(intptr_t))
+            return -1;
+        r->pos += sizeof(intptr_t);
+    }
+    if (r->profile_timestamps) {
+        /* samples are merged, their times are lost */
+        if ((size_t)(r->end - r->pos) < 2 * sizeof(intptr_t))
+            return -1;
+        r->pos += 2 * sizeof(intptr_t);
+    }
+    return 0;
+}
+
+static struct compact_thread_s *read_compact_thread(struct profile_reader_s *r)
+{
+    uint64_t number, word;
+    struct compact_thread_s *t;
+
+    if (read_uvarint(r, &number) < 0)
+        return NULL;
+    if (number == (uint64_t)r->threads_used) {
+        /* the first record of the thread */
+        if (read_uvarint(r, &word) < 0)
+            return NULL;
+        if (r->threads_used == r->threads_size) {
+            long size = r->threads_size * 2 + 16;
+            t = realloc(r->threads, size * sizeof(struct compact_thread_s));
+            if (t == NULL) {
+                PyErr_NoMemory();
+                return NULL;
+            }
+            r->threads = t;
+            r->threads_size = size;
+        }
+        t = &r->threads[r->threads_used++];
+        t->thread = (intptr_t)word;
+        t->addrs = NULL;
+        t->depth = 0;
+        t->rss = 0;
+        return t;
+    }
+    if (number >= (uint64_t)r->threads_used)
+        return NULL;
+    return &r->threads[number];
+}
+
+/* a MARKER_STACK_DEF or MARKER_STACK_REF record of VERSION_COMPACT,
+   see src/vmprof_mt.c for the layout */
+static int read_compact_sample(struct profile_reader_s *r, char marker)
+{
+    uint64_t id, shared, count, delta;
+    struct compact_thread_s *t;
+    khint_t k;
+    int absent;
+
+    if (read_uvarint(r, &id) < 0 || (t = read_compact_thread(r)) == NULL)
+        return -1;
+    if (marker == MARKER_STACK_DEF) {
+        intptr_t *addrs;
+        long depth, i;
+        if (read_uvarint(r, &shared) < 0 || read_uvarint(r, &count) < 0)
+            return -1;
+        if (shared > (uint64_t)t->depth || count > (1 << 16) ||
+                shared + count > (1 << 16))
+            return -1;
+        depth = (long)(shared + count);
+        if ((addrs = arena_alloc(r, depth)) == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (shared > 0) {
+            memcpy(addrs + count, t->addrs + (t->depth - shared) * sizeof(intptr_t),
+                   shared * sizeof(intptr_t));
+        }
+        for (i = (long)count - 1; i >= 0; i--) {
+            uintptr_t base = i + 2 < depth ? (uintptr_t)addrs[i + 2] : 0;
+            if (read_svarint(r, &delta) < 0)
+                return -1;
+            addrs[i] = (intptr_t)(base + delta);
+        }
+        k = kh_put(vmp_stackdefs, r->stackdefs, (khint64_t)id, &absent);
+        if (absent < 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        kh_value(r->stackdefs, k).addrs = (const char *)addrs;
+        kh_value(r->stackdefs, k).depth = depth;
+    } else {
+        k = kh_get(vmp_stackdefs, r->stackdefs, (khint64_t)id);
+        if (k == kh_end(r->stackdefs))
+            return -1;
+    }
+    t->addrs = kh_value(r->stackdefs, k).addrs;
+    t->depth = kh_value(r->stackdefs, k).depth;
+    if (r->profile_memory) {
+        if (read_svarint(r, &delta) < 0)
+            return -1;
+        t->rss += (intptr_t)delta;
+    }
+    if (r->profile_timestamps) {
+        uint64_t cpu;
+        if (read_svarint(r, &delta) < 0 || read_uvarint(r, &cpu) < 0)
+            return -1;
+    }
+    if (count_sample(r->samples, t->addrs, t->depth, t->thread, 0) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *addrs_to_tuple(const char *addrs, long depth)
+{
+    PyObject *t = PyTuple_New(depth);
+    long i;
+    if (t == NULL)
+        return NULL;
+    for (i = 0; i < depth; i++) {
+        intptr_t addr;
+        PyObject *o;
+        memcpy(&addr, addrs + i * sizeof(intptr_t), sizeof(intptr_t));
+        o = PyLong_FromSsize_t((Py_ssize_t)addr);
+        if (o == NULL) {
+            Py_DECREF(t);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(t, i, o);
+    }
+    return t;
+}
+
+/* [(addrs, count, thread)] or [(addrs, count, bytes, thread)] */
+static PyObject *aggregated_to_list(khash_t(vmp_agg) *table, int with_bytes)
+{
+    PyObject *list = PyList_New(0);
+    khint_t k;
+
+    if (list == NULL)
+        return NULL;
+    for (k = kh_begin(table); k != kh_end(table); k++) {
+        struct agg_key_s *key;
+        struct agg_value_s *value;
+        PyObject *addrs, *item;
+        if (!kh_exist(table, k))
+            continue;
+        key = &kh_key(table, k);
+        value = &kh_value(table, k);
+        addrs = addrs_to_tuple(key->addrs, key->depth);
+        if (addrs == NULL)
+            goto error;
+        if (with_bytes) {
+            item = Py_BuildValue("(NlLn)", addrs, value->count, value->bytes,
+                                 (Py_ssize_t)key->thread);
+        } else {
+            item = Py_BuildValue("(Nln)", addrs, value->count,
+                                 (Py_ssize_t)key->thread);
+        }
+        if (item == NULL)
+            goto error;
+        if (PyList_Append(list, item) < 0) {
+            Py_DECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+ error:
+    Py_DECREF(list);
+    return NULL;
+}
+
+static int set_item(PyObject *dict, const char *key, PyObject *value)
+{
+    int res;
+    if (value == NULL)
+        return -1;
+    res = PyDict_SetItemString(dict, key, value);
+    Py_DECREF(value);
+    return res;
+}
+
+static PyObject *read_profile(struct profile_reader_s *r)
+{
+    PyObject *result = NULL, *meta = NULL, *virtual_ips = NULL;
+    PyObject *line_tables = NULL;
+    PyObject *module_maps = NULL, *thread_info = NULL;
+    PyObject *interp_name = NULL, *start_time = NULL, *end_time = NULL;
+    PyObject *key, *value;
+    long period, dropped = 0;
+    long header[5];
+    int i, done = 0;
+
+    /* static header: 0, 3, 0, period, flags */
+    ENSURE(r, sizeof(header));
+    for (i = 0; i < 5; i++)
+        header[i] = read_word(r);
+    if (header[0] != 0 || header[1] != 3 || header[2] != 0 || header[4] != 0) {
+        /* different word size or a 64 bit windows profile */
+        Py_RETURN_NONE;
+    }
+    period = header[3];
+
+    if ((meta = PyDict_New()) == NULL)
+        goto error;
+    if ((virtual_ips = PyList_New(0)) == NULL)
+        goto error;
+    if ((line_tables = PyList_New(0)) == NULL)
+        goto error;
+    if ((module_maps = PyList_New(0)) == NULL)
+        goto error;
+    if ((thread_info = PyDict_New()) == NULL)
+        goto error;
+
+    while (!done && r->pos < r->end) {
+        char marker = *r->pos++;
+        if (r->version >= VERSION_COMPACT &&
+                (marker == MARKER_STACK_DEF || marker == MARKER_STACK_REF)) {
+            if (read_compact_sample(r, marker) < 0)
+                goto malformed;
+            continue;
+        }
+        switch (marker) {
+            case MARKER_HEADER: {
+                unsigned char lgt;
+                ENSURE(r, 2);
+                r->version = ((unsigned char)r->pos[0] << 8) | (unsigned char)r->pos[1];
+                r->pos += 2;
+                if (r->version >= VMP_VERSION_MODE_AWARE) {
+                    char mode;
+                    ENSURE(r, 1);
+                    mode = *r->pos++;
+                    r->profile_memory = (mode & PROFILE_MEMORY) != 0;
+                    r->profile_lines = (mode & PROFILE_LINES) != 0;
+                    r->profile_rpython = (mode & PROFILE_RPYTHON) != 0;
+                    r->profile_line_offsets = (mode & PROFILE_LINE_OFFSETS) != 0;
+                    r->profile_timestamps = (mode & PROFILE_TIMESTAMPS) != 0;
+                } else {
+                    r->profile_memory = r->version == VMP_VERSION_MEMORY;
+                }
+                ENSURE(r, 1);
+                lgt = (unsigned char)*r->pos++;
+                ENSURE(r, lgt);
+                Py_XDECREF(interp_name);
+                interp_name = PyUnicode_DecodeUTF8(r->pos, lgt, NULL);
+                if (interp_name == NULL)
+                    goto error;
+                if (lgt == 4 && memcmp(r->pos, "pypy", 4) == 0)
+                    r->profile_rpython = 1;
+                r->pos += lgt;
+                break;
+            }
+            case MARKER_META: {
+                if ((key = read_string(r)) == NULL)
+                    goto malformed;
+                if ((value = read_string(r)) == NULL) {
+                    Py_DECREF(key);
+                    goto malformed;
+                }
+                i = PyDict_SetItem(meta, key, value);
+                Py_DECREF(key);
+                Py_DECREF(value);
+                if (i < 0)
+                    goto error;
+                break;
+            }
+            case MARKER_TIME_N_ZONE: {
+                Py_XDECREF(start_time);
+                if ((start_time = read_timeval(r)) == NULL)
+                    goto malformed;
+                break;
+            }
+            case MARKER_STACKTRACE:
+            case MARKER_STACK_DEF:
+            case MARKER_ALLOC: {
+                long first, depth;
+                const char *addrs;
+                intptr_t thread;
+                ENSURE(r, 2 * sizeof(long));
+                first = read_word(r);   /* count, stack id or size */
+                depth = read_word(r);
+                if (depth < 0 || depth > (1 << 16))
+                    goto malformed;
+                ENSURE(r, depth * sizeof(intptr_t));
+                addrs = r->pos;
+                r->pos += depth * sizeof(intptr_t);
+                if (marker == MARKER_ALLOC) {
+                    ENSURE(r, sizeof(intptr_t));
+                    thread = read_addr(r);
+                    if (count_sample(r->allocs, addrs, depth, thread, first) < 0)
+                        goto nomem;
+                    break;
+                }
+                if (read_sample_tail(r, &thread) < 0)
+                    goto malformed;
+                if (marker == MARKER_STACK_DEF) {
+                    int absent;
+                    khint_t k = kh_put(vmp_stackdefs, r->stackdefs, first, &absent);
+                    if (absent < 0)
+                        goto nomem;
+                    kh_value(r->stackdefs, k).addrs = addrs;
+                    kh_value(r->stackdefs, k).depth = depth;
+                }
+                if (count_sample(r->samples, addrs, depth, thread, 0) < 0)
+                    goto nomem;
+                break;
+            }
+            case MARKER_STACK_REF: {
+                long stack_id;
+                intptr_t thread;
+                khint_t k;
+                ENSURE(r, sizeof(long));
+                stack_id = read_word(r);
+                if (read_sample_tail(r, &thread) < 0)
+                    goto malformed;
+                k = kh_get(vmp_stackdefs, r->stackdefs, stack_id);
+                if (k == kh_end(r->stackdefs))
+                    goto malformed;
+                if (count_sample(r->samples, kh_value(r->stackdefs, k).addrs,
+                                 kh_value(r->stackdefs, k).depth, thread, 0) < 0)
+                    goto nomem;
+                break;
+            }
+            case MARKER_VIRTUAL_IP:
+            case MARKER_NATIVE_SYMBOLS: {
+                intptr_t addr;
+                PyObject *item;
+                ENSURE(r, sizeof(intptr_t));
+                addr = read_addr(r);
+                if ((value = read_string(r)) == NULL)
+                    goto malformed;
+                item = Py_BuildValue("(nN)", (Py_ssize_t)addr, value);
+                if (item == NULL)
+                    goto error;
+                i = PyList_Append(virtual_ips, item);
+                Py_DECREF(item);
+                if (i < 0)
+                    goto error;
+                break;
+            }
+            case MARKER_LINETABLE: {
+                /* handed over as is, the reader decodes them */
+                intptr_t addr;
+                long format, firstlineno, offset, size;
+                PyObject *item;
+                ENSURE(r, sizeof(intptr_t) + 4 * sizeof(long));
+                addr = read_addr(r);
+                format = read_word(r);
+                firstlineno = read_word(r);
+                offset = read_word(r);
+                size = read_word(r);
+                if (size < 0)
+                    goto malformed;
+                ENSURE(r, size);
+                item = Py_BuildValue("(nlllN)", (Py_ssize_t)addr, format,
+                                     firstlineno, offset,
+                                     PyBytes_FromStringAndSize(r->pos, size));
+                r->pos += size;
+                if (item == NULL)
+                    goto error;
+                i = PyList_Append(line_tables, item);
+                Py_DECREF(item);
+                if (i < 0)
+                    goto error;
+                break;
+            }
+            case MARKER_MODULE_MAP: {
+                intptr_t start, end, base;
+                PyObject *build_id, *path, *item;
+                ENSURE(r, 3 * sizeof(intptr_t));
+                start = read_addr(r);
+                end = read_addr(r);
+                base = read_addr(r);
+                if ((build_id = read_string(r)) == NULL)
+                    goto malformed;
+                if ((path = read_string(r)) == NULL) {
+                    Py_DECREF(build_id);
+                    goto malformed;
+                }
+                item = Py_BuildValue("(nnnNN)", (Py_ssize_t)start, (Py_ssize_t)end,
+                                     (Py_ssize_t)base, build_id, path);
+                if (item == NULL)
+                    goto error;
+                i = PyList_Append(module_maps, item);
+                Py_DECREF(item);
+                if (i < 0)
+                    goto error;
+                break;
+            }
+            case MARKER_THREAD_INFO: {
+                intptr_t tid;
+                PyObject *name, *native_name, *item;
+                ENSURE(r, sizeof(intptr_t));
+                tid = read_addr(r);
+                if ((name = read_string(r)) == NULL)
+                    goto malformed;
+                if ((native_name = read_string(r)) == NULL) {
+                    Py_DECREF(name);
+                    goto malformed;
+                }
+                if ((key = PyLong_FromSsize_t((Py_ssize_t)tid)) == NULL) {
+                    Py_DECREF(name);
+                    Py_DECREF(native_name);
+                    goto error;
+                }
+                item = Py_BuildValue("(NN)", name, native_name);
+                if (item == NULL) {
+                    Py_DECREF(key);
+                    goto error;
+                }
+                i = PyDict_SetItem(thread_info, key, item);
+                Py_DECREF(key);
+                Py_DECREF(item);
+                if (i < 0)
+                    goto error;
+                break;
+            }
+            case MARKER_TRAILER: {
+                if (r->version >= VMP_VERSION_DURATION) {
+                    if ((end_time = read_timeval(r)) == NULL)
+                        goto malformed;
+                }
+                if (r->version >= VERSION_DROPPED_SAMPLES) {
+                    ENSURE(r, sizeof(long));
+                    dropped = read_word(r);
+                }
+                done = 1;
+                break;
+            }
+            case 0:
+                /* zero padding at the end of a truncated profile */
+                done = 1;
+                break;
+            default:
+                goto malformed;
+        }
+    }
+
+    if ((result = PyDict_New()) == NULL)
+        goto error;
+    if (set_item(result, "version", PyLong_FromLong(r->version)) < 0 ||
+        set_item(result, "period", PyLong_FromLong(period)) < 0 ||
+        set_item(result, "profile_memory", PyBool_FromLong(r->profile_memory)) < 0 ||
+        set_item(result, "profile_lines", PyBool_FromLong(r->profile_lines)) < 0 ||
+        set_item(result, "profile_line_offsets", PyBool_FromLong(r->profile_line_offsets)) < 0 ||
+        set_item(result, "profile_rpython", PyBool_FromLong(r->profile_rpython)) < 0 ||
+        set_item(result, "dropped_samples", PyLong_FromLong(dropped)) < 0 ||
+        set_item(result, "stacks", aggregated_to_list(r->samples, 0)) < 0 ||
+        set_item(result, "allocations", aggregated_to_list(r->allocs, 1)) < 0)
+        goto error;
+    if (PyDict_SetItemString(result, "meta", meta) < 0 ||
+        PyDict_SetItemString(result, "virtual_ips", virtual_ips) < 0 ||
+        PyDict_SetItemString(result, "line_tables", line_tables) < 0 ||
+        PyDict_SetItemString(result, "module_maps", module_maps) < 0 ||
+        PyDict_SetItemString(result, "thread_info", thread_info) < 0 ||
+        PyDict_SetItemString(result, "interp_name", interp_name ? interp_name : Py_None) < 0 ||
+        PyDict_SetItemString(result, "start_time", start_time ? start_time : Py_None) < 0 ||
+        PyDict_SetItemString(result, "end_time", end_time ? end_time : Py_None) < 0)
+        goto error;
+    goto done;
+
+ nomem:
+    PyErr_NoMemory();
+    goto error;
+ malformed:
+    if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_ValueError, "malformed profile (at offset %zd)",
+                     (Py_ssize_t)(r->pos - r->start));
+    }
+ error:
+    Py_CLEAR(result);
+ done:
+    Py_XDECREF(meta);
+    Py_XDECREF(virtual_ips);
+    Py_XDECREF(line_tables);
+    Py_XDECREF(module_maps);
+    Py_XDECREF(thread_info);
+    Py_XDECREF(interp_name);
+    Py_XDECREF(start_time);
+    Py_XDECREF(end_time);
+    return result;
+}
+
+PyObject *vmp_read_profile_aggregated(PyObject *module, PyObject *args)
+{
+    struct profile_reader_s reader;
+    struct stat st;
+    PyObject *result;
+    void *map;
+    int fd;
+
+    if (!PyArg_ParseTuple(args, "i", &fd)) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (st.st_size < 2) {
+        Py_RETURN_NONE;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (((unsigned char *)map)[0] == 0x1f && ((unsigned char *)map)[1] == 0x8b) {
+        /* gzipped */
+        munmap(map, st.st_size);
+        Py_RETURN_NONE;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    memset(&reader, 0, sizeof(reader));
+    reader.start = reader.pos = (const char *)map;
+    reader.end = reader.pos + st.st_size;
+    reader.samples = kh_init(vmp_agg);
+    reader.allocs = kh_init(vmp_agg);
+    reader.stackdefs = kh_init(vmp_stackdefs);
+    if (reader.samples == NULL || reader.allocs == NULL || reader.stackdefs == NULL) {
+        result = PyErr_NoMemory();
+    } else {
+        result = read_profile(&reader);
+    }
+
+    if (reader.samples != NULL)
+        kh_destroy(vmp_agg, reader.samples);
+    if (reader.allocs != NULL)
+        kh_destroy(vmp_agg, reader.allocs);
+    if (reader.stackdefs != NULL)
+        kh_destroy(vmp_stackdefs, reader.stackdefs);
+    free(reader.threads);
+    arena_free(&reader);
+    munmap(map, st.st_size);
+    return result;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <Python.h>
+
+/* Reads the profile behind a file descriptor in one pass over an mmap()
+   and aggregates the samples by stack and thread, without creating
+   Python objects per sample.  Returns None if the profile cannot be
+   read this way (gzipped, or written with a different word size). */
+PyObject *vmp_read_profile_aggregated(PyObject *module, PyObject *args);
@@ -0,0 +1,241 @@
+#include "vmprof_threads.h"
+
+#include "vmprof.h"
+#include "vmprof_common.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef VMPROF_LINUX
+#include <syscall.h>
+#endif
+
+/* Open addressing table of thread ids, the same scheme as the table of
+   code ids in vmprof_codes.c: the signal handler claims a slot with a
+   compare-and-swap, only its state moves afterwards.
+
+     any            -> THREAD_SEEN      sampler (the thread itself)
+     THREAD_SEEN    -> THREAD_EMITTED   drain (GIL held)
+
+   A thread marks itself only once per profile, it remembers the
+   generation of the table it did so in.  The kernel reuses the ids of
+   threads that ended; the new thread marks the slot again and is
+   described by another record, which replaces the first one. */
+
+#define THREAD_TABLE_SIZE   4096
+#define THREAD_MAX_PROBES   32
+
+#define THREAD_IDLE     0
+#define THREAD_SEEN     1
+#define THREAD_EMITTED  2
+
+struct thread_slot_s {
+    intptr_t volatile tid;      /* 0 if the slot is free */
+    long volatile state;
+};
+
+static struct thread_slot_s *thread_table = NULL;
+static long volatile thread_pending = 0;
+static long volatile thread_generation = 1;
+static int volatile drain_scheduled = 0;
+static vmp_emit_thread_fn thread_emit = NULL;
+
+#ifdef VMPROF_LINUX
+/* read from the signal handler: initial-exec never allocates */
+static __thread __attribute__((tls_model("initial-exec"))) intptr_t tls_tid = 0;
+static __thread __attribute__((tls_model("initial-exec"))) long tls_generation = 0;
+
+static void _thread_seen(intptr_t tid)
+{
+    size_t i = (size_t)tid & (THREAD_TABLE_SIZE - 1);
+    int probes;
+
+    if (thread_table == NULL)
+        return;
+    for (probes = 0; probes < THREAD_MAX_PROBES; probes++) {
+        struct thread_slot_s *slot = &thread_table[i];
+        if (slot->tid == tid ||
+                (slot->tid == 0 && __sync_bool_compare_and_swap(&slot->tid, 0, tid))) {
+            if (__sync_lock_test_and_set(&slot->state, THREAD_SEEN) != THREAD_SEEN)
+                __sync_fetch_and_add(&thread_pending, 1L);
+            return;
+        }
+        i = (i + 1) & (THREAD_TABLE_SIZE - 1);
+    }
+    /* table full, the thread stays without a name */
+}
+
+intptr_t vmp_thread_id(void)
+{
+    /* called from the signal handler, the system call is made once per
+       thread and profile */
+    if (tls_generation != thread_generation) {
+        tls_tid = (intptr_t)syscall(SYS_gettid);
+        tls_generation = thread_generation;
+        _thread_seen(tls_tid);
+    }
+    return tls_tid;
+}
+#endif
+
+int vmp_threads_reset(vmp_emit_thread_fn emit)
+{
+    /* not running concurrently with the sampler */
+    if (thread_table == NULL) {
+        thread_table = calloc(THREAD_TABLE_SIZE, sizeof(struct thread_slot_s));
+        if (thread_table == NULL)
+            return -1;
+    } else {
+        memset(thread_table, 0, THREAD_TABLE_SIZE * sizeof(struct thread_slot_s));
+    }
+    thread_emit = emit;
+    thread_pending = 0;
+    thread_generation++;
+    return 0;
+}
+
+static PyObject *_python_thread_names(void)
+{
+    /* {native_id: name} of the threads the threading module knows about.
+       threading.enumerate() takes a lock the interrupted thread might
+       hold, the dict of active threads is copied instead. */
+    PyObject *threading, *active, *threads, *names;
+    Py_ssize_t i;
+
+    if ((names = PyDict_New()) == NULL)
+        return NULL;
+    threading = PyDict_GetItemString(PyImport_GetModuleDict(), "threading");
+    if (threading == NULL)
+        return names;
+    active = PyObject_GetAttrString(threading, "_active");
+    if (active == NULL || !PyDict_Check(active)) {
+        Py_XDECREF(active);
+        PyErr_Clear();
+        return names;
+    }
+    threads = PyDict_Values(active);
+    Py_DECREF(active);
+    if (threads == NULL) {
+        Py_DECREF(names);
+        return NULL;
+    }
+    for (i = 0; i < PyList_GET_SIZE(threads); i++) {
+        PyObject *thread = PyList_GET_ITEM(threads, i);
+        /* native_id is new in 3.8 */
+        PyObject *native_id = PyObject_GetAttrString(thread, "native_id");
+        PyObject *name = PyObject_GetAttrString(thread, "name");
+        if (native_id != NULL && name != NULL && native_id != Py_None)
+            (void)PyDict_SetItem(names, native_id, name);
+        Py_XDECREF(native_id);
+        Py_XDECREF(name);
+        PyErr_Clear();
+    }
+    Py_DECREF(threads);
+    return names;
+}
+
+static void _native_thread_name(intptr_t tid, char *buf, size_t size)
+{
+    char path[64];
+    ssize_t count = -1;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%ld/comm", (long)tid);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        count = read(fd, buf, size - 1);
+        close(fd);
+    }
+    if (count < 0)
+        count = 0;
+    if (count > 0 && buf[count - 1] == '\n')
+        count--;
+    buf[count] = '\0';
+}
+
+static int _emit_thread(intptr_t tid, PyObject *names)
+{
+    char buf[64];
+    const char *name = "", *native_name;
+    PyObject *key, *value, *decoded;
+    int res;
+
+    key = PyLong_FromSsize_t((Py_ssize_t)tid);
+    if (key == NULL)
+        return -1;
+    value = PyDict_GetItem(names, key);
+    Py_DECREF(key);
+    if (value != NULL) {
+#if PY_MAJOR_VERSION >= 3
+        name = PyUnicode_AsUTF8(value);
+#else
+        name = PyString_AsString(value);
+#endif
+        if (name == NULL)
+            return -1;
+    }
+    /* the kernel cuts the name to 15 bytes, maybe within a character */
+    _native_thread_name(tid, buf, sizeof(buf));
+    decoded = PyUnicode_DecodeUTF8(buf, strlen(buf), "replace");
+    if (decoded == NULL)
+        return -1;
+#if PY_MAJOR_VERSION >= 3
+    native_name = PyUnicode_AsUTF8(decoded);
+    res = native_name == NULL ? -1 : thread_emit(tid, name, native_name);
+#else
+    res = thread_emit(tid, name, buf);
+#endif
+    Py_DECREF(decoded);
+    return res;
+}
+
+int vmp_threads_drain(void)
+{
+    PyObject *names;
+    size_t i;
+    int res = 0;
+
+    if (thread_table == NULL || thread_emit == NULL)
+        return 0;
+    if (thread_pending == 0)
+        return 0;
+    if ((names = _python_thread_names()) == NULL)
+        return -1;
+    for (i = 0; i < THREAD_TABLE_SIZE; i++) {
+        struct thread_slot_s *slot = &thread_table[i];
+        if (slot->state != THREAD_SEEN)
+            continue;
+        if (!__sync_bool_compare_and_swap(&slot->state, THREAD_SEEN, THREAD_EMITTED))
+            continue;
+        __sync_fetch_and_sub(&thread_pending, 1L);
+        if (_emit_thread(slot->tid, names) < 0)
+            res = -1;
+    }
+    Py_DECREF(names);
+    return res;
+}
+
+static int _drain_pending_call(void *arg)
+{
+    drain_scheduled = 0;
+    /* see vmprof_codes.c */
+    if (vmprof_is_enabled() && !vmp_writes_suspended()) {
+        if (vmp_threads_drain() < 0)
+            PyErr_Clear();
+        flush_codes();
+    }
+    return 0;
+}
+
+void vmp_threads_schedule_drain(void)
+{
+    /* called by the writer thread, without the GIL */
+    if (thread_pending == 0)
+        return;
+    if (!__sync_bool_compare_and_swap(&drain_scheduled, 0, 1))
+        return;
+    if (Py_AddPendingCall(_drain_pending_call, NULL) < 0)
+        drain_scheduled = 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "vmprof.h"
+
+/* Threads seen by the sampler (CPython only).
+ *
+ * On Linux samples name their thread by its kernel thread id, the one
+ * perf and top -H show, instead of the address of its PyThreadState.
+ * The first time a thread is sampled in a profile (or in a segment of
+ * it, see vmprof.rotate()) its id is marked in a table, like the code
+ * objects of vmprof_codes.h.  The marked threads are described later
+ * with the GIL held, by a MARKER_THREAD_INFO record with the name of
+ * their threading.Thread and the name of the pthread.  A thread that
+ * is gone by then has empty names.
+ */
+
+typedef int (*vmp_emit_thread_fn)(intptr_t tid, const char *name,
+                                  const char *native_name);
+
+#ifdef VMPROF_LINUX
+intptr_t vmp_thread_id(void);
+#endif
+int vmp_threads_reset(vmp_emit_thread_fn emit);
+int vmp_threads_drain(void);
+void vmp_threads_schedule_drain(void);
@@ -15,6 +15,7 @@
 
 #include <dlfcn.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
@@ -30,7 +31,15 @@
 #include "vmprof_getpc.h"
 #include "vmprof_common.h"
 #include "vmprof_memory.h"
+#ifndef RPYTHON_VMPROF
+#include "vmprof_alloc.h"
+#include "vmprof_compress.h"
+#include "vmprof_threads.h"
+#endif
 #include "compat.h"
+#ifdef VMP_SUPPORTS_MODULE_MAPS
+#include "symboltable.h"
+#endif
 
 
 
@@ -95,13 +104,18 @@ void segfault_handler(int arg)
 int _vmprof_sample_stack(struct profbuf_s *p, PY_THREAD_STATE_T * tstate, ucontext_t * uc)
 {
     int depth;
+    int timestamps = vmprof_get_timestamps();
+    int max_depth = MAX_STACK_DEPTH - (timestamps ? 3 : 1);
     struct prof_stacktrace_s *st = (struct prof_stacktrace_s *)p->data;
     st->marker = MARKER_STACKTRACE;
     st->count = 1;
 #ifdef RPYTHON_VMPROF
-    depth = get_stack_trace(get_vmprof_stack(), st->stack, MAX_STACK_DEPTH-1, (intptr_t)GetPC(uc));
+    depth = get_stack_trace(get_vmprof_stack(), st->stack, max_depth, (intptr_t)GetPC(uc));
 #else
-    depth = get_stack_trace(tstate, st->stack, MAX_STACK_DEPTH-1, (intptr_t)NULL);
+    // the frame pointer unwinder starts where the signal interrupted
+    vmp_native_set_ucontext(uc);
+    depth = get_stack_trace(tstate, st->stack, max_depth, (intptr_t)NULL);
+    vmp_native_set_ucontext(NULL);
 #endif
     // useful for tests (see test_stop_sampling)
 #ifndef RPYTHON_LL2CTYPES
@@ -110,10 +124,23 @@ int _vmprof_sample_stack(struct profbuf_s *p, PY_THREAD_STATE_T * tstate, uconte
     }
 #endif
     st->depth = depth;
+#if defined(VMPROF_LINUX) && !defined(RPYTHON_VMPROF)
+    // the kernel thread id, see vmprof_threads.h
+    st->stack[depth++] = (void*)vmp_thread_id();
+#else
     st->stack[depth++] = tstate;
+#endif
     long rss = get_current_proc_rss();
     if (rss >= 0)
         st->stack[depth++] = (void*)rss;
+    if (timestamps) {
+        st->stack[depth++] = (void*)(intptr_t)vmprof_timestamp_now();
+#ifdef VMPROF_LINUX
+        st->stack[depth++] = (void*)(intptr_t)sched_getcpu();
+#else
+        st->stack[depth++] = (void*)(intptr_t)-1;
+#endif
+    }
     p->data_offset = offsetof(struct prof_stacktrace_s, marker);
     p->data_size = (depth * sizeof(void *) +
                     sizeof(struct prof_stacktrace_s) -
@@ -125,11 +152,22 @@ int _vmprof_sample_stack(struct profbuf_s *p, PY_THREAD_STATE_T * tstate, uconte
 PY_THREAD_STATE_T * _get_pystate_for_this_thread(void) {
     // see issue 116 on github.com/vmprof/vmprof-python.
     // PyGILState_GetThisThreadState(); can hang forever
+    // (before 3.7 only, see sigprof_handler)
     //
     PyInterpreterState * istate;
     PyThreadState * state;
     long mythread_id;
 
+#if PY_VERSION_HEX >= 0x03070000
+    // O(1): CPython maintains this slot when thread states are created
+    // and deleted.  Only threads that have no slot (e.g. threads of a
+    // sub-interpreter) need the slow walk below.
+    state = PyGILState_GetThisThreadState();
+    if (state != NULL) {
+        return state;
+    }
+#endif
+
     mythread_id = PyThread_get_thread_ident();
     istate = PyInterpreterState_Head();
     if (istate == NULL) {
@@ -194,6 +232,17 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
         return;
     }
 
+#ifdef VMP_LOCKFREE_PYSTATE
+    // Since CPython 3.7 the thread state of a thread is kept in a native
+    // thread-specific slot: set when the thread state is created, cleared
+    // when it is deleted.  Reading it is a lock-free pthread_getspecific(),
+    // unlike the old implementation that made issue 116 hang.  This also
+    // covers threads that create and delete their thread states through
+    // PyGILState_Ensure/Release, where a private copy would dangle.
+    // No spinlock and no SIGSEGV guard are needed, samples of different
+    // threads do not serialize.
+    tstate = PyGILState_GetThisThreadState();
+#else
     // TERRIBLE HACK AHEAD
     // on OS X, the thread local storage is sometimes uninitialized
     // when the signal handler runs - it means it's impossible to read errno
@@ -207,12 +256,13 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
     while (__sync_lock_test_and_set(&spinlock, 1)) {
     }
 
-#ifdef VMPROF_UNIX
+#if defined(VMPROF_UNIX) && !defined(VMPROF_LINUX)
     // SIGNAL ABUSE AHEAD
-    // On linux, the prof timer will deliver the signal to the thread which triggered the timer,
+    // The prof timer will deliver the signal to the thread which triggered the timer,
     // because these timers are based on process and system time, and as such, are thread-aware.
     // For the real timer, the signal gets delivered to the main thread, seemingly always.
     // Consequently if we want to sample multiple threads, we need to forward this signal.
+    // (On Linux, every registered thread has a timer of its own instead.)
     if (vmprof_get_signal_type() == SIGALRM) {
         if (is_main_thread() && broadcast_signal_for_threads()) {
             __sync_lock_release(&spinlock);
@@ -233,6 +283,7 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
     }
     signal(SIGSEGV, prevhandler);
     __sync_lock_release(&spinlock);
+#endif /* VMP_LOCKFREE_PYSTATE */
 #endif
 
     long val = vmprof_enter_signal();
@@ -242,9 +293,10 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
         int fd = vmp_profile_fileno();
         assert(fd >= 0);
 
-        struct profbuf_s *p = reserve_buffer(fd);
+        struct profbuf_s *p = reserve_sample_buffer();
         if (p == NULL) {
-            /* ignore this signal: there are no free buffers right now */
+            /* ignore this signal: the ring of this thread is full right
+               now, the sample was counted as dropped */
         } else {
 #ifdef RPYTHON_VMPROF
             commit = _vmprof_sample_stack(p, NULL, (ucontext_t*)ucontext);
@@ -252,12 +304,12 @@ void sigprof_handler(int sig_nr, siginfo_t* info, void *ucontext)
             commit = _vmprof_sample_stack(p, tstate, (ucontext_t*)ucontext);
 #endif
             if (commit) {
-                commit_buffer(fd, p);
+                commit_sample_buffer(p);
             } else {
 #if DEBUG
                 fprintf(stderr, "WARNING: canceled buffer, no stack trace was written\n");
 #endif
-                cancel_buffer(p);
+                cancel_sample_buffer(p);
             }
         }
 
@@ -296,6 +348,10 @@ int remove_sigprof_handler(void)
 int install_sigprof_timer(void)
 {
     static struct itimerval timer;
+#ifdef VMPROF_LINUX
+    if (vmp_uses_thread_timers())
+        return vmp_arm_thread_timers(vmprof_get_profile_interval_usec());
+#endif
     timer.it_interval.tv_sec = 0;
     timer.it_interval.tv_usec = (int)vmprof_get_profile_interval_usec();
     timer.it_value = timer.it_interval;
@@ -307,6 +363,15 @@ int install_sigprof_timer(void)
 int remove_sigprof_timer(void)
 {
     static struct itimerval timer;
+#ifdef VMPROF_LINUX
+    if (vmp_uses_thread_timers()) {
+        if (vmp_arm_thread_timers(0) != 0) {
+            fprintf(stderr, "Could not disable the thread timers (for profiling)\n");
+            return -1;
+        }
+        return 0;
+    }
+#endif
     timerclear(&(timer.it_interval));
     timerclear(&(timer.it_value));
     if (setitimer(vmprof_get_itimer_type(), &timer, NULL) != 0) {
@@ -330,6 +395,12 @@ void atfork_close_profile_file(void)
     if (fd != -1)
         close(fd);
     vmp_set_profile_fileno(-1);
+    vmp_writer_atfork_child();
+    rss_atfork_child();
+#ifndef RPYTHON_VMPROF
+    vmp_alloc_atfork_child();
+    vmp_compress_atfork_child();
+#endif
 }
 void atfork_enable_timer(void)
 {
@@ -340,6 +411,20 @@ void atfork_enable_timer(void)
 }
 
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
+static long native_maps_generation = -1;
+
+static void load_native_ranges(void)
+{
+    // read the generation first: a dlopen() while reading the maps
+    // shows up as a change on the next check
+    native_maps_generation = vmp_native_maps_generation();
+#ifdef __APPLE__
+    (void)vmp_read_vmaps(NULL);
+#else
+    (void)vmp_read_vmaps("/proc/self/maps");
+#endif
+}
+
 void init_cpyprof(int native)
 {
     // skip this if native should not be enabled
@@ -348,6 +433,66 @@ void init_cpyprof(int native)
         return;
     }
     vmp_native_enable();
+    if (vmp_native_skips_interpreter()) {
+        load_native_ranges();
+    } else {
+        native_maps_generation = vmp_native_maps_generation();
+    }
+}
+
+#ifdef VMP_SUPPORTS_MODULE_MAPS
+static int _write_module_map(void *arg, uintptr_t start, uintptr_t end, uintptr_t base,
+                             const char *build_id, const char *path)
+{
+    char block[1 + 3 * sizeof(intptr_t) + 2 * sizeof(long) + 128 + 1024];
+    long build_id_len = strnlen(build_id, 128);
+    long path_len = strnlen(path, 1024);
+    char *t = block;
+
+    *t++ = MARKER_MODULE_MAP;
+    memcpy(t, &start, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &end, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &base, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &build_id_len, sizeof(long)); t += sizeof(long);
+    memcpy(t, build_id, build_id_len); t += build_id_len;
+    memcpy(t, &path_len, sizeof(long)); t += sizeof(long);
+    memcpy(t, path, path_len); t += path_len;
+    return vmp_write_all_fd(*(int *)arg, block, t - block);
+}
+
+static void write_module_maps(int fd)
+{
+    // the objects native addresses belong to, for offline symbolization
+    (void)vmp_iterate_modules(_write_module_map, &fd);
+}
+#endif
+
+void vmp_native_refresh_ranges(int fd)
+{
+    // called by the writer thread, which alone writes to the profile
+    // ('fd', read under the write lock) right now: the ranges only
+    // cover the shared objects that were mapped when they were read,
+    // the procedures in the cache might have been unloaded and the
+    // module maps miss new objects.  The signal handlers keep running:
+    // the cache is cleared entry by entry, the ranges are replaced
+    // with a single store.
+    long generation;
+    if (!vmp_native_enabled())
+        return;
+    generation = vmp_native_maps_generation();
+    if (generation == native_maps_generation)
+        return;
+    if (vmp_native_unwinder() == VMP_UNWIND_LIBUNWIND) {
+        vmp_native_ip_cache_clear();
+    }
+    if (vmp_native_skips_interpreter()) {
+        load_native_ranges();
+    } else {
+        native_maps_generation = generation;
+    }
+#ifdef VMP_SUPPORTS_MODULE_MAPS
+    write_module_maps(fd);
+#endif
 }
 
 static void disable_cpyprof(void)
@@ -362,16 +507,28 @@ int vmprof_enable(int memory, int native, int real_time)
     init_cpyprof(native);
 #endif
     assert(vmp_profile_fileno() >= 0);
+#ifdef VMP_SUPPORTS_MODULE_MAPS
+    if (vmp_native_enabled()) {
+        write_module_maps(vmp_profile_fileno());
+    }
+#endif
     assert(vmprof_get_prepare_interval_usec() > 0);
     vmprof_set_profile_interval_usec(vmprof_get_prepare_interval_usec());
     if (memory && setup_rss() == -1)
         goto error;
 #if VMPROF_UNIX
-    if (real_time && insert_thread(pthread_self(), -1) == -1)
+    long native_id = 0;
+#ifdef VMPROF_LINUX
+    native_id = (long)syscall(SYS_gettid);
+#endif
+    if ((real_time || vmprof_get_per_thread()) &&
+            insert_thread(pthread_self(), native_id) == -1)
         goto error;
 #endif
     if (install_pthread_atfork_hooks() == -1)
         goto error;
+    if (vmp_start_writer(vmprof_get_profile_interval_usec()) == -1)
+        goto error;
     if (install_sigprof_handler() == -1)
         goto error;
     if (install_sigprof_timer() == -1)
@@ -390,7 +547,12 @@ int close_profile(void)
 {
     int fileno = vmp_profile_fileno();
     fsync(fileno);
+    long dropped = vmp_dropped_samples();
     (void)vmp_write_time_now(MARKER_TRAILER);
+    (void)vmp_write_all((char*)&dropped, sizeof(long));
+#ifndef RPYTHON_VMPROF
+    (void)vmp_compress_stop(fileno);
+#endif
     teardown_rss();
 
     /* don't close() the file descriptor from here */
@@ -398,6 +560,35 @@ int close_profile(void)
     return 0;
 }
 
+int vmprof_rotate(int fd, char *trailer)
+{
+    /* Ends the current segment of the profile and continues in 'fd',
+       with the timer still running.  The signals must be ignored and the
+       writes suspended (see vmp_suspend_writes()).  Returns the file
+       descriptor of the segment that ended, which lacks its trailer:
+       'trailer' receives it (VMP_TRAILER_SIZE bytes), the caller writes
+       it after the native symbols. */
+    int old_fd = vmp_profile_fileno();
+    long dropped = vmp_rotate_writes(old_fd);
+    if (dropped < 0)
+        return -1;
+    if (vmp_format_time_now(MARKER_TRAILER, trailer) < 0)
+        return -1;
+    memcpy(trailer + VMP_TIME_RECORD_SIZE, &dropped, sizeof(long));
+
+    vmp_set_profile_fileno(fd);
+    // the timestamps of the samples count from the new start
+    vmprof_set_timestamps(vmprof_get_timestamps());
+    if (reopened_profile() < 0)
+        return -1;
+#ifdef VMP_SUPPORTS_MODULE_MAPS
+    if (vmp_native_enabled()) {
+        write_module_maps(vmp_profile_fileno());
+    }
+#endif
+    return old_fd;
+}
+
 int vmprof_disable(void)
 {
     signal_handler_ignore = 1;
@@ -413,24 +604,30 @@ int vmprof_disable(void)
         return -1;
     }
 #ifdef VMPROF_UNIX
-    if ((vmprof_get_signal_type() == SIGALRM) && remove_threads() == -1) {
+    if ((vmprof_get_signal_type() == SIGALRM || vmprof_get_per_thread()) &&
+            remove_threads() == -1) {
         return -1;
     }
 #endif
+    vmp_resume_writes();
     flush_codes();
+    if (vmp_stop_writer() == -1)
+        return -1;
+#ifdef VMP_SUPPORTS_NATIVE_PROFILING
+    vmp_native_free_ranges();
+#endif
     if (shutdown_concurrent_bufs(vmp_profile_fileno()) < 0)
         return -1;
     return close_profile();
 }
 
-int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
-                                     int auto_retry)
+static int _write_code_block(const char *block, long blocklen, int auto_retry)
 {
-    long namelen = strnlen(code_name, 1023);
-    long blocklen = 1 + sizeof(intptr_t) + sizeof(long) + namelen;
+    /* appends 'block' to 'current_codes', the buffer shared by all
+       records that describe code */
     struct profbuf_s *p;
-    char *t;
 
+    assert(blocklen <= (long)SINGLE_BUF_SIZE);
  retry:
     p = current_codes;
     if (p != NULL) {
@@ -465,13 +662,9 @@ int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
         }
     }
 
-    t = p->data + p->data_size;
+    memcpy(p->data + p->data_size, block, blocklen);
     p->data_size += blocklen;
     assert(p->data_size <= SINGLE_BUF_SIZE);
-    *t++ = MARKER_VIRTUAL_IP;
-    memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
-    memcpy(t, &namelen, sizeof(long)); t += sizeof(long);
-    memcpy(t, code_name, namelen);
 
     /* try to reattach 'p' to 'current_codes' */
     if (!__sync_bool_compare_and_swap(&current_codes, NULL, p)) {
@@ -481,6 +674,74 @@ int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
     return 0;
 }
 
+int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
+                                     int auto_retry)
+{
+    char block[1 + sizeof(intptr_t) + sizeof(long) + 1024];
+    long namelen = strnlen(code_name, 1023);
+    char *t = block;
+
+    *t++ = MARKER_VIRTUAL_IP;
+    memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &namelen, sizeof(long)); t += sizeof(long);
+    memcpy(t, code_name, namelen); t += namelen;
+    return _write_code_block(block, t - block, auto_retry);
+}
+
+int vmprof_register_line_table(intptr_t code_uid, long format, long firstlineno,
+                               const char *table, long size, int auto_retry)
+{
+    /* a line table can be bigger than a buffer, it is written in chunks
+       that carry their offset into the table */
+    char block[1 + sizeof(intptr_t) + 4 * sizeof(long) + LINETABLE_CHUNK];
+    long offset = 0;
+
+    do {
+        long chunk = size - offset;
+        char *t = block;
+        if (chunk > LINETABLE_CHUNK)
+            chunk = LINETABLE_CHUNK;
+        *t++ = MARKER_LINETABLE;
+        memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
+        memcpy(t, &format, sizeof(long)); t += sizeof(long);
+        memcpy(t, &firstlineno, sizeof(long)); t += sizeof(long);
+        memcpy(t, &offset, sizeof(long)); t += sizeof(long);
+        memcpy(t, &chunk, sizeof(long)); t += sizeof(long);
+        memcpy(t, table + offset, chunk); t += chunk;
+        if (_write_code_block(block, t - block, auto_retry) < 0)
+            return -1;
+        offset += chunk;
+    } while (offset < size);
+    return 0;
+}
+
+static long _utf8_prefix(const char *s, long maxlen)
+{
+    /* the length of 's' cut to 'maxlen' bytes, not within a character */
+    long len = strnlen(s, maxlen);
+    if (s[len] != '\0')
+        while (len > 0 && (s[len] & 0xc0) == 0x80)
+            len--;
+    return len;
+}
+
+int vmprof_register_thread_info(intptr_t tid, const char *name,
+                                const char *native_name, int auto_retry)
+{
+    char block[1 + sizeof(intptr_t) + 2 * sizeof(long) + 2 * 256];
+    long namelen = _utf8_prefix(name, 255);
+    long native_namelen = _utf8_prefix(native_name, 255);
+    char *t = block;
+
+    *t++ = MARKER_THREAD_INFO;
+    memcpy(t, &tid, sizeof(intptr_t)); t += sizeof(intptr_t);
+    memcpy(t, &namelen, sizeof(long)); t += sizeof(long);
+    memcpy(t, name, namelen); t += namelen;
+    memcpy(t, &native_namelen, sizeof(long)); t += sizeof(long);
+    memcpy(t, native_name, native_namelen); t += native_namelen;
+    return _write_code_block(block, t - block, auto_retry);
+}
+
 #if PY_VERSION_HEX < 0x030900B1  && ! defined(RPYTHON_VMPROF) /* < 3.9 */
 static inline PyFrameObject* PyThreadState_GetFrame(PyThreadState *tstate)
 {
@@ -40,6 +40,10 @@ RPY_EXTERN long vmprof_exit_signal(void);
 
 #ifndef RPYTHON_VMPROF
 PY_THREAD_STATE_T * _get_pystate_for_this_thread(void);
+#if defined(VMPROF_LINUX) && PY_VERSION_HEX >= 0x03070000
+/* the signal handler reads the thread state without taking locks */
+#define VMP_LOCKFREE_PYSTATE 1
+#endif
 #endif
 int get_stack_trace(PY_THREAD_STATE_T * current, void** result, int max_depth, intptr_t pc);
 
@@ -72,10 +76,14 @@ int install_pthread_atfork_hooks(void);
 #ifdef VMP_SUPPORTS_NATIVE_PROFILING
 void init_cpyprof(int native);
 static void disable_cpyprof(void);
+void vmp_native_refresh_ranges(int fd);
 #endif
 
 int close_profile(void);
 
+#define VMP_TRAILER_SIZE (VMP_TIME_RECORD_SIZE + sizeof(long))
+int vmprof_rotate(int fd, char *trailer);
+
 RPY_EXTERN
 int vmprof_enable(int memory, int native, int real_time);
 RPY_EXTERN
@@ -83,6 +91,10 @@ int vmprof_disable(void);
 RPY_EXTERN
 int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
                                      int auto_retry);
+int vmprof_register_line_table(intptr_t code_uid, long format, long firstlineno,
+                               const char *table, long size, int auto_retry);
+int vmprof_register_thread_info(intptr_t tid, const char *name,
+                                const char *native_name, int auto_retry);
 
 
 void vmprof_aquire_lock(void);
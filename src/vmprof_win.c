@@ -34,6 +34,30 @@ int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
     return 0;
 }
 
+int vmprof_register_line_table(intptr_t code_uid, long format, long firstlineno,
+                               const char *table, long size, int auto_retry)
+{
+    char buf[1 + sizeof(intptr_t) + 4 * sizeof(long) + LINETABLE_CHUNK];
+    long offset = 0;
+
+    do {
+        long chunk = size - offset;
+        char *t = buf;
+        if (chunk > LINETABLE_CHUNK)
+            chunk = LINETABLE_CHUNK;
+        *t++ = MARKER_LINETABLE;
+        memcpy(t, &code_uid, sizeof(intptr_t)); t += sizeof(intptr_t);
+        memcpy(t, &format, sizeof(long)); t += sizeof(long);
+        memcpy(t, &firstlineno, sizeof(long)); t += sizeof(long);
+        memcpy(t, &offset, sizeof(long)); t += sizeof(long);
+        memcpy(t, &chunk, sizeof(long)); t += sizeof(long);
+        memcpy(t, table + offset, chunk); t += chunk;
+        vmp_write_all(buf, t - buf);
+        offset += chunk;
+    } while (offset < size);
+    return 0;
+}
+
 int vmp_write_all(const char *buf, size_t bufsize)
 {
     int res;
@@ -149,8 +173,10 @@ PY_WIN_THREAD_STATE * get_current_thread_state(void)
     return _PyThreadState_Current;
 #elif PY_VERSION_HEX < 0x03050200
     return (PyThreadState*) _Py_atomic_load_relaxed(&_PyThreadState_Current);
-#else
+#elif PY_VERSION_HEX < 0x030D0000
     return _PyThreadState_UncheckedGet();
+#else
+    return PyThreadState_GetUnchecked();
 #endif
 }
 #endif
@@ -228,7 +254,9 @@ RPY_EXTERN
 int vmprof_disable(void)
 {
     char marker = MARKER_TRAILER;
+    long dropped = 0;
     (void)vmp_write_time_now(MARKER_TRAILER);
+    vmp_write_all((char*)&dropped, sizeof(long));
 
     enabled = 0;
     vmp_set_profile_fileno(-1);
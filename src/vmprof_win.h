@@ -21,6 +21,8 @@ typedef PyThreadState PY_WIN_THREAD_STATE;
 
 int vmprof_register_virtual_function(char *code_name, intptr_t code_uid,
                                      int auto_retry);
+int vmprof_register_line_table(intptr_t code_uid, long format, long firstlineno,
+                               const char *table, long size, int auto_retry);
 
 PY_WIN_THREAD_STATE * get_current_thread_state(void);
 int vmprof_enable(int memory, int native, int real_time);
@@ -1,5 +1,6 @@
 import os
 import sys
+import threading
 try:
     from shutil import which
 except ImportError:
@@ -9,10 +10,10 @@ import _vmprof
 
 from vmprof import cli
 
-from vmprof.reader import (MARKER_NATIVE_SYMBOLS, FdWrapper,
+from vmprof.reader import (MARKER_NATIVE_SYMBOLS, FdWrapper, gunzip,
         LogReaderState, LogReaderDumpNative)
 from vmprof.stats import Stats
-from vmprof.profiler import Profiler, read_profile
+from vmprof.profiler import Profiler, RotatingProfiler, read_profile
 
 
 PY3  = sys.version_info[0] >= 3
@@ -26,7 +27,14 @@ IS_PYPY = '__pypy__' in sys.builtin_module_names
 # 1000Hz
 DEFAULT_PERIOD = 0.00099
 
-def disable():
+# how enable(native=True) walks the native stack
+NATIVE_UNWINDERS = {'libunwind': 0, 'frame_pointer': 1}
+
+def disable(resolve_native=True):
+    """ Stops profiling. The native symbols of the profile are resolved
+        right away, unless resolve_native is False: then the profile
+        can be symbolized later, see vmprof.symbolize.
+    """
     try:
         # fish the file descriptor that is still open!
         try:
@@ -34,8 +42,13 @@ def disable():
                 fileno = _vmprof.stop_sampling()
                 if fileno >= 0:
                     # TODO does fileobj leak the fd? I dont think so, but need to check
-                    fileobj = FdWrapper(fileno)
+                    raw = FdWrapper(fileno)
+                    raw.seek(0, os.SEEK_SET)
+                    fileobj = gunzip(raw)
                     l = LogReaderDumpNative(fileobj, LogReaderState())
+                    l.resolve_native = resolve_native
+                    l.out = raw
+                    l.gzip_output = fileobj is not raw
                     l.read_all()
                     if hasattr(_vmprof, 'write_all_code_objects'):
                         _vmprof.write_all_code_objects(l.dedup)
@@ -44,6 +57,27 @@ def disable():
     except IOError as e:
         raise Exception("Error while writing profile: " + str(e))
 
+def rotate(fileno, resolve_native=True):
+    """ Ends the current segment of the profile and continues profiling
+        into the file descriptor fileno, without stopping the timer.
+        The segment that ended gets its native symbols (see disable())
+        and its trailer. Returns its file descriptor, which is left open.
+    """
+    old_fileno, trailer = _vmprof.rotate(fileno)
+    try:
+        raw = FdWrapper(old_fileno)
+        raw.seek(0, os.SEEK_SET)
+        fileobj = gunzip(raw)
+        l = LogReaderDumpNative(fileobj, LogReaderState())
+        l.resolve_native = resolve_native
+        l.out = raw
+        l.gzip_output = fileobj is not raw
+        l.trailer = trailer
+        l.read_all()
+    except IOError as e:
+        raise Exception("Error while writing profile: " + str(e))
+    return old_fileno
+
 def _is_native_enabled(native):
     if os.name == "nt":
         if native:
@@ -79,11 +113,33 @@ if IS_PYPY:
         _vmprof.enable(fileno, period)
 else:
     # CPYTHON
-    def enable(fileno, period=DEFAULT_PERIOD, memory=False, lines=False, native=None, real_time=False):
+    def enable(fileno, period=DEFAULT_PERIOD, memory=False, lines=False, native=None, real_time=False,
+               per_thread=False, alloc_sample_bytes=0, native_skip_interpreter=False,
+               native_unwinder='libunwind', native_lines=False, compress=False,
+               timestamps=False):
         if not isinstance(period, float):
             raise ValueError("period must be a float, not %s" % type(period))
+        # True picks the fastest level, the profile is written as it goes
+        if compress is True:
+            compress = 1
+        elif compress is False:
+            compress = 0
+        if not isinstance(compress, int) or not 0 <= compress <= 9:
+            raise ValueError("compress must be a bool or a level from 1 to 9, not %r" % (compress,))
+        if native_unwinder not in NATIVE_UNWINDERS:
+            raise ValueError("native_unwinder must be one of %s, not %r" %
+                             (', '.join(sorted(NATIVE_UNWINDERS)), native_unwinder))
         native = _is_native_enabled(native)
-        _vmprof.enable(fileno, period, memory, lines, native, real_time)
+        _vmprof.enable(fileno, period, memory, lines, native, real_time, per_thread,
+                       alloc_sample_bytes, native_skip_interpreter,
+                       NATIVE_UNWINDERS[native_unwinder], native_lines, compress,
+                       timestamps)
+        if per_thread:
+            # the caller thread was registered by _vmprof.enable()
+            current = threading.current_thread()
+            for thread in threading.enumerate():
+                if thread is not current and thread.ident is not None:
+                    insert_real_time_thread(thread.ident)
 
     def sample_stack_now(skip=0):
         """ Helper utility mostly for tests, this is considered
@@ -102,16 +158,65 @@ else:
         """
         return _vmprof.resolve_addr(addr)
 
+    def set_symbol_cache(directory):
+        """ Keeps the native symbols resolved when a profile is written
+            in 'directory', in a file per shared object named after its
+            build id. Profiles of the same binaries look them up there
+            instead of reading the debug info again. None turns the cache
+            off. Linux only, elsewhere this does nothing.
+        """
+        if not hasattr(_vmprof, 'set_symbol_cache'):
+            return
+        if directory is not None:
+            directory = os.path.abspath(directory)
+            if not os.path.isdir(directory):
+                os.makedirs(directory)
+        _vmprof.set_symbol_cache(directory)
+
+    def native_cache_stats():
+        """ Returns how often the procedure of a native frame was found
+            in the cache (hits) or looked up with libunwind (misses) since
+            native profiling was last enabled, and the number of cache
+            entries.
+        """
+        if not hasattr(_vmprof, 'native_cache_stats'):
+            return {'hits': 0, 'misses': 0, 'size': 0}
+        hits, misses, size = _vmprof.native_cache_stats()
+        return {'hits': hits, 'misses': misses, 'size': size}
+
+def _native_thread_id(thread_id):
+    thread = threading._active.get(thread_id)
+    return getattr(thread, 'native_id', None) or 0
+
 def insert_real_time_thread(thread_id=0):
-    """ Inserts a thread into the list of threads to be sampled in real time mode.
-        When enabling real time mode, the caller thread is inserted automatically.
+    """ Inserts a thread into the list of threads to be sampled in real time
+        or per-thread mode.  When enabling one of these modes, the caller
+        thread is inserted automatically (with per_thread=True, all threads
+        alive at that point are).
         Returns the number of registered threads, or -1 if we can't insert thread.
         Inserts the current thread if thread_id is not provided.
     """
+    if thread_id and not IS_PYPY:
+        return _vmprof.insert_real_time_thread(thread_id,
+                                               _native_thread_id(thread_id))
     return _vmprof.insert_real_time_thread(thread_id)
 
+def register_native_thread():
+    """ Lets native profiling with native_unwinder='frame_pointer' walk the
+        native stack of the calling thread, in any sampling mode.  Without it
+        the samples of a thread other than the one that enabled vmprof only
+        record the interrupted native frame.  insert_real_time_thread() does
+        this as well when called without a thread_id.
+        Returns True if the thread was registered, False if frame pointer
+        unwinding is not active.
+    """
+    if not hasattr(_vmprof, 'register_native_thread'):
+        return False
+    return _vmprof.register_native_thread()
+
 def remove_real_time_thread(thread_id=0):
-    """ Removes a thread from the list of threads to be sampled in real time mode.
+    """ Removes a thread from the list of threads to be sampled in real time
+        or per-thread mode.
         When disabling in real time mode, *all* threads are removed automatically.
         Returns the number of registered threads, or -1 if we can't remove thread.
         Removes the current thread if thread_id is not provided.
@@ -49,8 +49,13 @@ def main():
         prof_name = prof_file.name
 
 
+    if args.symbol_cache and hasattr(vmprof, 'set_symbol_cache'):
+        vmprof.set_symbol_cache(args.symbol_cache)
+    kwargs = {}
+    if args.compress:
+        kwargs['compress'] = True
     vmprof.enable(prof_file.fileno(), args.period, args.mem,
-                  args.lines, native=native)
+                  args.lines, native=native, **kwargs)
     if args.jitlog and _jitlog:
         fd = os.open(prof_name + '.jit', os.O_WRONLY | os.O_TRUNC | os.O_CREAT)
         _jitlog.enable(fd)
@@ -71,6 +71,16 @@ def build_argparser():
         action='store_true',
         help='Disable native profiling for this run'
     )
+    parser.add_argument(
+        '--symbol-cache',
+        metavar='directory',
+        help='Keep resolved native symbols in this directory for later runs'
+    )
+    parser.add_argument(
+        '--compress',
+        action='store_true',
+        help='Write the profile gzip compressed'
+    )
     output_mode_args = parser.add_mutually_exclusive_group()
     output_mode_args.add_argument(
         '--web',
@@ -99,6 +109,7 @@ def parse_args(argv):
             ('web-url', str),
             ('output', str),
             ('no-native', bool),
+            ('symbol-cache', str),
         ]
 
         ini_parser = IniParser(args.config)
@@ -168,6 +179,10 @@ def show(stats):
         else:
             print(" %s %s" % (v.ljust(7), k.ljust(max_len + 1)))
 
+    if stats.dropped_samples:
+        print(" %d samples were dropped, the writer did not keep up" %
+              stats.dropped_samples)
+
 
 def _namelen(e):
     if e.startswith('py:'):
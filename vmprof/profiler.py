@@ -1,8 +1,9 @@
 import vmprof
 import tempfile
+import threading
 
 from vmprof.stats import Stats
-from vmprof.reader import _read_prof
+from vmprof.reader import _read_prof, _read_prof_aggregated
 
 
 class VMProfError(Exception):
@@ -11,7 +12,10 @@ class VMProfError(Exception):
 class ProfilerContext(object):
     done = False
 
-    def __init__(self, name, period, memory, native, real_time):
+    def __init__(self, name, period, memory, native, real_time, per_thread=False,
+                 alloc_sample_bytes=0, native_skip_interpreter=False,
+                 native_unwinder='libunwind', native_lines=False, compress=False,
+                 timestamps=False):
         if name is None:
             self.tmpfile = tempfile.NamedTemporaryFile("w+b", delete=False)
         else:
@@ -21,10 +25,33 @@ class ProfilerContext(object):
         self.memory = memory
         self.native = native
         self.real_time = real_time
+        self.per_thread = per_thread
+        self.alloc_sample_bytes = alloc_sample_bytes
+        self.native_skip_interpreter = native_skip_interpreter
+        self.native_unwinder = native_unwinder
+        self.native_lines = native_lines
+        self.compress = compress
+        self.timestamps = timestamps
 
     def __enter__(self):
+        kwargs = {}
+        if self.per_thread:
+            # not accepted by the PyPy variant of vmprof.enable()
+            kwargs['per_thread'] = True
+        if self.alloc_sample_bytes:
+            kwargs['alloc_sample_bytes'] = self.alloc_sample_bytes
+        if self.native_skip_interpreter:
+            kwargs['native_skip_interpreter'] = True
+        if self.native_unwinder != 'libunwind':
+            kwargs['native_unwinder'] = self.native_unwinder
+        if self.native_lines:
+            kwargs['native_lines'] = True
+        if self.compress:
+            kwargs['compress'] = self.compress
+        if self.timestamps:
+            kwargs['timestamps'] = True
         vmprof.enable(self.tmpfile.fileno(), self.period, self.memory,
-                      native=self.native, real_time=self.real_time)
+                      native=self.native, real_time=self.real_time, **kwargs)
 
     def __exit__(self, type, value, traceback):
         vmprof.disable()
@@ -32,12 +59,20 @@ class ProfilerContext(object):
         self.done = True
 
 
-def read_profile(prof_file):
+def read_profile(prof_file, aggregate=False):
+    """ Reads a profile into a Stats object. With aggregate=True, samples
+        that share stack and thread become one entry of Stats.profiles,
+        which keeps memory bounded for huge profiles (memory readings are
+        lost).
+    """
     file_to_close = None
     if not hasattr(prof_file, 'read'):
         prof_file = file_to_close = open(str(prof_file), 'rb')
 
-    state = _read_prof(prof_file)
+    if aggregate:
+        state = _read_prof_aggregated(prof_file)
+    else:
+        state = _read_prof(prof_file)
 
     if file_to_close:
         file_to_close.close()
@@ -56,8 +91,13 @@ class Profiler(object):
     def __init__(self):
         self._lib_cache = {}
 
-    def measure(self, name=None, period=0.001, memory=False, native=False, real_time=False):
-        self.ctx = ProfilerContext(name, period, memory, native, real_time)
+    def measure(self, name=None, period=0.001, memory=False, native=False, real_time=False,
+                per_thread=False, alloc_sample_bytes=0, native_skip_interpreter=False,
+                native_unwinder='libunwind', native_lines=False, compress=False,
+                timestamps=False):
+        self.ctx = ProfilerContext(name, period, memory, native, real_time, per_thread,
+                                   alloc_sample_bytes, native_skip_interpreter,
+                                   native_unwinder, native_lines, compress, timestamps)
         return self.ctx
 
     def get_stats(self):
@@ -69,3 +109,69 @@ class Profiler(object):
         self.ctx = None
         return res
 
+
+
+class RotatingProfiler(object):
+    """ Profiles continuously into a new file every 'interval' seconds,
+        see vmprof.rotate(). The files are named pattern % n, n counts
+        from 0. Once a file is complete, on_segment(filename) is called
+        (from the thread that rotates). Keyword arguments go to
+        vmprof.enable().
+    """
+    thread = None
+
+    def __init__(self, pattern, interval=60.0, on_segment=None, **kwargs):
+        self.pattern = pattern
+        self.interval = interval
+        self.on_segment = on_segment
+        self.kwargs = kwargs
+        self.number = 0
+        self.current = None
+        self.lock = threading.Lock()
+        self.stopped = threading.Event()
+
+    def _open_next(self):
+        fileobj = open(self.pattern % self.number, "w+b")
+        self.number += 1
+        return fileobj
+
+    def _finished(self, fileobj):
+        fileobj.close()
+        if self.on_segment is not None:
+            self.on_segment(fileobj.name)
+
+    def start(self):
+        self.current = self._open_next()
+        vmprof.enable(self.current.fileno(), **self.kwargs)
+        self.thread = threading.Thread(target=self._run, name='vmprof-rotate')
+        self.thread.daemon = True
+        self.thread.start()
+        return self
+
+    def _run(self):
+        while not self.stopped.wait(self.interval):
+            self.rotate()
+
+    def rotate(self):
+        with self.lock:
+            if self.current is None:
+                return
+            fileobj = self._open_next()
+            vmprof.rotate(fileobj.fileno())
+            previous, self.current = self.current, fileobj
+        self._finished(previous)
+
+    def stop(self):
+        self.stopped.set()
+        if self.thread is not None:
+            self.thread.join()
+        with self.lock:
+            vmprof.disable()
+            previous, self.current = self.current, None
+        self._finished(previous)
+
+    def __enter__(self):
+        return self.start()
+
+    def __exit__(self, type, value, traceback):
+        self.stop()
@@ -4,7 +4,7 @@ import struct
 import sys
 from six.moves import xrange
 import io
-import gzip
+import zlib
 import datetime
 
 PY3  = sys.version_info[0] >= 3
@@ -18,6 +18,12 @@ MARKER_HEADER = b'\x05'
 MARKER_TIME_N_ZONE = b'\x06'
 MARKER_META = b'\x07'
 MARKER_NATIVE_SYMBOLS = b'\x08'
+MARKER_STACK_DEF = b'\x09'
+MARKER_STACK_REF = b'\x0a'
+MARKER_ALLOC = b'\x0b'
+MARKER_LINETABLE = b'\x0c'
+MARKER_MODULE_MAP = b'\x0d'
+MARKER_THREAD_INFO = b'\x0e'
 
 
 VERSION_BASE = 0
@@ -27,11 +33,20 @@ VERSION_MEMORY = 3
 VERSION_MODE_AWARE = 4
 VERSION_DURATION = 5
 VERSION_TIMESTAMP = 6
+VERSION_DROPPED_SAMPLES = 7
+VERSION_COMPACT = 8
 
 PROFILE_MEMORY = 1
 PROFILE_LINES = 2
 PROFILE_NATIVE = 4
 PROFILE_RPYTHON = 8
+PROFILE_LINE_OFFSETS = 0x20
+PROFILE_TIMESTAMPS = 0x40
+
+LINETABLE_LNOTAB_UNSIGNED = 0
+LINETABLE_LNOTAB = 1
+LINETABLE_PY310 = 2
+LINETABLE_PY311 = 3
 
 VMPROF_CODE_TAG = 1
 VMPROF_BLACKHOLE_TAG = 2
@@ -61,11 +76,95 @@ def wrap_kind(kind, pc):
     assert kind == VMPROF_CODE_TAG
     return pc
 
+def _signed64(value):
+    value &= 0xffffffffffffffff
+    if value >= 0x8000000000000000:
+        return value - 0x10000000000000000
+    return value
+
+def wrap_native(addr):
+    if addr > 0 and addr & 1 == 1:
+        return NativeCode(addr)
+    return addr
+
+class GzipMembers(io.RawIOBase):
+    """ The uncompressed data of the complete gzip members in fileobj.
+        vmprof ends a member about once a second while it writes a
+        compressed profile; the member a crash cut short (or the one
+        that is still being written) is left out, instead of failing
+        like gzip.GzipFile does.
+    """
+    CHUNK = 65536
+
+    def __init__(self, fileobj):
+        self.fileobj = fileobj
+        self.start = fileobj.tell()
+        self.rewind()
+
+    def rewind(self):
+        self.fileobj.seek(self.start, os.SEEK_SET)
+        self.decompressor = None
+        self.pending = []       # output of the member being read
+        self.data = b''         # of complete members, not read yet
+        self.offset = 0
+        self.pos = 0
+        self.eof = False
+
+    def readable(self):
+        return True
+
+    def seekable(self):
+        return True
+
+    def _fill(self):
+        while not self.data and not self.eof:
+            chunk = self.fileobj.read(self.CHUNK)
+            if not chunk:
+                self.eof = True
+                break
+            while chunk:
+                if self.decompressor is None:
+                    self.decompressor = zlib.decompressobj(16 + zlib.MAX_WBITS)
+                self.pending.append(self.decompressor.decompress(chunk))
+                if not self.decompressor.eof:
+                    break
+                self.pending.append(self.decompressor.flush())
+                chunk = self.decompressor.unused_data
+                self.decompressor = None
+                self.data += b''.join(self.pending)
+                self.pending = []
+
+    def readinto(self, buf):
+        if self.offset >= len(self.data):
+            self.data = b''
+            self.offset = 0
+            self._fill()
+        count = min(len(buf), len(self.data) - self.offset)
+        buf[:count] = self.data[self.offset:self.offset + count]
+        self.offset += count
+        self.pos += count
+        return count
+
+    def tell(self):
+        return self.pos
+
+    def seek(self, pos, how=os.SEEK_SET):
+        if how == os.SEEK_CUR:
+            pos += self.pos
+        elif how != os.SEEK_SET:
+            raise io.UnsupportedOperation("can only seek from the start")
+        if pos < self.pos:
+            self.rewind()
+        while self.pos < pos:
+            if not self.read(min(pos - self.pos, self.CHUNK)):
+                break
+        return self.pos
+
 def gunzip(fileobj):
     is_gzipped = fileobj.read(2) == b'\037\213'
     fileobj.seek(-2, os.SEEK_CUR)
     if is_gzipped:
-        fileobj = io.BufferedReader(gzip.GzipFile(fileobj=fileobj))
+        fileobj = io.BufferedReader(GzipMembers(fileobj))
     return fileobj
 
 class ReaderStatus(object):
@@ -76,6 +175,7 @@ class ReaderStatus(object):
         else:
             self.virtual_ips = {}
         self.profiles = []
+        self.allocations = []
         self.interp_name = interp_name
         self.period = period
         self.version = version
@@ -97,6 +197,11 @@ class LogReader(object):
         self.state = state
         self.word_size = None
         self.addr_size = None
+        self.stacks = {}
+        # VERSION_COMPACT: the addresses of every stack as written, and
+        # [thread_id, last stack, last rss, last time] per thread number
+        self.raw_stacks = {}
+        self.threads = []
         self.setup()
 
     def setup(self):
@@ -163,6 +268,8 @@ class LogReader(object):
             s.profile_memory = (mode & PROFILE_MEMORY) != 0
             s.profile_lines = (mode & PROFILE_LINES) != 0
             s.profile_rpython = (mode & PROFILE_RPYTHON) != 0
+            s.profile_line_offsets = (mode & PROFILE_LINE_OFFSETS) != 0
+            s.profile_timestamps = (mode & PROFILE_TIMESTAMPS) != 0
         else:
             s.profile_memory = s.version == VERSION_MEMORY
             s.profile_lines = False
@@ -202,15 +309,19 @@ class LogReader(object):
         return bytes
 
     def read_trace(self, depth):
+        return self.decode_trace(self.read_addresses(depth))
+
+    def decode_trace(self, addrs):
+        """ Turns the addresses of a stack record (see read_addresses)
+            into a trace, in the order they were written.
+        """
         if self.state.profile_rpython:
-            assert depth & 1 == 0
-            depth = depth // 2
-            kinds_and_pcs = self.read_addresses(depth * 2)
-            # kinds_and_pcs is a list of [kind1, pc1, kind2, pc2, ...]
-            return [wrap_kind(kinds_and_pcs[i], kinds_and_pcs[i+1])
-                    for i in xrange(0, len(kinds_and_pcs), 2)]
+            assert len(addrs) & 1 == 0
+            # addrs is a list of [kind1, pc1, kind2, pc2, ...]
+            return [wrap_kind(addrs[i], addrs[i+1])
+                    for i in xrange(0, len(addrs), 2)]
         else:
-            trace = self.read_addresses(depth)
+            trace = addrs
 
             if self.state.profile_lines:
                 for i in xrange(0, len(trace), 2):
@@ -220,13 +331,52 @@ class LogReader(object):
             return trace
 
     def read_addresses(self, count):
-        addrs = []
-        for i in range(count):
-            addr = self.read_addr()
-            if addr > 0 and addr & 1 == 1:
-                addrs.append(NativeCode(addr))
-            else:
-                addrs.append(addr)
+        return [wrap_native(self.read_addr()) for i in range(count)]
+
+    def read_varint(self):
+        value = shift = 0
+        while True:
+            byte = ord(self.fileobj.read(1))
+            value |= (byte & 0x7f) << shift
+            if byte < 0x80:
+                return value
+            shift += 7
+
+    def read_svarint(self):
+        value = self.read_varint()
+        return (value >> 1) ^ -(value & 1)
+
+    def read_compact_thread(self):
+        """ The thread of a compact stack record, see src/vmprof_mt.c """
+        number = self.read_varint()
+        if number == len(self.threads):
+            # the first record of the thread
+            self.threads.append([_signed64(self.read_varint()), [], 0, 0])
+        assert_error(number < len(self.threads))
+        return self.threads[number]
+
+    def read_compact_mem(self, thread):
+        if self.state.profile_memory:
+            thread[2] = _signed64(thread[2] + self.read_svarint())
+            return thread[2]
+        return 0
+
+    def read_compact_time(self, thread):
+        if self.state.profile_timestamps:
+            thread[3] = _signed64(thread[3] + self.read_svarint())
+            self.add_sample_time(thread[3], self.read_varint() - 1)
+
+    def read_compact_stack(self, thread):
+        shared = self.read_varint()
+        count = self.read_varint()
+        prev = thread[1]
+        assert_error(shared <= len(prev))
+        addrs = [0] * count + prev[len(prev) - shared:]
+        depth = len(addrs)
+        assert_error(depth <= 2**16, 'stack strace depth too high')
+        for i in xrange(count - 1, -1, -1):
+            base = addrs[i + 2] if i + 2 < depth else 0
+            addrs[i] = _signed64(base + self.read_svarint())
         return addrs
 
     def read_s64(self):
@@ -241,6 +391,13 @@ class LogReader(object):
         tv_usec = self.read_s64()
         return tv_sec * 10**6 + tv_usec
 
+    def read_thread_and_mem(self):
+        thread_id = self.read_addr()
+        mem_in_kb = 0
+        if self.state.profile_memory:
+            mem_in_kb = self.read_addr()
+        return thread_id, mem_in_kb
+
     def read_timezone(self):
         timezone = self.read(8).strip(b'\x00')
         # we should use pytz and parse iso8601 if we really support time zones
@@ -280,15 +437,84 @@ class LogReader(object):
                     mem_in_kb = self.read_addr()
                 trace.reverse()
                 self.add_trace(trace, 1, thread_id, mem_in_kb)
+                if s.profile_timestamps:
+                    when = self.read_addr()
+                    self.add_sample_time(when, self.read_addr())
+            elif marker == MARKER_STACK_DEF and s.version >= VERSION_COMPACT:
+                stack_id = self.read_varint()
+                thread = self.read_compact_thread()
+                addrs = self.read_compact_stack(thread)
+                mem_in_kb = self.read_compact_mem(thread)
+                trace = self.decode_trace([wrap_native(addr) for addr in addrs])
+                trace.reverse()
+                self.raw_stacks[stack_id] = thread[1] = addrs
+                self.stacks[stack_id] = trace
+                self.add_trace(trace, 1, thread[0], mem_in_kb)
+                self.read_compact_time(thread)
+            elif marker == MARKER_STACK_REF and s.version >= VERSION_COMPACT:
+                stack_id = self.read_varint()
+                thread = self.read_compact_thread()
+                mem_in_kb = self.read_compact_mem(thread)
+                assert_error(stack_id in self.stacks)
+                thread[1] = self.raw_stacks[stack_id]
+                self.add_trace(self.stacks[stack_id], 1, thread[0], mem_in_kb)
+                self.read_compact_time(thread)
+            elif marker == MARKER_STACK_DEF:
+                # same as a stack trace, but the stack is remembered
+                stack_id = self.read_word()
+                depth = self.read_word()
+                assert depth <= 2**16, 'stack strace depth too high'
+                trace = self.read_trace(depth)
+                thread_id, mem_in_kb = self.read_thread_and_mem()
+                trace.reverse()
+                self.stacks[stack_id] = trace
+                self.add_trace(trace, 1, thread_id, mem_in_kb)
+            elif marker == MARKER_STACK_REF:
+                stack_id = self.read_word()
+                thread_id, mem_in_kb = self.read_thread_and_mem()
+                self.add_trace(self.stacks[stack_id], 1, thread_id, mem_in_kb)
+            elif marker == MARKER_ALLOC:
+                # a sampled allocation, laid out like a stack trace
+                # with the allocated size in place of the count
+                size = self.read_word()
+                depth = self.read_word()
+                assert depth <= 2**16, 'stack strace depth too high'
+                trace = self.read_trace(depth)
+                thread_id = self.read_addr()
+                trace.reverse()
+                self.add_alloc(trace, size, thread_id)
+            elif marker == MARKER_LINETABLE:
+                unique_id = self.read_addr()
+                format = self.read_word()
+                firstlineno = self.read_word()
+                offset = self.read_word()
+                size = self.read_word()
+                self.add_line_table(unique_id, format, firstlineno, offset,
+                                    self.read(size))
+            elif marker == MARKER_MODULE_MAP:
+                start = self.read_addr()
+                end = self.read_addr()
+                base = self.read_addr()
+                build_id = self.read_string()
+                path = self.read_string()
+                self.add_module_map(start, end, base, build_id, path)
+            elif marker == MARKER_THREAD_INFO:
+                thread_id = self.read_addr()
+                name = self.read_string()
+                native_name = self.read_string()
+                self.state.thread_info[thread_id] = (name, native_name)
             elif marker == MARKER_VIRTUAL_IP or marker == MARKER_NATIVE_SYMBOLS:
                 unique_id = self.read_addr()
                 name = self.read_string()
                 self.add_virtual_ip(marker, unique_id, name)
             elif marker == MARKER_TRAILER:
+                s.trailer_offset = self.fileobj.tell() - 1
                 #if not virtual_ips_only:
                 #    symmap = read_ranges(fileobj.read())
                 if s.version >= VERSION_DURATION:
                     s.end_time = self.read_time_and_zone()
+                if s.version >= VERSION_DROPPED_SAMPLES:
+                    s.dropped_samples = self.read_word()
                 break
             else:
                 assert not marker, (fileobj.tell(), repr(marker))
@@ -298,14 +524,63 @@ class LogReader(object):
 
     def finished_reading_profile(self):
         self.state.virtual_ips.sort() # I think it's sorted, but who knows
+        if self.state.profile_line_offsets:
+            resolve_line_offsets(self.state)
+        if self.state.meta.get('native_lines') == '1':
+            resolve_native_lines(self.state)
 
     def add_virtual_ip(self, marker, unique_id, name):
         self.state.virtual_ips.append((unique_id, name))
 
+    def add_line_table(self, unique_id, format, firstlineno, offset, data):
+        # large tables come in several chunks
+        if offset == 0:
+            self.state.line_tables[unique_id] = (format, firstlineno, bytearray())
+        self.state.line_tables[unique_id][2].extend(data)
+
+    def add_module_map(self, start, end, base, build_id, path):
+        self.state.module_maps.append((start, end, base, build_id, path))
+
     def add_trace(self, trace, trace_count, thread_id, mem_in_kb):
         self.state.profiles.append((trace, trace_count, thread_id, mem_in_kb))
 
+    def add_sample_time(self, usec, cpu):
+        # follows add_trace() for the same sample
+        self.state.timestamps.append((usec / 1e6, cpu))
+
+    def add_alloc(self, trace, size, thread_id):
+        self.state.allocations.append((trace, size, thread_id))
+
+def native_symbol_record(addr, result):
+    """ A MARKER_NATIVE_SYMBOLS record naming addr, result is what
+        vmprof.resolve_many_addr() found for it (or None).
+    """
+    if result is None:
+        name, lineno, srcfile = None, 0, None
+    else:
+        name, lineno, srcfile = result
+    if not name:
+        name = "<native symbol 0x%x>" % addr
+    if not srcfile:
+        srcfile = "-"
+    # must match '<lang>:<name>:<line>:<file>'
+    # 'n' has been chosen as lang here, because the symbol
+    # can be generated from several languages (e.g. C, C++, ...)
+    string = "n:%s:%d:%s" % (name, lineno, srcfile)
+    bytestring = string.encode('utf-8')
+    return b"".join([MARKER_NATIVE_SYMBOLS, struct.pack("P", addr),
+                     struct.pack("l", len(bytestring)), bytestring])
+
 class LogReaderDumpNative(LogReader):
+    # False leaves the native symbols to vmprof.symbolize
+    resolve_native = True
+    # where the symbols go if the profile is read through gunzip(),
+    # they are appended as one more gzip member
+    out = None
+    gzip_output = False
+    # written after the symbols, see vmprof.rotate()
+    trailer = b''
+
     def setup(self):
         self.dedup = set()
 
@@ -316,33 +591,21 @@ class LogReaderDumpNative(LogReader):
             return
 
         LogReader.finished_reading_profile(self)
-        if len(self.dedup) == 0:
+        data = b''
+        if len(self.dedup) > 0 and self.resolve_native:
+            all_addresses = vmprof.resolve_many_addr(
+                    [addr for addr in self.dedup if isinstance(addr, NativeCode)])
+            data = b''.join([native_symbol_record(addr, all_addresses.get(addr))
+                             for addr in self.dedup])
+        data += self.trailer
+        if not data:
             return
-        all_addresses = vmprof.resolve_many_addr(
-                [addr for addr in self.dedup if isinstance(addr, NativeCode)])
-
-        self.fileobj.seek(0, os.SEEK_END)
-        # must match '<lang>:<name>:<line>:<file>'
-        # 'n' has been chosen as lang here, because the symbol
-        # can be generated from several languages (e.g. C, C++, ...)
-
-        for addr in self.dedup:
-            bytelist = [MARKER_NATIVE_SYMBOLS]
-            result = all_addresses.get(addr)
-            if result is None:
-                name, lineno, srcfile = None, 0, None
-            else:
-                name, lineno, srcfile = result
-            if not name:
-                name = "<native symbol 0x%x>" % addr
-            if not srcfile:
-                srcfile = "-"
-            string = "n:%s:%d:%s" % (name, lineno, srcfile)
-            bytestring = string.encode('utf-8')
-            bytelist.append(struct.pack("P", addr))
-            bytelist.append(struct.pack("l", len(bytestring)))
-            bytelist.append(bytestring)
-            self.fileobj.write(b"".join(bytelist))
+        if self.gzip_output:
+            compressor = zlib.compressobj(6, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+            data = compressor.compress(data) + compressor.flush()
+        out = self.out or self.fileobj
+        out.seek(0, os.SEEK_END)
+        out.write(data)
 
     def add_virtual_ip(self, marker, unique_id, name):
         pass # do nothing, no need to save this data
@@ -352,6 +615,38 @@ class LogReaderDumpNative(LogReader):
             if addr not in self.dedup:
                 self.dedup.add(addr)
 
+    def add_alloc(self, trace, size, thread_id):
+        self.add_trace(trace, 1, thread_id, 0)
+
+    def add_sample_time(self, usec, cpu):
+        pass
+
+class LogReaderAggregate(LogReader):
+    """ Sums up the samples that share stack and thread instead of keeping
+        one entry per sample. Memory readings are not kept.
+    """
+    def setup(self):
+        self.counts = {}
+        self.alloc_bytes = {}
+
+    def add_trace(self, trace, trace_count, thread_id, mem_in_kb):
+        key = (tuple(trace), thread_id)
+        self.counts[key] = self.counts.get(key, 0) + trace_count
+
+    def add_alloc(self, trace, size, thread_id):
+        key = (tuple(trace), thread_id)
+        self.alloc_bytes[key] = self.alloc_bytes.get(key, 0) + size
+
+    def add_sample_time(self, usec, cpu):
+        pass # samples are merged, their times are lost
+
+    def finished_reading_profile(self):
+        self.state.profiles = [(list(trace), count, thread_id, 0)
+                               for (trace, thread_id), count in self.counts.items()]
+        self.state.allocations = [(list(trace), size, thread_id)
+                                  for (trace, thread_id), size in self.alloc_bytes.items()]
+        LogReader.finished_reading_profile(self)
+
 class ReaderState(object):
     pass
 
@@ -359,12 +654,25 @@ class LogReaderState(ReaderState):
     def __init__(self):
         self.virtual_ips = []
         self.profiles = []
+        self.allocations = []
         self.interp_name = None
         self.start_time = None
         self.end_time = None
+        self.dropped_samples = 0
         self.version = 0
         self.profile_memory = False
         self.profile_lines = False
+        self.profile_line_offsets = False
+        self.profile_rpython = False
+        self.profile_timestamps = False
+        # (seconds since the start, cpu or -1) of every entry in profiles,
+        # with PROFILE_TIMESTAMPS
+        self.timestamps = []
+        self.line_tables = {}
+        self.module_maps = []
+        # thread id: (name of the threading.Thread, name of the pthread)
+        self.thread_info = {}
+        self.trailer_offset = None
         self.meta = {}
         self.little_endian = True
         self.period = 0
@@ -380,6 +688,239 @@ def _read_prof(fileobj, virtual_ips_only=False):
         return state.virtual_ips
     return state
 
+def _read_prof_aggregated(fileobj):
+    """ Same as _read_prof, but every entry of state.profiles stands for
+        all samples with the same stack and thread (its count says how
+        many). The entries of state.allocations sum up the allocated
+        bytes of a stack the same way. Memory readings are not kept.
+
+        Uncompressed profiles are read by _vmprof in C if possible.
+    """
+    try:
+        import _vmprof
+        read_aggregated = _vmprof.read_profile_aggregated
+        fileno = fileobj.fileno()
+    except (ImportError, AttributeError, io.UnsupportedOperation):
+        read_aggregated = None
+
+    if read_aggregated is not None:
+        data = read_aggregated(fileno)
+        if data is not None:
+            return _state_from_aggregated(data)
+
+    fileobj = gunzip(fileobj)
+    state = LogReaderState()
+    LogReaderAggregate(fileobj, state).read_all()
+    return state
+
+def _state_from_aggregated(data):
+    state = LogReaderState()
+    for key in ('version', 'period', 'profile_memory', 'profile_lines',
+                'profile_line_offsets', 'profile_rpython', 'interp_name',
+                'meta', 'virtual_ips', 'dropped_samples', 'module_maps',
+                'thread_info'):
+        setattr(state, key, data[key])
+    if data['start_time'] is not None:
+        state.start_time = datetime.datetime.fromtimestamp(
+            data['start_time']/10.0**6, None)
+    if data['end_time'] is not None:
+        state.end_time = datetime.datetime.fromtimestamp(
+            data['end_time']/10.0**6, None)
+    reader = LogReader(None, state)
+    for args in data['line_tables']:
+        reader.add_line_table(*args)
+    for addrs, count, thread_id in data['stacks']:
+        trace = reader.decode_trace([wrap_native(addr) for addr in addrs])
+        trace.reverse()
+        state.profiles.append((trace, count, thread_id, 0))
+    for addrs, count, size, thread_id in data['allocations']:
+        trace = reader.decode_trace([wrap_native(addr) for addr in addrs])
+        trace.reverse()
+        state.allocations.append((trace, size, thread_id))
+    reader.finished_reading_profile()
+    return state
+
+def _read_varint(table, i):
+    read = table[i]
+    i += 1
+    value = read & 63
+    shift = 0
+    while read & 64:
+        read = table[i]
+        i += 1
+        shift += 6
+        value |= (read & 63) << shift
+    return value, i
+
+def _read_svarint(table, i):
+    value, i = _read_varint(table, i)
+    if value & 1:
+        return -(value >> 1), i
+    return value >> 1, i
+
+def addr_to_line(format, firstlineno, table, addr):
+    """ Offline version of PyCode_Addr2Line() of the CPython that wrote
+        the line table. 'addr' is the instruction offset in bytes, as
+        recorded by the sampler. Returns -1 for instructions without line.
+    """
+    if format in (LINETABLE_LNOTAB, LINETABLE_LNOTAB_UNSIGNED):
+        # pairs of (address increment, line increment)
+        line = firstlineno
+        current = 0
+        for i in xrange(0, len(table) - 1, 2):
+            current += table[i]
+            if current > addr:
+                break
+            incr = table[i + 1]
+            if format == LINETABLE_LNOTAB and incr >= 128:
+                incr -= 256
+            line += incr
+        return line
+    if addr < 0:
+        return firstlineno
+    if format == LINETABLE_PY310:
+        # pairs of (address delta, line delta), -128 means no line
+        line = firstlineno
+        end = 0
+        for i in xrange(0, len(table) - 1, 2):
+            start = end
+            end += table[i]
+            delta = table[i + 1]
+            if delta >= 128:
+                delta -= 256
+            if delta == -128:
+                result = -1
+            else:
+                line += delta
+                result = line
+            if start <= addr < end:
+                return result
+        return -1
+    if format == LINETABLE_PY311:
+        # the location table of PEP 657, lengths count code units
+        unit = addr // 2
+        line = firstlineno
+        start = 0
+        i = 0
+        while i < len(table):
+            first = table[i]
+            i += 1
+            code = (first >> 3) & 15
+            length = (first & 7) + 1
+            if code == 15:
+                # no location
+                result = -1
+            elif code == 14:
+                # long form: line, end line, column, end column
+                delta, i = _read_svarint(table, i)
+                line += delta
+                result = line
+                for _ in range(3):
+                    _, i = _read_varint(table, i)
+            elif code == 13:
+                # no column
+                delta, i = _read_svarint(table, i)
+                line += delta
+                result = line
+            elif code >= 10:
+                # one line form, two bytes of columns follow
+                line += code - 10
+                result = line
+                i += 2
+            else:
+                # short form, one byte of columns
+                result = line
+                i += 1
+            if start <= unit < start + length:
+                return result
+            start += length
+        return -1
+    raise NotImplementedError("unknown line table format %d" % format)
+
+def resolve_line_offsets(state):
+    """ In profiles with PROFILE_LINE_OFFSETS the sampler stores the offset
+        of the current instruction in front of every code address, instead
+        of the line number. Replace them with (negated) line numbers, the
+        way other profiles store them, using the line tables of the code
+        objects. Lines that cannot be resolved become 0.
+    """
+    cache = {}
+    done = set()
+    tables = state.line_tables
+
+    def resolve(trace):
+        if id(trace) in done:
+            return  # stacks of deduplicated samples share the list
+        done.add(id(trace))
+        for i in xrange(1, len(trace), 2):
+            addr = trace[i - 1]
+            key = (addr, -trace[i])
+            line = cache.get(key)
+            if line is None:
+                table = tables.get(addr)
+                line = 0
+                if table is not None and not isinstance(addr, NativeCode):
+                    line = max(addr_to_line(table[0], table[1], table[2], key[1]), 0)
+                cache[key] = line
+            trace[i] = -line
+
+    for profile in state.profiles:
+        resolve(profile[0])
+    for allocation in state.allocations:
+        resolve(allocation[0])
+
+def resolve_native_lines(state):
+    """ Profiles with the meta value native_lines store the address of
+        the instruction a native frame was executing, not the start of
+        its function. All addresses of a function (same symbol and file)
+        are replaced by one of them, so that the function is one node of
+        the call tree. In line profiles the line of each address takes
+        the line slot of its frame, the way python frames record it.
+    """
+    names = dict(state.virtual_ips)
+    if not names:
+        return  # no symbols, e.g. while vmprof.disable() dumps them
+    functions = {}
+    canonical = {}
+    for addr, name in state.virtual_ips:
+        if not name.startswith('n:'):
+            continue
+        lang, symbol, line, srcfile = name.split(':', 3)
+        if symbol.startswith('<native symbol'):
+            continue  # nothing is known about it
+        line = int(line)
+        key = (symbol, srcfile)
+        first = functions.get(key)
+        if first is None:
+            functions[key] = first = [NativeCode(addr), line]
+        elif 0 < line < first[1] or first[1] <= 0:
+            first[1] = line
+        canonical[addr] = (first, line)
+    # the function is named after the lowest line found in it
+    for (symbol, srcfile), (addr, line) in functions.items():
+        names[addr] = "n:%s:%d:%s" % (symbol, max(line, 0), srcfile)
+    state.virtual_ips = sorted(names.items())
+
+    done = set()
+    lines = state.profile_lines
+
+    def resolve(trace):
+        if id(trace) in done:
+            return  # stacks of deduplicated samples share the list
+        done.add(id(trace))
+        for i in xrange(len(trace)):
+            entry = canonical.get(trace[i])
+            if entry is None:
+                continue
+            trace[i] = entry[0][0]
+            if lines and i + 1 < len(trace) and trace[i + 1] == 0:
+                trace[i + 1] = -entry[1]
+
+    for profile in state.profiles:
+        resolve(profile[0])
+    for allocation in state.allocations:
+        resolve(allocation[0])
+
 class FdWrapper(object):
     """ This wrapper behaves like a file object. Could not find
         an stdlib API function that creates such an object without
@@ -394,7 +935,7 @@ class FdWrapper(object):
     def read(self, n):
         return os.read(self.fd, n)
 
-    def seek(self, pos, how):
+    def seek(self, pos, how=os.SEEK_SET):
         return os.lseek(self.fd, pos, how)
 
     def tell(self):
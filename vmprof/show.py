@@ -33,7 +33,7 @@ class AbstractPrinter(object):
         :type profile: str
         """
         try:
-            stats = vmprof.read_profile(profile)
+            stats = vmprof.read_profile(profile, aggregate=True)
         except Exception as e:
             print("Fatal: could not read vmprof profile file '{}': {}".format(profile, e))
             return
@@ -14,10 +14,20 @@ class Stats(object):
         if state:
             self.profile_lines = state.profile_lines
             self.profile_memory = state.profile_memory
+            self.dropped_samples = state.dropped_samples
+            self.allocations = state.allocations
+            self.thread_info = getattr(state, 'thread_info', {})
+            self.timestamps = None
+            if getattr(state, 'profile_timestamps', False):
+                self.timestamps = state.timestamps
         else:
             # unknown, for tests only
             self.profile_lines = False
             self.profile_memory = False
+            self.dropped_samples = 0
+            self.allocations = []
+            self.thread_info = {}
+            self.timestamps = None
         self.generate_top()
         if jit_frames is None:
             jit_frames = set()
@@ -35,6 +45,25 @@ class Stats(object):
         ts = self.end_time - self.start_time
         return ts.total_seconds() * 1000000
 
+    def slice(self, t0, t1):
+        """ Returns the samples taken from t0 up to (excluding) t1 as new
+            Stats, both in seconds since the start of the profile. Needs
+            a profile taken with vmprof.enable(..., timestamps=True), see
+            self.timestamps for the time and cpu of every sample.
+            Allocations have no time, the slice has none of them.
+        """
+        if self.timestamps is None:
+            raise ValueError("the profile has no timestamps")
+        keep = [i for i, (t, cpu) in enumerate(self.timestamps) if t0 <= t < t1]
+        stats = Stats.__new__(Stats)
+        stats.__dict__.update(self.__dict__)
+        stats.profiles = [self.profiles[i] for i in keep]
+        stats.timestamps = [self.timestamps[i] for i in keep]
+        stats.allocations = []
+        stats.functions = {}
+        stats.generate_top()
+        return stats
+
     def get_name(self, addr):
         if addr not in self.adr_dict:
             return "unknown"
@@ -73,7 +102,7 @@ class Stats(object):
                     assert addr <= 0
                     continue
                 if addr not in current_iter:  # count only topmost
-                    self.functions[addr] = self.functions.get(addr, 0) + 1
+                    self.functions[addr] = self.functions.get(addr, 0) + profile[1]
                     current_iter[addr] = None
 
     def top_profile(self):
@@ -99,11 +128,11 @@ class Stats(object):
                     if addr in current_iter:
                         continue
                     current_iter[addr] = None
-                    result[addr] = result.get(addr, 0) + 1
+                    result[addr] = result.get(addr, 0) + profile[1]
                 else:
                     if addr == top_function:
                         counting = True
-                        total += 1
+                        total += profile[1]
         result = sorted(result.items(), key=lambda a: a[1])
         return result, total
 
@@ -115,7 +144,7 @@ class Stats(object):
             raise EmptyProfileFile()
         top_addr = prof[0][0]
         top = Node(top_addr, self._get_name(top_addr))
-        top.count = len(self.profiles)
+        top.count = sum(profile[1] for profile in self.profiles)
         return top
 
     def get_tree(self):
@@ -124,6 +153,7 @@ class Stats(object):
         top = self.get_top(self.profiles)
         addr = None
         for profile in self.profiles:
+            count = profile[1]
             last_addr = top.addr
             cur = top
             for i in range(0, len(profile[0])):
@@ -133,17 +163,17 @@ class Stats(object):
 
                 if addr <= 0:
                     # negative address means line number
-                    cur.lines[-addr] = cur.lines.get(-addr, 0) + 1
+                    cur.lines[-addr] = cur.lines.get(-addr, 0) + count
                 else:
                     if addr == last_addr:
                         continue  # ignore duplicates
                     last_addr = addr
                     name = self._get_name(addr)
-                    cur = cur.add_child(addr, name)
+                    cur = cur.add_child(addr, name, count)
             if isinstance(addr, JittedCode):
-                cur.meta['jit'] = cur.meta.get('jit', 0) + 1
+                cur.meta['jit'] = cur.meta.get('jit', 0) + count
             if isinstance(addr, NativeCode):
-                cur.meta['native'] = cur.meta.get('native', 0) + 1
+                cur.meta['native'] = cur.meta.get('native', 0) + count
         # get the first "interesting" node, that is after vmprof and pypy
         # mess
 
@@ -247,12 +277,12 @@ class Node(object):
 
     self_count = property(get_self_count)
 
-    def add_child(self, addr, name):
+    def add_child(self, addr, name, count=1):
         try:
             next = self.children[addr]
-            next.count += 1
+            next.count += count
         except KeyError:
-            next = Node(addr, name)
+            next = Node(addr, name, count)
             self.children[addr] = next
         return next
 
@@ -0,0 +1,107 @@
+""" Resolves the native symbols of a profile after the profiled process
+    is gone (it crashed, was killed, or called vmprof.disable() with
+    resolve_native=False).
+
+    The sampler writes the objects that were loaded (path, address range
+    and build id) to the profile; each native address is looked up in the
+    debug info of its object on disk. Run it on the host that profiled,
+    or one with the same binaries:
+
+        python -m vmprof.symbolize [--symbol-cache directory] file.prof
+"""
+from __future__ import print_function
+
+import argparse
+import bisect
+import sys
+
+import _vmprof
+import vmprof
+from vmprof.reader import (LogReader, LogReaderState, NativeCode,
+                           native_symbol_record)
+
+
+def _native_addresses(state):
+    addrs = set()
+    for profile in state.profiles:
+        addrs.update(addr for addr in profile[0] if isinstance(addr, NativeCode))
+    for allocation in state.allocations:
+        addrs.update(addr for addr in allocation[0] if isinstance(addr, NativeCode))
+    return addrs - set(addr for addr, name in state.virtual_ips)
+
+
+def _group_by_module(addrs, module_maps):
+    """ Returns {(path, build_id, base): [addr, ...]}, addresses outside
+        of every module are left out. """
+    modules = sorted(set(module_maps))
+    starts = [module[0] for module in modules]
+    groups = {}
+    for addr in addrs:
+        i = bisect.bisect_right(starts, addr) - 1
+        if i < 0:
+            continue
+        start, end, base, build_id, path = modules[i]
+        if addr < end:
+            groups.setdefault((path, build_id, base), []).append(addr)
+    return groups
+
+
+def symbolize(filename):
+    """ Adds the symbols of the native addresses of the profile at
+        filename that are not named yet. Returns the number of addresses
+        that were resolved and the number of addresses that were not
+        named before.
+    """
+    with open(filename, 'r+b') as fileobj:
+        if fileobj.read(2) == b'\x1f\x8b':
+            raise ValueError("%s is compressed, decompress it first" % filename)
+        fileobj.seek(0)
+        state = LogReaderState()
+        LogReader(fileobj, state).read_all()
+
+        addrs = _native_addresses(state)
+        resolved = {}
+        for (path, build_id, base), group in _group_by_module(addrs, state.module_maps).items():
+            offsets = [addr - base for addr in group]
+            found = _vmprof.resolve_file_addr(path, build_id or None, offsets)
+            for addr in group:
+                if addr - base in found:
+                    resolved[addr] = found[addr - base]
+
+        records = b"".join(native_symbol_record(addr, resolved.get(addr))
+                           for addr in sorted(addrs))
+        # the reader stops at the trailer, the symbols go in front of it
+        if state.trailer_offset is not None:
+            fileobj.seek(state.trailer_offset)
+            trailer = fileobj.read()
+            fileobj.seek(state.trailer_offset)
+            fileobj.write(records + trailer)
+        else:
+            fileobj.seek(0, 2)
+            fileobj.write(records)
+    return len(resolved), len(addrs)
+
+
+def main(args=None):
+    parser = argparse.ArgumentParser(
+        prog='vmprofsymbolize',
+        description='Resolve the native symbols of vmprof profiles offline')
+    parser.add_argument('profile', nargs='+')
+    parser.add_argument(
+        '--symbol-cache',
+        metavar='directory',
+        help='Look up and keep resolved symbols in this directory')
+    args = parser.parse_args(args)
+    if not hasattr(_vmprof, 'resolve_file_addr'):
+        print("offline symbolization is not supported on this platform", file=sys.stderr)
+        return 1
+    if args.symbol_cache:
+        vmprof.set_symbol_cache(args.symbol_cache)
+    for filename in args.profile:
+        resolved, count = symbolize(filename)
+        print("%s: resolved %d of %d native addresses" % (filename, resolved, count))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
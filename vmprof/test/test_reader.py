@@ -1,5 +1,5 @@
 
-import struct, pytest
+import sys, struct, pytest
 from vmprof import reader
 from vmprof.reader import (FileReadError, MARKER_HEADER)
 from vmprof.test.test_run import (read_one_marker, read_header,
@@ -48,3 +48,222 @@ def test_fileobj_wrapper():
     assert fw.read(4) == b'4567'
     assert fw.read(2) == b'89'
 
+
+def _synthetic_profile(version, trailer_extra=b'', records=b'', mode=0):
+    import io
+    f = io.BytesIO()
+    f.write(struct.pack('lllll', 0, 3, 0, 1000, 0))
+    f.write(MARKER_HEADER + struct.pack('!hBB', version, mode, 7) + b'cpython')
+    f.write(records)
+    f.write(reader.MARKER_TRAILER + struct.pack('qq', 1, 0) + b'\x00' * 8)
+    f.write(trailer_extra)
+    f.seek(0)
+    return f
+
+def test_read_dropped_samples_from_trailer():
+    state = reader.LogReaderState()
+    f = _synthetic_profile(reader.VERSION_DROPPED_SAMPLES, struct.pack('l', 42))
+    reader.LogReader(f, state).read_all()
+    assert state.dropped_samples == 42
+    assert state.end_time is not None
+
+    # older profiles have no drop counter in the trailer
+    state = reader.LogReaderState()
+    f = _synthetic_profile(reader.VERSION_TIMESTAMP)
+    reader.LogReader(f, state).read_all()
+    assert state.dropped_samples == 0
+
+def test_read_deduplicated_stacks():
+    records = (reader.MARKER_STACK_DEF + struct.pack('lllll', 5, 2, 11, 12, 100) +
+               reader.MARKER_STACK_REF + struct.pack('ll', 5, 101) +
+               reader.MARKER_STACKTRACE + struct.pack('lllll', 1, 2, 13, 14, 100) +
+               reader.MARKER_STACK_REF + struct.pack('ll', 5, 100))
+    state = reader.LogReaderState()
+    f = _synthetic_profile(reader.VERSION_DROPPED_SAMPLES, struct.pack('l', 0),
+                           records)
+    reader.LogReader(f, state).read_all()
+    assert state.profiles == [([12, 11], 1, 100, 0),
+                              ([12, 11], 1, 101, 0),
+                              ([14, 13], 1, 100, 0),
+                              ([12, 11], 1, 100, 0)]
+
+def _uvarint(value):
+    out = b''
+    while value >= 0x80:
+        out += struct.pack('B', (value & 0x7f) | 0x80)
+        value >>= 7
+    return out + struct.pack('B', value)
+
+def _svarint(value):
+    return _uvarint(((value << 1) ^ (value >> 63)) & 0xffffffffffffffff)
+
+def test_read_compact_stacks(tmpdir):
+    import io
+    u, s = _uvarint, _svarint
+    # thread 100 samples [11, 12, 13] (innermost first), thread 200 the
+    # same stack, thread 100 then [-7, 12, 13] and [11, 12, 13] again
+    records = (reader.MARKER_STACK_DEF + u(5) + u(0) + u(100) +
+                   u(0) + u(3) + s(13) + s(12) + s(11 - 13) + s(1000) +
+               reader.MARKER_STACK_REF + u(5) + u(1) + u(200) + s(2000) +
+               reader.MARKER_STACK_DEF + u(9) + u(0) +
+                   u(2) + u(1) + s(-7 - 13) + s(24) +
+               reader.MARKER_STACK_REF + u(5) + u(0) + s(-24))
+    data = _synthetic_profile(reader.VERSION_COMPACT, struct.pack('l', 0),
+                              records, mode=reader.PROFILE_MEMORY).getvalue()
+    state = reader.LogReaderState()
+    reader.LogReader(io.BytesIO(data), state).read_all()
+    assert state.profiles == [([13, 12, 11], 1, 100, 1000),
+                              ([13, 12, 11], 1, 200, 2000),
+                              ([13, 12, -7], 1, 100, 1024),
+                              ([13, 12, 11], 1, 100, 1000)]
+
+    path = tmpdir.join('compact.prof')
+    path.write_binary(data)
+    for fileobj in (path.open('rb'), io.BytesIO(data)):
+        state = reader._read_prof_aggregated(fileobj)
+        assert sorted(state.profiles) == [([13, 12, -7], 1, 100, 0),
+                                          ([13, 12, 11], 1, 200, 0),
+                                          ([13, 12, 11], 2, 100, 0)]
+
+def test_read_allocation_samples():
+    records = (reader.MARKER_ALLOC + struct.pack('lllll', 4096, 2, 11, 12, 100) +
+               reader.MARKER_STACKTRACE + struct.pack('lllll', 1, 2, 13, 14, 100) +
+               reader.MARKER_ALLOC + struct.pack('llll', 24, 1, 13, 101))
+    state = reader.LogReaderState()
+    f = _synthetic_profile(reader.VERSION_DROPPED_SAMPLES, struct.pack('l', 0),
+                           records)
+    reader.LogReader(f, state).read_all()
+    assert state.profiles == [([14, 13], 1, 100, 0)]
+    assert state.allocations == [([12, 11], 4096, 100),
+                                 ([13], 24, 101)]
+
+def _summed(profiles):
+    counts = {}
+    for trace, count, thread_id, mem in profiles:
+        key = (tuple(trace), thread_id)
+        counts[key] = counts.get(key, 0) + count
+    return counts
+
+def test_read_aggregated(tmpdir):
+    import io
+    records = (reader.MARKER_META + struct.pack('l', 1) + b'k' + struct.pack('l', 1) + b'v' +
+               reader.MARKER_VIRTUAL_IP + struct.pack('ll', 12, 5) + b'py:a' + b'\x00' +
+               reader.MARKER_STACK_DEF + struct.pack('lllll', 5, 2, 11, 12, 100) +
+               reader.MARKER_STACK_REF + struct.pack('ll', 5, 101) +
+               reader.MARKER_STACKTRACE + struct.pack('lllll', 1, 2, 13, 15, 100) +
+               reader.MARKER_STACK_REF + struct.pack('ll', 5, 100) +
+               reader.MARKER_ALLOC + struct.pack('lllll', 4096, 2, 11, 12, 100) +
+               reader.MARKER_ALLOC + struct.pack('lllll', 100, 2, 11, 12, 100))
+    data = _synthetic_profile(reader.VERSION_DROPPED_SAMPLES, struct.pack('l', 3),
+                              records).getvalue()
+    path = tmpdir.join('synthetic.prof')
+    path.write_binary(data)
+    # from a real file the C reader is used if available, the in-memory
+    # file always takes the python fallback
+    for fileobj in (path.open('rb'), io.BytesIO(data)):
+        state = reader._read_prof_aggregated(fileobj)
+        assert sorted(state.profiles) == [([12, 11], 1, 101, 0),
+                                          ([12, 11], 2, 100, 0),
+                                          ([reader.NativeCode(15), 13], 1, 100, 0)]
+        assert state.allocations == [([12, 11], 4196, 100)]
+        assert state.meta == {'k': 'v'}
+        assert state.virtual_ips == [(12, 'py:a\x00')]
+        assert state.dropped_samples == 3
+        assert state.end_time is not None
+
+def _line_table(co):
+    if sys.version_info >= (3, 11):
+        return reader.LINETABLE_PY311, co.co_linetable
+    if sys.version_info >= (3, 10):
+        return reader.LINETABLE_PY310, co.co_linetable
+    if sys.version_info >= (3, 6):
+        return reader.LINETABLE_LNOTAB, co.co_lnotab
+    return reader.LINETABLE_LNOTAB_UNSIGNED, co.co_lnotab
+
+def _sample_code(a, b):
+    x = [i for i in range(a)]
+    if b:
+        try:
+            x.append(b // a)
+        except ZeroDivisionError:
+            return None
+    return (x,
+            a, b)
+
+@pytest.mark.skipif("not hasattr(sys, 'version_info') or sys.version_info < (3, 0)")
+def test_addr_to_line_matches_interpreter():
+    import dis
+    co = _sample_code.__code__
+    format, table = _line_table(co)
+    table = bytearray(table)
+    if hasattr(co, 'co_lines'):
+        expected = [(start, line) for start, end, line in co.co_lines()]
+    else:
+        expected = list(dis.findlinestarts(co))
+    assert expected
+    for offset, line in expected:
+        if line is None:
+            line = -1
+        assert reader.addr_to_line(format, co.co_firstlineno, table, offset) == line
+
+def test_read_line_offsets(tmpdir):
+    # a single code object at 12 with a table mapping offsets 0-7 to line 10,
+    # 8-15 to line 12 and the rest to 13 (lnotab format, sent in two chunks);
+    # each stack record stores the offset in front of the code address
+    records = (reader.MARKER_LINETABLE + struct.pack('lllll', 12, reader.LINETABLE_LNOTAB, 10, 0, 2) + b'\x08\x02' +
+               reader.MARKER_LINETABLE + struct.pack('lllll', 12, reader.LINETABLE_LNOTAB, 10, 2, 2) + b'\x08\x01' +
+               reader.MARKER_STACKTRACE + struct.pack('lllll', 1, 2, 4, 12, 100) +
+               reader.MARKER_STACKTRACE + struct.pack('lllll', 1, 2, 10, 12, 100) +
+               reader.MARKER_STACKTRACE + struct.pack('lllll', 1, 2, 18, 12, 100))
+    f = _synthetic_profile(reader.VERSION_DROPPED_SAMPLES, struct.pack('l', 0), records,
+                           mode=reader.PROFILE_LINES | reader.PROFILE_LINE_OFFSETS)
+    path = tmpdir.join('lines.prof')
+    path.write_binary(f.getvalue())
+    for read in (reader._read_prof, reader._read_prof_aggregated):
+        f.seek(0)
+        for fileobj in (f, path.open('rb')):
+            state = read(fileobj)
+            assert state.profile_line_offsets
+            assert state.line_tables[12] == (reader.LINETABLE_LNOTAB, 10,
+                                             bytearray(b'\x08\x02\x08\x01'))
+            assert sorted(p[0] for p in state.profiles) == [[12, -13], [12, -12], [12, -10]]
+
+def test_resolve_native_lines():
+    # two addresses in 'compute' and one in 'main' of the same file,
+    # the python frame (code 12) is not touched
+    N = reader.NativeCode
+    state = reader.LogReaderState()
+    state.meta = {'native_lines': '1'}
+    state.profile_lines = True
+    state.virtual_ips = [(0x1001, 'n:compute:20:kernel.c'),
+                         (0x1011, 'n:compute:18:kernel.c'),
+                         (0x2001, 'n:main:5:kernel.c'),
+                         (12, 'py:function_foo:3:test.py')]
+    shared = [12, -3, N(0x2001), 0, N(0x1011), 0]
+    state.profiles = [([12, -3, N(0x2001), 0, N(0x1001), 0], 1, 1, 0),
+                      (shared, 1, 1, 0), (shared, 2, 2, 0)]
+    reader.resolve_native_lines(state)
+    assert state.profiles[0][0] == [12, -3, 0x2001, -5, 0x1001, -20]
+    assert state.profiles[1][0] == [12, -3, 0x2001, -5, 0x1001, -18]
+    assert isinstance(state.profiles[1][0][4], N)
+    names = dict(state.virtual_ips)
+    assert names[0x1001] == 'n:compute:18:kernel.c'
+    assert names[12] == 'py:function_foo:3:test.py'
+
+def test_read_module_maps(tmpdir):
+    def string(s):
+        return struct.pack('l', len(s)) + s
+    records = (reader.MARKER_MODULE_MAP + struct.pack('lll', 0x1000, 0x3000, 0x1000) +
+               string(b'abcd') + string(b'/lib/libfoo.so') +
+               reader.MARKER_MODULE_MAP + struct.pack('lll', 0x400000, 0x401000, 0) +
+               string(b'') + string(b'/usr/bin/python'))
+    f = _synthetic_profile(reader.VERSION_DROPPED_SAMPLES, struct.pack('l', 0), records)
+    path = tmpdir.join('modules.prof')
+    path.write_binary(f.getvalue())
+    expected = [(0x1000, 0x3000, 0x1000, 'abcd', '/lib/libfoo.so'),
+                (0x400000, 0x401000, 0, '', '/usr/bin/python')]
+    for read in (reader._read_prof, reader._read_prof_aggregated):
+        state = read(path.open('rb'))
+        assert [tuple(m) for m in state.module_maps] == expected
+    state = reader._read_prof(path.open('rb'))
+    assert state.trailer_offset == len(f.getvalue()) - 33
@@ -1,6 +1,7 @@
 """ Test the actual run
 """
 import os
+import platform
 import pytest
 import sys
 import tempfile
@@ -9,6 +10,7 @@ import gzip
 import time
 import pytz
 import vmprof
+import _vmprof
 import six
 from cffi import FFI
 from datetime import datetime
@@ -19,7 +21,7 @@ from vmprof.profiler import read_profile
 from vmprof.reader import (gunzip, MARKER_STACKTRACE, MARKER_VIRTUAL_IP,
         MARKER_TRAILER, FileReadError, VERSION_THREAD_ID,
         MARKER_TIME_N_ZONE, assert_error,
-        MARKER_META, MARKER_NATIVE_SYMBOLS)
+        MARKER_META, MARKER_NATIVE_SYMBOLS, NativeCode)
 from vmshare.binary import read_string, read_word, read_addr
 from vmprof.stats import Stats
 
@@ -198,12 +200,48 @@ def test_nested_call():
         t = t['']
     assert len(t.children) == 1
     assert 'function_foo' in t[''].name
-    if PY3K:
+    if PY3K and sys.version_info < (3, 12):
         assert len(t[''].children) == 1
         assert '<listcomp>' in t[''][''].name
     else:
+        # comprehensions are inlined since 3.12
         assert len(t[''].children) == 0
 
+def function_foo_via_c(arg):
+    return function_foo()
+
+def function_bar_via_c():
+    # map() calls back into the interpreter, that is a new entry frame
+    # (a C stack owned shim frame on 3.12+) between the two functions
+    return list(map(function_foo_via_c, [0]))
+
+@pytest.mark.skipif("IS_PYPY")
+def test_nested_call_through_c():
+    prof = vmprof.Profiler()
+    with prof.measure():
+        function_bar_via_c()
+    t = prof.get_stats().get_tree()
+    while 'function_bar_via_c' not in t.name:
+        t = t['']
+    assert 'function_foo_via_c' in t[''].name
+    assert 'function_foo' in t[''][''].name
+
+def function_sorting_via_c():
+    # every call of the key enters the eval loop again
+    t0 = time.time()
+    while time.time() - t0 < 1.0:
+        sorted(range(2000), key=lambda x: -x)
+
+@pytest.mark.skipif("IS_PYPY")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_sampling_while_frames_are_pushed():
+    # many samples land while a frame is linked but not filled in yet
+    prof = vmprof.Profiler()
+    with prof.measure(period=0.0005):
+        function_sorting_via_c()
+    stats = prof.get_stats()
+    assert 'function_sorting_via_c' in _sampled_names(stats)
+
 def test_multithreaded():
     if '__pypy__' in sys.builtin_module_names:
         pytest.skip("not supported on pypy just yet")
@@ -245,6 +283,36 @@ def test_multithreaded():
     # assert (0.23 * total) <= lgt1 <= (0.43 * total)
     assert len(finished) == 3
 
+@pytest.mark.skipif("not sys.platform.startswith('linux')")
+@pytest.mark.skipif("IS_PYPY")
+def test_dropped_samples(tmpdir):
+    # the writer thread blocks on a full pipe, the rings fill up and the
+    # samples that find no room are counted in the trailer.  Deep stacks
+    # with line numbers make records big enough to fill it.
+    import fcntl, subprocess
+    def deep(n):
+        if n < 300:
+            return deep(n + 1)
+        for i in range(1000):
+            pass
+    F_SETPIPE_SZ = 1031
+    filename = str(tmpdir.join('profile.prof'))
+    r, w = os.pipe()
+    fcntl.fcntl(w, F_SETPIPE_SZ, 4096)
+    _vmprof.enable(w, 0.0005, 0, 1)
+    t0 = time.time()
+    while time.time() - t0 < 1.5:
+        deep(0)
+    with open(filename, 'wb') as out:
+        cat = subprocess.Popen(['cat'], stdin=r, stdout=out)
+        _vmprof.disable()
+        os.close(w)
+        cat.wait()
+    os.close(r)
+    stats = read_profile(filename)
+    assert stats.profiles
+    assert stats.dropped_samples > 0
+
 def test_memory_measurment():
     if not sys.platform.startswith('linux') or '__pypy__' in sys.builtin_module_names:
         pytest.skip("unsupported platform")
@@ -260,7 +328,9 @@ def test_memory_measurment():
     with prof.measure(memory=True):
         function_bar()
 
-    prof.get_stats()
+    stats = prof.get_stats()
+    # every sample carries the rss (in kilobytes) published by the helper
+    assert all(p[3] > 0 for p in stats.profiles)
 
 
 @pytest.mark.skipif("sys.platform == 'win32'")
@@ -328,9 +398,345 @@ def test_insert_other_real_time_thread(insert_foo, remove_bar):
     assert remove_bar != (bar_time_name in d)
 
 
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("not sys.platform.startswith('linux')")
+def test_vmprof_per_thread_timers():
+    import threading
+    def worker():
+        vmprof.insert_real_time_thread()
+        function_foo()
+    prof = vmprof.Profiler()
+    thread = threading.Thread(target=worker)
+    with prof.measure(per_thread=True):
+        thread.start()
+        function_bar()
+        thread.join()
+    stats = prof.get_stats()
+    # both threads were sampled on their own timer
+    assert len(set(p[2] for p in stats.profiles)) == 2
+    assert dict(stats.top_profile())[foo_full_name] > 0
+
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("not sys.platform.startswith('linux')")
+def test_vmprof_per_thread_timers_of_dead_threads():
+    import threading
+    counts = []
+    def worker():
+        # ends without remove_real_time_thread()
+        counts.append(vmprof.insert_real_time_thread())
+    def run_worker():
+        thread = threading.Thread(target=worker)
+        thread.start()
+        thread.join()
+    prof = vmprof.Profiler()
+    with prof.measure(per_thread=True):
+        for i in range(20):
+            run_worker()
+        # the writer has the rest reaped about once a second
+        for i in range(25):
+            time.sleep(0.1)
+        run_worker()
+    # a thread that gets the pthread_t of one that ended replaces it
+    assert counts[0] == 2 and max(counts) < 20
+    # the timers of the threads that ended are gone
+    assert counts[-1] == 2
+
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("not sys.platform.startswith('linux')")
+def test_vmprof_per_thread_insert_with_many_threads():
+    import threading
+    n = 300
+    times = [None] * n
+    stop = threading.Event()
+    def worker(i, registered):
+        t0 = time.perf_counter()
+        count = vmprof.insert_real_time_thread()
+        times[i] = time.perf_counter() - t0
+        assert count == i + 2
+        registered.set()
+        stop.wait()
+    threads = []
+    prof = vmprof.Profiler()
+    with prof.measure(per_thread=True):
+        try:
+            for i in range(n):
+                registered = threading.Event()
+                threads.append(threading.Thread(target=worker,
+                                                args=(i, registered)))
+                threads[-1].start()
+                registered.wait()
+        finally:
+            stop.set()
+            for thread in threads:
+                thread.join()
+    # inserting does not look at the threads registered before
+    first = sorted(times[:50])[25]
+    last = sorted(times[-50:])[25]
+    assert last < 4 * first + 0.0002
+
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_code_objects_without_heap_walk(monkeypatch):
+    import gc
+    def get_objects(*args):
+        raise AssertionError("the heap must not be searched for code objects")
+    prof = vmprof.Profiler()
+    with prof.measure():
+        monkeypatch.setattr(gc, 'get_objects', get_objects)
+        function_foo()
+    monkeypatch.undo()
+    stats = prof.get_stats()
+    assert dict(stats.top_profile())[foo_full_name] > 0
+
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_code_objects_that_come_and_go(monkeypatch):
+    import gc
+    def get_objects(*args):
+        raise AssertionError("the table of code ids must not overflow")
+    source = "def %s_%d():\n    return sample(0)\n"
+    sampled = set()
+    never_run = []
+    prof = vmprof.Profiler()
+    with prof.measure():
+        # more sampled code objects than the table has slots
+        # (CODE_TABLE_SIZE), but only one of them alive at a time
+        for i in range(70000):
+            namespace = {}
+            exec(compile(source % ('churned', i), '<churned>', 'exec'),
+                 {'sample': _vmprof.sample_stack_now}, namespace)
+            func = namespace.pop('churned_%d' % i)
+            func()
+            sampled.add(id(func.__code__))
+            del func
+            # takes the memory of the code object that was just freed,
+            # the next one gets an address of its own
+            never_run.append(compile(source % ('never_run', i),
+                                     '<never_run>', 'exec'))
+        del never_run
+        monkeypatch.setattr(gc, 'get_objects', get_objects)
+    monkeypatch.undo()
+    stats = prof.get_stats()
+    assert len(sampled) > 1 << 16
+    names = list(stats.adr_dict.values())
+    assert sum('py:churned_' in name for name in names) == len(sampled)
+    assert not any('never_run_' in name for name in names)
+
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+def test_read_profile_aggregated():
+    prof = vmprof.Profiler()
+    with prof.measure(period=0.0005):
+        function_foo()
+        function_bar()
+    full = read_profile(prof.ctx.filename)
+    aggregated = read_profile(prof.ctx.filename, aggregate=True)
+    assert len(aggregated.profiles) < len(full.profiles)
+    assert (sum(p[1] for p in aggregated.profiles) ==
+            sum(p[1] for p in full.profiles))
+    assert dict(aggregated.top_profile()) == dict(full.top_profile())
+    assert aggregated.get_tree().count == full.get_tree().count
+    assert aggregated.adr_dict == full.adr_dict
+    assert aggregated.end_time == full.end_time
+
+
+def function_allocating():
+    return [bytearray(1024) for _ in range(20000)]
+
 @pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
 @pytest.mark.skipif("sys.platform == 'win32'")
-@pytest.mark.skip("seems to crash")
+def test_vmprof_allocation_sampling():
+    prof = vmprof.Profiler()
+    with prof.measure(alloc_sample_bytes=64 * 1024):
+        function_allocating()
+    stats = prof.get_stats()
+    assert stats.meta['alloc_sample_bytes'] == str(64 * 1024)
+    # ~20MB were allocated, expect about 300 samples
+    assert len(stats.allocations) > 50
+    names = set()
+    for trace, size, thread_id in stats.allocations:
+        assert size > 0
+        for addr in trace:
+            if addr in stats.adr_dict:
+                names.add(stats.adr_dict[addr].split(':')[1])
+    assert 'function_allocating' in names
+
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_vmprof_compress():
+    native = sys.platform.startswith('linux')
+    prof = vmprof.Profiler()
+    with prof.measure(native=native, compress=True):
+        function_foo()
+    with open(prof.ctx.filename, 'rb') as fd:
+        assert fd.read(2) == b'\x1f\x8b'
+    stats = prof.get_stats()
+    assert stats.end_time is not None
+    names = set()
+    native_names = set()
+    for trace, count, thread_id, mem in stats.profiles:
+        for addr in trace:
+            if addr in stats.adr_dict:
+                names.add(stats.get_addr_info(addr)[1])
+                if isinstance(addr, NativeCode):
+                    native_names.add(stats.get_addr_info(addr)[1])
+    assert 'function_foo' in names
+    if native:
+        # the native symbols were appended as another gzip member
+        assert native_names
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_vmprof_compress_cut_short(tmpdir):
+    # a copy taken while profiling ends within a gzip member, it is
+    # read up to the last complete one
+    filename = str(tmpdir.join('profile.prof'))
+    copy = str(tmpdir.join('copy.prof'))
+    with open(filename, 'w+b') as fileobj:
+        vmprof.enable(fileobj.fileno(), compress=True)
+        t0 = time.time()
+        while time.time() - t0 < 2.5:
+            function_foo()
+        with open(filename, 'rb') as src:
+            data = src.read()
+        vmprof.disable()
+    with open(copy, 'wb') as dst:
+        dst.write(data)
+    stats = read_profile(copy)
+    assert stats.end_time is None
+    assert stats.profiles
+    if sys.version_info >= (3, 13):
+        # before, a pending call scheduled by the writer thread only runs
+        # at the next switch of threads, the code objects were not
+        # written yet
+        assert 'function_foo' in _sampled_names(stats)
+
+
+def function_after_rotation():
+    return function_foo()
+
+def _sampled_names(stats):
+    names = set()
+    for trace, count, thread_id, mem in stats.profiles:
+        for addr in trace:
+            if addr in stats.adr_dict:
+                names.add(stats.get_addr_info(addr)[1])
+    return names
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_timestamps():
+    prof = vmprof.Profiler()
+    with prof.measure(timestamps=True):
+        t0 = time.time()
+        function_foo()
+        middle = time.time() - t0
+        function_after_rotation()
+        end = time.time() - t0
+    filename = prof.ctx.filename
+    stats = prof.get_stats()
+    assert len(stats.timestamps) == len(stats.profiles) > 0
+    last = {}
+    for (trace, count, thread_id, mem), (t, cpu) in zip(stats.profiles, stats.timestamps):
+        assert 0 <= t < end + 0.1
+        assert t >= last.get(thread_id, 0)
+        last[thread_id] = t
+        if sys.platform.startswith('linux'):
+            assert cpu >= 0
+    first = stats.slice(0, middle - 0.05)
+    assert 0 < len(first.profiles) < len(stats.profiles)
+    assert 'function_foo' in _sampled_names(first)
+    assert 'function_after_rotation' not in _sampled_names(first)
+    second = stats.slice(middle + 0.05, end + 1)
+    assert 'function_after_rotation' in _sampled_names(second)
+    # aggregated, the times are dropped
+    aggregated = read_profile(filename, aggregate=True)
+    assert sum(count for _, count, _, _ in aggregated.profiles) == len(stats.profiles)
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("not sys.platform.startswith('linux')")
+@pytest.mark.skipif("sys.version_info < (3, 8)")
+def test_thread_info():
+    import threading
+    worked = threading.Event()
+    done = threading.Event()
+    def worker():
+        function_foo()
+        worked.set()
+        done.wait()
+    thread = threading.Thread(target=worker, name='vmprof-worker')
+    prof = vmprof.Profiler()
+    with prof.measure():
+        thread.start()
+        function_after_rotation()
+        worked.wait()
+        # the names are looked up while both threads are alive
+        t0 = time.time()
+        while time.time() - t0 < 0.3:
+            pass
+        done.set()
+        thread.join()
+    filename = prof.ctx.filename
+    stats = prof.get_stats()
+    thread_ids = set(thread_id for _, _, thread_id, _ in stats.profiles)
+    assert thread.native_id in thread_ids
+    assert thread_ids <= set(stats.thread_info)
+    assert stats.thread_info[thread.native_id][0] == 'vmprof-worker'
+    assert stats.thread_info[threading.main_thread().native_id][0] == 'MainThread'
+    assert all(native_name for _, native_name in stats.thread_info.values())
+    aggregated = read_profile(filename, aggregate=True)
+    assert aggregated.thread_info == stats.thread_info
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_rotate(tmpdir):
+    native = sys.platform.startswith('linux')
+    first = open(str(tmpdir.join('first.prof')), 'w+b')
+    second = open(str(tmpdir.join('second.prof')), 'w+b')
+    vmprof.enable(first.fileno(), native=native)
+    function_foo()
+    assert vmprof.rotate(second.fileno()) == first.fileno()
+    function_after_rotation()
+    vmprof.disable()
+    first.close()
+    second.close()
+
+    stats = read_profile(first.name)
+    assert stats.end_time is not None
+    names = _sampled_names(stats)
+    assert 'function_foo' in names
+    assert 'function_after_rotation' not in names
+    # every segment stands on its own
+    stats = read_profile(second.name)
+    assert stats.start_time >= read_profile(first.name).end_time
+    assert 'function_after_rotation' in _sampled_names(stats)
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+def test_rotating_profiler(tmpdir):
+    segments = []
+    pattern = str(tmpdir.join('segment-%d.prof'))
+    with vmprof.RotatingProfiler(pattern, interval=0.2, on_segment=segments.append,
+                                 compress=True):
+        t0 = time.time()
+        while time.time() - t0 < 0.7:
+            function_foo()
+    assert len(segments) >= 3
+    assert segments[0] == pattern % 0
+    for filename in segments:
+        stats = read_profile(filename)
+        assert stats.end_time is not None
+        assert 'function_foo' in _sampled_names(stats)
+
+@pytest.mark.skipif("'__pypy__' in sys.builtin_module_names")
+@pytest.mark.skipif("sys.platform == 'win32'")
+# the pthread_kill() broadcast used elsewhere seems to crash
+@pytest.mark.skipif("not sys.platform.startswith('linux')")
 def test_vmprof_real_time_many_threads():
     import threading
     prof = vmprof.Profiler()
@@ -442,6 +848,164 @@ def read_header(fileobj, buffer_so_far=None):
                         profile_lines)
 
 
+def _interpreter_mappings():
+    # what vmprof considers the interpreter, see _ignore_symbols_from_path
+    ranges = []
+    with open('/proc/self/maps') as maps:
+        for line in maps:
+            fields = line.split()
+            if len(fields) < 6:
+                continue
+            if 'python' in fields[5] and not fields[5].endswith('.so'):
+                start, end = fields[0].split('-')
+                ranges.append((int(start, 16), int(end, 16)))
+    return ranges
+
+@pytest.mark.skipif("not sys.platform.startswith('linux') or IS_PYPY")
+def test_native_skip_interpreter():
+    prof = vmprof.Profiler()
+    with prof.measure(native=True, native_skip_interpreter=True):
+        function_bar()
+    stats = prof.get_stats()
+    assert stats.meta.get('native_skip_interpreter') == '1'
+    assert stats.get_tree()
+    ranges = _interpreter_mappings()
+    assert ranges
+    for profile in stats.profiles:
+        for addr in profile[0]:
+            if isinstance(addr, NativeCode):
+                assert not any(start <= addr < end for start, end in ranges)
+
+@pytest.mark.skipif("not hasattr(_vmprof, 'resolve_many_addr')")
+def test_resolve_many_addr_matches_resolve_addr():
+    import ctypes
+    libc = ctypes.CDLL(None)
+    addrs = [ctypes.cast(getattr(libc, name), ctypes.c_void_p).value
+             for name in ('abs', 'malloc', 'strlen')]
+    addrs.append(addrs[0])
+    res = _vmprof.resolve_many_addr(addrs)
+    assert len(res) == 3
+    for addr in addrs:
+        assert res[addr][:2] == _vmprof.resolve_addr(addr)[:2]
+    assert res[addrs[0]][0] == 'abs'
+    # without debug info, the shared object stands in for the source file
+    assert 'libc' in res[addrs[0]][2]
+    assert _vmprof.resolve_many_addr([]) == {}
+
+@pytest.mark.skipif("not sys.platform.startswith('linux') or IS_PYPY")
+def test_symbol_cache(tmpdir):
+    import ctypes
+    libc = ctypes.CDLL(None)
+    addr = ctypes.cast(libc.abs, ctypes.c_void_p).value
+    vmprof.set_symbol_cache(str(tmpdir.join('symbols')))
+    try:
+        assert vmprof.resolve_many_addr([addr])[addr][0] == 'abs'
+        files = tmpdir.join('symbols').listdir()
+        assert len(files) == 1 and files[0].basename.endswith('.sym')
+        # build id and offset find the entry, the debug info is not read
+        offset, lineno, name, srcfile = files[0].read().splitlines()[0].split('\t')
+        assert name == 'abs'
+        files[0].write('%s\t7\tcached_abs\t%s\n' % (offset, srcfile))
+        assert _vmprof.resolve_addr(addr)[:2] == ('cached_abs', 7)
+    finally:
+        vmprof.set_symbol_cache(None)
+    assert _vmprof.resolve_addr(addr)[0] == 'abs'
+
+@pytest.mark.skipif("not sys.platform.startswith('linux') or IS_PYPY")
+def test_offline_symbolization():
+    from vmprof.symbolize import symbolize
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), native=True)
+    function_bar()
+    vmprof.disable(resolve_native=False)
+    tmpfile.close()
+
+    stats = read_profile(tmpfile.name)
+    assert stats.meta  # a complete profile, trailer included
+    assert stats.end_time is not None
+    natives = set(addr for profile in stats.profiles for addr in profile[0]
+                  if isinstance(addr, NativeCode))
+    assert natives
+    assert not natives & set(stats.adr_dict)
+    from vmprof.reader import _read_prof
+    state = _read_prof(open(tmpfile.name, "rb"))
+    assert any(path.endswith('.so') or 'python' in path
+               for start, end, base, build_id, path in state.module_maps)
+
+    resolved, count = symbolize(tmpfile.name)
+    assert count == len(natives)
+    assert resolved > 0
+    stats = read_profile(tmpfile.name)
+    assert stats.end_time is not None
+    assert natives <= set(stats.adr_dict)
+    names = [stats.get_name(addr) for addr in natives]
+    assert any(not name.startswith('<native symbol') for name in names)
+    # nothing is left to do
+    assert symbolize(tmpfile.name) == (0, 0)
+
+@pytest.mark.skipif("not sys.platform.startswith('linux') or IS_PYPY")
+def test_native_lines():
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), lines=True, native=True, native_lines=True)
+    function_bar()
+    vmprof.disable()
+    tmpfile.close()
+
+    stats = read_profile(tmpfile.name)
+    assert stats.meta.get('native_lines') == '1'
+    functions = {}
+    for profile in stats.profiles:
+        for addr in profile[0]:
+            if isinstance(addr, NativeCode) and addr in stats.adr_dict:
+                lang, symbol, line, srcfile = stats.get_addr_info(addr)
+                if not symbol.startswith('<native symbol'):
+                    functions.setdefault((symbol, srcfile), set()).add(addr)
+    assert functions
+    # one address per native function is left
+    assert all(len(addrs) == 1 for addrs in functions.values())
+    assert stats.get_tree()
+
+@pytest.mark.skipif("not sys.platform.startswith('linux') or IS_PYPY")
+def test_native_cache_stats():
+    prof = vmprof.Profiler()
+    with prof.measure(native=True):
+        function_bar()
+    stats = vmprof.native_cache_stats()
+    assert stats['size'] > 0
+    assert stats['misses'] > 0
+    # the same frames are seen by many samples
+    assert stats['hits'] > stats['misses']
+
+@pytest.mark.skipif("not sys.platform.startswith('linux') or platform.machine() != 'x86_64' or IS_PYPY")
+def test_native_frame_pointer_unwinder():
+    import threading
+    prof = vmprof.Profiler()
+    with prof.measure(native=True, native_unwinder='frame_pointer'):
+        # the stack of this thread is unknown, the walk must not leave
+        # the interrupted frame
+        thread = threading.Thread(target=function_foo)
+        thread.start()
+        function_bar()
+        thread.join()
+    stats = prof.get_stats()
+    assert stats.meta.get('native_unwinder') == 'frame_pointer'
+    assert any(isinstance(addr, NativeCode)
+               for profile in stats.profiles for addr in profile[0])
+    # without frame pointers in the interpreter, python frames are still there
+    def names(tree):
+        yield tree.name
+        for child in tree.children.values():
+            for name in names(child):
+                yield name
+    assert any('function_foo' in name for name in names(stats.get_tree()))
+
+@pytest.mark.skipif("IS_PYPY")
+def test_native_unwinder_unknown():
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    with pytest.raises(ValueError):
+        vmprof.enable(tmpfile.fileno(), native=True, native_unwinder='dwarf')
+    tmpfile.close()
+
 @pytest.mark.skipif("IS_PYPY")
 def test_line_profiling():
     tmpfile = tempfile.NamedTemporaryFile(delete=False)
@@ -459,6 +1023,33 @@ def test_line_profiling():
     stats = read_profile(tmpfile.name)
     walk(stats.get_tree())
 
+@pytest.mark.skipif("IS_PYPY")
+def test_line_profiling_resolves_offsets():
+    import inspect
+    tmpfile = tempfile.NamedTemporaryFile(delete=False)
+    vmprof.enable(tmpfile.fileno(), lines=True, native=False)
+    function_foo()
+    vmprof.disable()
+    tmpfile.close()
+
+    source, first = inspect.getsourcelines(function_foo)
+    last = first + len(source) - 1
+    stats = read_profile(tmpfile.name)
+    assert stats.profile_lines
+    def walk(tree):
+        if 'function_foo' in tree.name:
+            yield tree
+        for v in six.itervalues(tree.children):
+            for node in walk(v):
+                yield node
+
+    nodes = list(walk(stats.get_tree()))
+    assert nodes
+    lines = [line for node in nodes for line in node.lines]
+    assert lines
+    for line in lines:
+        assert first <= line <= last
+
 def test_vmprof_show():
     tmpfile = tempfile.NamedTemporaryFile(delete=False)
     vmprof.enable(tmpfile.fileno())
@@ -475,6 +1066,7 @@ class TestNative(object):
         ffi = FFI()
         ffi.cdef("""
         void native_gzipgzipgzip(void);
+        int native_spin(int);
         """)
         source = """
         #include "zlib.h"
@@ -498,6 +1090,19 @@ class TestNative(object):
             }
             deflateEnd(&defstream);
         }
+        static int __attribute__((noinline)) native_spin_inner(int n) {
+            volatile int i, sum = 0;
+            for (i = 0; i < n; i++) {
+                sum += i;
+            }
+            return sum;
+        }
+        static int __attribute__((noinline)) native_spin_outer(int n) {
+            return native_spin_inner(n) + 1;
+        }
+        int native_spin(int n) {
+            return native_spin_outer(n) + 1;
+        }
         """
         libs = []
         if sys.platform.startswith('linux'):
@@ -505,7 +1110,8 @@ class TestNative(object):
         # trick: compile with _CFFI_USE_EMBEDDING=1 which will not define Py_LIMITED_API
         ffi.set_source("vmprof.test._test_native_gzip", source, include_dirs=['src'],
                        define_macros=[('_CFFI_USE_EMBEDDING',1),('_PY_TEST',1)], libraries=libs,
-                       extra_compile_args=['-Werror', '-g', '-O0'])
+                       extra_compile_args=['-Werror', '-g', '-O0',
+                                           '-fno-omit-frame-pointer'])
 
         ffi.compile(verbose=True)
         from vmprof.test import _test_native_gzip as clib
@@ -542,6 +1148,32 @@ class TestNative(object):
         parent = stats.get_tree()
         assert walk(parent)
 
+    @pytest.mark.skipif("not sys.platform.startswith('linux') or "
+                        "platform.machine() != 'x86_64' or IS_PYPY")
+    def test_frame_pointer_unwinding_in_worker_thread(self):
+        import threading
+        registered = []
+        def worker():
+            registered.append(vmprof.register_native_thread())
+            t0 = time.time()
+            while time.time() - t0 < 0.5:
+                self.lib.native_spin(100000)
+        with tempfile.NamedTemporaryFile() as f:
+            # the default mode, in which insert_real_time_thread() fails
+            vmprof.enable(f.fileno(), 0.001, native=True,
+                          native_unwinder='frame_pointer')
+            t = threading.Thread(target=worker)
+            t.start()
+            t.join()
+            vmprof.disable()
+            stats = read_profile(f.name)
+        assert registered == [True]
+        # native_spin_inner, native_spin_outer, native_spin, ...
+        depths = [sum(isinstance(addr, NativeCode) for addr in profile[0])
+                  for profile in stats.profiles if profile[2] == t.native_id]
+        assert depths and max(depths) > 1
+        assert vmprof.register_native_thread() == False
+
     def test_is_enabled(self):
         assert vmprof.is_enabled() == False
         tmpfile = tempfile.NamedTemporaryFile(delete=False)
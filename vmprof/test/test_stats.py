@@ -23,6 +23,17 @@ def test_tree_basic():
         2: Node(2, 'bar', 1),
         3: Node(3, 'baz', 1)})
 
+def test_tree_weighted():
+    # aggregated profiles carry the number of samples in the count
+    profiles = [([1, 2], 2, 1),
+                ([1, 3], 1, 1)]
+    stats = Stats(profiles, adr_dict={1: 'foo', 2: 'bar', 3: 'baz'})
+    tree = stats.get_tree()
+    assert tree == Node(1, 'foo', 3, {
+        2: Node(2, 'bar', 2),
+        3: Node(3, 'baz', 1)})
+    assert dict(stats.top_profile()) == {'foo': 3, 'bar': 2, 'baz': 1}
+
 def test_tree_jit():
     profiles = [([1], 1, 1),
                 ([1, AssemblerCode(100), JittedCode(1)], 1, 1)]